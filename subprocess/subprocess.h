@@ -1,8 +1,16 @@
 #pragma once
 
+#include "subprocess/async.h"
 #include "subprocess/basic_types.hpp"
 #include "subprocess/builder.h"
 #include "subprocess/environ.h"
 #include "subprocess/pipe.h"
+#include "subprocess/pipeline.h"
+#include "subprocess/process_pool.h"
+#include "subprocess/reactor.h"
+#include "subprocess/run_many.h"
 #include "subprocess/shellutils.h"
-#include "subprocess/utf8_to_utf16.h"
\ No newline at end of file
+#include "subprocess/spawn_template.h"
+#include "subprocess/trace.h"
+#include "subprocess/utf8_to_utf16.h"
+#include "subprocess/wait.h"
\ No newline at end of file
@@ -0,0 +1,338 @@
+#include "async.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+
+#include "reactor.h"
+#include "trace.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+namespace subprocess
+{
+
+namespace
+{
+std::mutex g_executor_mutex;
+std::shared_ptr<const Executor> g_executor;
+
+/** @brief Resumes the awaiting coroutine once an IoCompletion is done. */
+class AsyncCompletion
+{
+public:
+    explicit AsyncCompletion(std::shared_ptr<IoCompletion> completion) : m_completion(std::move(completion))
+    {
+    }
+
+    [[nodiscard]] bool await_ready() const
+    {
+        return m_completion->is_done();
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle)
+    {
+        return m_completion->notify([handle] { details::async_resume(handle); });
+    }
+
+    void await_resume() const noexcept
+    {
+    }
+
+private:
+    std::shared_ptr<IoCompletion> m_completion;
+};
+} // namespace
+
+void set_async_executor(Executor executor)
+{
+    std::shared_ptr<const Executor> value;
+    if (executor)
+    {
+        value = std::make_shared<const Executor>(std::move(executor));
+    }
+
+    std::lock_guard lock(g_executor_mutex);
+    g_executor = std::move(value);
+}
+
+void details::async_resume(std::coroutine_handle<> handle)
+{
+    std::shared_ptr<const Executor> executor;
+    {
+        std::lock_guard lock(g_executor_mutex);
+        executor = g_executor;
+    }
+
+    if (executor)
+    {
+        (*executor)(handle);
+    }
+    else
+    {
+        handle.resume();
+    }
+}
+
+/**
+ * @brief Performs the read or write of an AsyncIo once its pipe is ready.
+ * The pipe belongs to the awaiter.
+ */
+class AsyncIoTransfer final : public IoTransfer
+{
+public:
+    AsyncIoTransfer(AsyncIo& io, std::coroutine_handle<> handle) : m_io(io), m_handle(handle)
+    {
+    }
+
+    [[nodiscard]] PipeHandle handle() const override
+    {
+        return m_io.m_handle;
+    }
+
+    [[nodiscard]] bool is_write() const override
+    {
+        return m_io.m_write;
+    }
+
+    IoStatus on_ready() override
+    {
+        ssize_t transfered = 0;
+        if (m_io.m_write)
+        {
+            transfered = pipe_write(m_io.m_handle, m_io.m_buffer, m_io.m_size);
+            if (transfered == 0)
+            {
+                return IoStatus::blocked;
+            }
+        }
+        else
+        {
+            transfered = pipe_read(m_io.m_handle, m_io.m_buffer, m_io.m_size);
+            if (transfered < 0 && pipe_would_block())
+            {
+                return IoStatus::blocked;
+            }
+        }
+
+        // The awaiter may be gone as soon as the coroutine resumes.
+        m_io.m_result = transfered;
+        details::async_resume(m_handle);
+        return IoStatus::done;
+    }
+
+private:
+    AsyncIo& m_io;
+    std::coroutine_handle<> m_handle;
+};
+
+void AsyncIo::await_suspend(std::coroutine_handle<> handle)
+{
+    IoReactor::instance().add(std::make_unique<AsyncIoTransfer>(*this, handle));
+}
+
+bool AsyncWait::await_ready()
+{
+    return m_popen.pid == 0U || m_popen.poll();
+}
+
+#ifdef _WIN32
+/** @brief Shared by await_suspend and the wait callback, the later of them frees it. */
+struct AsyncWaitContext
+{
+    AsyncWait* awaiter;
+    std::coroutine_handle<> handle;
+    HANDLE wait{nullptr};
+    std::atomic<bool> released{false};
+
+    void release()
+    {
+        if (released.exchange(true))
+        {
+            (void)UnregisterWait(wait);
+            delete this; // NOLINT
+        }
+    }
+
+    static void CALLBACK on_exit(PVOID parameter, BOOLEAN /*timed_out*/)
+    {
+        auto* context = static_cast<AsyncWaitContext*>(parameter);
+        try
+        {
+            (void)context->awaiter->m_popen.wait();
+        }
+        catch (...)
+        {
+            context->awaiter->m_error = std::current_exception();
+        }
+        details::async_resume(context->handle);
+        context->release();
+    }
+};
+
+void AsyncWait::await_suspend(std::coroutine_handle<> handle)
+{
+    auto* context = new AsyncWaitContext{this, handle}; // NOLINT
+    if (!RegisterWaitForSingleObject(&context->wait, m_popen.process_info.hProcess, &AsyncWaitContext::on_exit,
+                                     context, INFINITE, WT_EXECUTEONLYONCE))
+    {
+        delete context; // NOLINT
+        throw OSError("RegisterWaitForSingleObject failed: " + LastErrorString());
+    }
+    context->release();
+}
+#else
+/** @brief Reaps the process of an AsyncWait once its pidfd is readable. */
+class AsyncWaitTransfer final : public IoTransfer
+{
+public:
+    AsyncWaitTransfer(AsyncWait& awaiter, std::coroutine_handle<> handle, PipeHandle pidfd)
+        : m_awaiter(awaiter), m_handle(handle), m_pidfd(pidfd)
+    {
+    }
+
+    ~AsyncWaitTransfer() override
+    {
+        (void)pipe_close(m_pidfd);
+    }
+
+    AsyncWaitTransfer(const AsyncWaitTransfer&) = delete;
+    AsyncWaitTransfer& operator=(const AsyncWaitTransfer&) = delete;
+
+    [[nodiscard]] PipeHandle handle() const override
+    {
+        return m_pidfd;
+    }
+
+    [[nodiscard]] bool is_write() const override
+    {
+        return false;
+    }
+
+    IoStatus on_ready() override
+    {
+        resume(m_awaiter, m_handle);
+        return IoStatus::done;
+    }
+
+    static void resume(AsyncWait& awaiter, std::coroutine_handle<> handle)
+    {
+        try
+        {
+            (void)awaiter.m_popen.wait();
+        }
+        catch (...)
+        {
+            awaiter.m_error = std::current_exception();
+        }
+        details::async_resume(handle);
+    }
+
+private:
+    AsyncWait& m_awaiter;
+    std::coroutine_handle<> m_handle;
+    PipeHandle m_pidfd;
+};
+
+void AsyncWait::await_suspend(std::coroutine_handle<> handle)
+{
+    int pidfd = -1;
+#ifdef SYS_pidfd_open
+    pidfd = static_cast<int>(syscall(SYS_pidfd_open, m_popen.pid, 0));
+#endif
+
+    if (pidfd >= 0)
+    {
+        IoReactor::instance().add(std::make_unique<AsyncWaitTransfer>(*this, handle, pidfd));
+    }
+    else
+    {
+        std::thread([this, handle] { AsyncWaitTransfer::resume(*this, handle); }).detach();
+    }
+}
+#endif
+
+AsyncWait Popen::async_wait()
+{
+    return AsyncWait(*this);
+}
+
+Task<CompletedProcess> async_run(CommandLine command, RunOptions options)
+{
+    if (options.timeout >= 0.0)
+    {
+        throw std::invalid_argument("async_run: timeout is not supported");
+    }
+
+    CompletedProcess completed;
+    completed.cout.reserve(options.cout_size_hint);
+    completed.cerr.reserve(options.cerr_size_hint);
+
+    // Takes the command, and only the cin data of options, the rest of them stays usable.
+    Popen popen(std::move(command), std::move(options));
+    auto captures = std::make_shared<IoCompletion>();
+
+    // The reactor owns the captured pipes from now on.
+    if (popen.cout != kBadPipeValue)
+    {
+        IoReactor::instance().add(std::make_unique<PipeToString>(popen.cout, completed.cout), captures);
+        popen.cout = kBadPipeValue;
+    }
+
+    if (popen.cerr != kBadPipeValue)
+    {
+        IoReactor::instance().add(std::make_unique<PipeToString>(popen.cerr, completed.cerr), captures);
+        popen.cerr = kBadPipeValue;
+    }
+
+    // The captures write into completed, so they are waited for even if waiting for the child failed.
+    std::exception_ptr error;
+    try
+    {
+        completed.returncode = co_await popen.async_wait();
+    }
+    catch (...)
+    {
+        error = std::current_exception();
+        (void)popen.kill();
+    }
+
+    // Output is complete once the child and whatever inherited its pipes closed them, like in run(). The
+    // redirections of popen, e.g. callbacks, Tee or cin data, are awaited too: close() would block on them, and if
+    // this runs on a reactor worker, that worker may be the one servicing them.
+    co_await AsyncCompletion(captures);
+    if (std::shared_ptr<IoCompletion> streams = std::exchange(popen.m_streams, nullptr); streams)
+    {
+        co_await AsyncCompletion(std::move(streams));
+    }
+    SUBPROCESS_TRACE_COUNT(TraceCounter::cout_bytes, completed.cout.size());
+    SUBPROCESS_TRACE_COUNT(TraceCounter::cerr_bytes, completed.cerr.size());
+    if (!error)
+    {
+        completed.usage = popen.resource_usage();
+        completed.cout_file = popen.mapped_cout();
+        completed.cerr_file = popen.mapped_cerr();
+    }
+    completed.argv = popen.argv();
+    completed.args = std::move(popen.args);
+    popen.close();
+
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+
+    if (options.raise_on_nonzero && completed.returncode != 0)
+    {
+        throw CalledProcessError{"failed to execute " + completed.args[0U], completed.args, completed.returncode,
+                                 completed.cout, completed.cerr};
+    }
+    co_return completed;
+}
+
+} // namespace subprocess
@@ -0,0 +1,454 @@
+#pragma once
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <semaphore>
+#include <span>
+#include <utility>
+
+#include "builder.h"
+
+namespace subprocess
+{
+
+/**
+ * @brief Resumes a suspended coroutine, see set_async_executor().
+ */
+using Executor = std::function<void(std::coroutine_handle<>)>;
+
+/**
+ * @brief Sets where coroutines suspended on the awaitables of this library
+ * are resumed.
+ *
+ * The awaitables are completed by IoReactor workers, or by the Windows
+ * thread pool for AsyncWait. By default coroutines are resumed right there,
+ * so they must not block for long, as other transfers wait meanwhile. They
+ * must not block on a transfer at all, i.e. call Popen::wait_streams(), or
+ * Popen::close() of a Popen with redirections, communicate(), run() or
+ * sync_wait(): the transfer may belong to the very worker that is blocked,
+ * which deadlocks. Set an executor that hands the coroutine to a thread
+ * pool or event loop to do any of that.
+ *
+ * @param executor The new executor, empty to resume inline again.
+ */
+void set_async_executor(Executor executor);
+
+template <typename T>
+class Task;
+
+namespace details
+{
+/** @brief Resumes handle with the executor set by set_async_executor(). */
+void async_resume(std::coroutine_handle<> handle);
+
+struct TaskPromiseBase
+{
+    struct FinalAwaiter
+    {
+        [[nodiscard]] bool await_ready() const noexcept
+        {
+            return false;
+        }
+
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            return handle.promise().continuation;
+        }
+
+        void await_resume() const noexcept
+        {
+        }
+    };
+
+    [[nodiscard]] std::suspend_always initial_suspend() const noexcept
+    {
+        return {};
+    }
+
+    [[nodiscard]] FinalAwaiter final_suspend() const noexcept
+    {
+        return {};
+    }
+
+    void unhandled_exception() noexcept
+    {
+        error = std::current_exception();
+    }
+
+    std::coroutine_handle<> continuation{std::noop_coroutine()};
+    std::exception_ptr error;
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase
+{
+    Task<T> get_return_object();
+
+    void return_value(T result)
+    {
+        value.emplace(std::move(result));
+    }
+
+    T result()
+    {
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+        return std::move(*value);
+    }
+
+    std::optional<T> value;
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase
+{
+    Task<void> get_return_object();
+
+    void return_void() const noexcept
+    {
+    }
+
+    void result() const
+    {
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+/** @brief The coroutine sync_wait() runs a Task from. */
+class SyncWaiter
+{
+public:
+    struct promise_type
+    {
+        struct FinalAwaiter
+        {
+            [[nodiscard]] bool await_ready() const noexcept
+            {
+                return false;
+            }
+
+            void await_suspend(std::coroutine_handle<promise_type> handle) const noexcept
+            {
+                handle.promise().done->release();
+            }
+
+            void await_resume() const noexcept
+            {
+            }
+        };
+
+        SyncWaiter get_return_object()
+        {
+            return SyncWaiter(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        [[nodiscard]] std::suspend_always initial_suspend() const noexcept
+        {
+            return {};
+        }
+
+        [[nodiscard]] FinalAwaiter final_suspend() const noexcept
+        {
+            return {};
+        }
+
+        void return_void() const noexcept
+        {
+        }
+
+        void unhandled_exception() const noexcept
+        {
+            std::terminate();
+        }
+
+        std::binary_semaphore* done{nullptr};
+    };
+
+    explicit SyncWaiter(std::coroutine_handle<promise_type> handle) : m_handle(handle)
+    {
+    }
+
+    ~SyncWaiter()
+    {
+        m_handle.destroy();
+    }
+
+    SyncWaiter(const SyncWaiter&) = delete;
+    SyncWaiter& operator=(const SyncWaiter&) = delete;
+
+    /** @brief Runs the coroutine, done is released once it finished. */
+    void start(std::binary_semaphore& done)
+    {
+        m_handle.promise().done = &done;
+        m_handle.resume();
+    }
+
+private:
+    std::coroutine_handle<promise_type> m_handle;
+};
+} // namespace details
+
+/**
+ * @brief A lazily started coroutine producing a T.
+ *
+ * The coroutine starts when the task is co_await'ed, or passed to
+ * sync_wait(), and the awaiting coroutine is resumed where it finishes.
+ * Exceptions escaping the coroutine are rethrown to the awaiter.
+ *
+ * @code
+ * subprocess::Task<std::string> hello()
+ * {
+ *     subprocess::CompletedProcess completed =
+ *         co_await subprocess::async_run({"echo", "hello"}, {.cout = PipeOption::pipe});
+ *     co_return completed.cout;
+ * }
+ * @endcode
+ */
+template <typename T = void>
+class [[nodiscard]] Task
+{
+public:
+    using promise_type = details::TaskPromise<T>;
+
+    Task() = default;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : m_handle(handle)
+    {
+    }
+
+    ~Task()
+    {
+        if (m_handle)
+        {
+            m_handle.destroy();
+        }
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    Task(Task&& other) noexcept : m_handle(std::exchange(other.m_handle, {}))
+    {
+    }
+
+    Task& operator=(Task&& other) noexcept
+    {
+        if (this != &other)
+        {
+            if (m_handle)
+            {
+                m_handle.destroy();
+            }
+            m_handle = std::exchange(other.m_handle, {});
+        }
+        return *this;
+    }
+
+    auto operator co_await() && noexcept
+    {
+        struct Awaiter
+        {
+            [[nodiscard]] bool await_ready() const noexcept
+            {
+                return !handle || handle.done();
+            }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept
+            {
+                handle.promise().continuation = continuation;
+                return handle;
+            }
+
+            T await_resume()
+            {
+                return handle.promise().result();
+            }
+
+            std::coroutine_handle<promise_type> handle;
+        };
+        return Awaiter{m_handle};
+    }
+
+    template <typename U>
+    friend U sync_wait(Task<U> task);
+
+private:
+    /** @brief Runs the task to completion, without taking its result. */
+    details::SyncWaiter run()
+    {
+        struct Awaiter
+        {
+            [[nodiscard]] bool await_ready() const noexcept
+            {
+                return handle.done();
+            }
+
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept
+            {
+                handle.promise().continuation = continuation;
+                return handle;
+            }
+
+            void await_resume() const noexcept
+            {
+            }
+
+            std::coroutine_handle<promise_type> handle;
+        };
+        co_await Awaiter{m_handle};
+    }
+
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+template <typename T>
+Task<T> details::TaskPromise<T>::get_return_object()
+{
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> details::TaskPromise<void>::get_return_object()
+{
+    return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+/**
+ * @brief Runs a task from ordinary code, blocking until it finished.
+ * @return The result of the task.
+ * @throws Whatever the task threw.
+ */
+template <typename T>
+T sync_wait(Task<T> task)
+{
+    std::binary_semaphore done{0};
+    details::SyncWaiter waiter = task.run();
+    waiter.start(done);
+    done.acquire();
+    return task.m_handle.promise().result();
+}
+
+/**
+ * @brief Awaitable single read or write of a pipe, see async_read() and
+ * async_write().
+ */
+class AsyncIo
+{
+public:
+    AsyncIo(PipeHandle handle, char* buffer, std::size_t size, bool write)
+        : m_handle(handle), m_buffer(buffer), m_size(size), m_write(write)
+    {
+    }
+
+    [[nodiscard]] bool await_ready() const noexcept
+    {
+        return m_size == 0U || m_handle == kBadPipeValue;
+    }
+
+    void await_suspend(std::coroutine_handle<> handle);
+
+    [[nodiscard]] ssize_t await_resume() const noexcept
+    {
+        return m_result;
+    }
+
+private:
+    friend class AsyncIoTransfer;
+
+    PipeHandle m_handle;
+    char* m_buffer;
+    std::size_t m_size;
+    bool m_write;
+    ssize_t m_result{-1};
+};
+
+/**
+ * @brief Reads from a pipe once data is available, for use with co_await.
+ *
+ * The pipe is watched by the IoReactor, no thread waits for it. It is made
+ * non-blocking and stays so.
+ *
+ * @param handle The pipe to read, e.g. Popen::cout.
+ * @param buffer Receives the data, must stay valid until resumed.
+ * @return co_await yields the number of bytes read, 0 on end-of-file, and
+ * -1 on error.
+ */
+[[nodiscard]] inline AsyncIo async_read(PipeHandle handle, std::span<char> buffer)
+{
+    return {handle, buffer.data(), buffer.size(), false};
+}
+
+/**
+ * @brief Writes to a pipe once it has room, for use with co_await.
+ *
+ * Like async_read(), written may be less than buffer.
+ *
+ * @param handle The pipe to write, e.g. Popen::cin.
+ * @param buffer The data, must stay valid until resumed.
+ * @return co_await yields the number of bytes written, or -1 on error, e.g.
+ * if the reader closed the pipe.
+ */
+[[nodiscard]] inline AsyncIo async_write(PipeHandle handle, std::span<const char> buffer)
+{
+    // Only read by the transfer for a write.
+    return {handle, const_cast<char*>(buffer.data()), buffer.size(), true}; // NOLINT
+}
+
+/**
+ * @brief Awaitable exit of a process, see Popen::async_wait().
+ *
+ * On Linux the process is watched through a pidfd polled by the IoReactor,
+ * and on Windows with RegisterWaitForSingleObject. Elsewhere, or before
+ * Linux 5.3, a thread is borrowed to wait for the process.
+ */
+class AsyncWait
+{
+public:
+    explicit AsyncWait(Popen& popen) : m_popen(popen)
+    {
+    }
+
+    [[nodiscard]] bool await_ready();
+
+    void await_suspend(std::coroutine_handle<> handle);
+
+    int64_t await_resume() const
+    {
+        if (m_error)
+        {
+            std::rethrow_exception(m_error);
+        }
+        return m_popen.returncode;
+    }
+
+private:
+    friend class AsyncWaitTransfer;
+    friend struct AsyncWaitContext;
+
+    Popen& m_popen;
+    std::exception_ptr m_error;
+};
+
+/**
+ * @brief Awaitable version of subprocess::run().
+ *
+ * Captured output and std::string input go through the IoReactor and the
+ * exit is awaited with Popen::async_wait(), so no thread is blocked while
+ * the process runs.
+ *
+ * @return co_await yields the details about the execution.
+ * @throws std::invalid_argument If options has a timeout, which is not
+ * supported. Use Popen::terminate() from elsewhere instead.
+ * @throws CalledProcessError, CommandNotFoundError, SpawnError, OSError As
+ * subprocess::run().
+ */
+Task<CompletedProcess> async_run(CommandLine command, RunOptions options = {});
+
+} // namespace subprocess
@@ -10,10 +10,14 @@
 #endif
 
 #include <csignal>
+#include <cstddef>
+#include <cstdint>
 #include <format>
 #include <map>
+#include <memory>
 #include <stdexcept>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
@@ -174,13 +178,22 @@ typedef std::map<std::string, std::string> EnvMap;
  */
 enum class PipeOption : int
 {
-    inherit,  ///< Inherits the current process handle
-    cout,     ///< Redirects to stdout
-    cerr,     ///< Redirects to stderr
-    specific, ///< Redirects to a provided pipe (made inheritable)
-    pipe,     ///< Redirects to a new handle created for you
-    close,    ///< Closes the pipe (troll the child)
-    none      ///< No file descriptor, i.e., not connected to parent process or the console.
+    inherit,   ///< Inherits the current process handle
+    cout,      ///< Redirects to stdout
+    cerr,      ///< Redirects to stderr
+    specific,  ///< Redirects to a provided pipe (made inheritable)
+    pipe,      ///< Redirects to a new handle created for you
+    close,     ///< Closes the pipe (troll the child)
+    none,      ///< No file descriptor, i.e., not connected to parent process or the console.
+    mmap_file, ///< Output goes to an anonymous file, read back as a MappedFile
+    pty        ///< Connects to a new pseudo-terminal, see RunOptions::pty
+};
+
+/** @brief The size of a pseudo-terminal, in characters. */
+struct PtySize
+{
+    uint16_t columns{80U}; // NOLINT
+    uint16_t rows{24U};    // NOLINT
 };
 
 /*
@@ -241,13 +254,138 @@ struct CalledProcessError : SubprocessError
     std::string cerr;   ///< Stderr output if it was captured
 };
 
+/**
+ * @brief Resources used by a process, see Popen::resource_usage().
+ *
+ * On POSIX the figures come from wait4() and cover the process and the
+ * descendants it waited for. With RunOptions::job_object on Windows the CPU
+ * time, peak memory, page faults and I/O cover the whole job, i.e. the
+ * process and every descendant. Fields that were not measured are 0.
+ */
+struct ResourceUsage
+{
+    double wall_seconds{0.0};      ///< Time from the start to the exit
+    double user_seconds{0.0};      ///< CPU time spent in user mode
+    double system_seconds{0.0};    ///< CPU time spent in the kernel
+    uint64_t max_rss{0U};          ///< Peak resident set size in bytes
+    uint64_t peak_memory{0U};      ///< Peak committed memory in bytes, Windows only
+    uint64_t page_faults{0U};      ///< Page faults, including soft faults
+    uint64_t read_operations{0U};  ///< Read I/O operations, block reads on POSIX
+    uint64_t write_operations{0U}; ///< Write I/O operations, block writes on POSIX
+    uint64_t read_bytes{0U};       ///< Bytes read, Windows only
+    uint64_t write_bytes{0U};      ///< Bytes written, Windows only
+    uint32_t process_count{0U};    ///< Processes that were part of the job
+};
+
+/**
+ * @brief Read-only memory mapped view of output captured with
+ * PipeOption::mmap_file, see Popen::mapped_cout().
+ *
+ * Copies share the mapping, which is unmapped with the last of them.
+ */
+class MappedFile
+{
+public:
+    MappedFile() = default;
+
+    /**
+     * @param mapping Keeps the mapping alive, unmaps it when released.
+     * @param data Start of the mapped contents.
+     * @param size Size of the contents in bytes.
+     */
+    MappedFile(std::shared_ptr<const void> mapping, const char* data, std::size_t size)
+        : m_mapping(std::move(mapping)), m_data(data), m_size(size)
+    {
+    }
+
+    [[nodiscard]] const char* data() const
+    {
+        return m_data;
+    }
+
+    [[nodiscard]] std::size_t size() const
+    {
+        return m_size;
+    }
+
+    [[nodiscard]] bool empty() const
+    {
+        return m_size == 0U;
+    }
+
+    /** @brief The contents, valid as long as this or a copy exists. */
+    [[nodiscard]] std::string_view view() const
+    {
+        return {m_data, m_size};
+    }
+
+private:
+    std::shared_ptr<const void> m_mapping;
+    const char* m_data{nullptr};
+    std::size_t m_size{0U};
+};
+
+/**
+ * @brief The arguments of a command in one contiguous block, as spawned.
+ *
+ * The strings lie back to back, each null-terminated, in one arena, indexed
+ * by a table of pointers ending with nullptr, so the table can be the argv of
+ * posix_spawn. It is built once per spawn and shared, not copied, by Popen
+ * and CompletedProcess.
+ */
+class ArgvBuffer
+{
+public:
+    ArgvBuffer() = default;
+
+    explicit ArgvBuffer(const CommandLine& command);
+
+    // The table points into the arena.
+    ArgvBuffer(const ArgvBuffer&) = delete;
+    ArgvBuffer& operator=(const ArgvBuffer&) = delete;
+
+    [[nodiscard]] std::size_t size() const
+    {
+        return m_argv.empty() ? 0U : m_argv.size() - 1U;
+    }
+
+    [[nodiscard]] bool empty() const
+    {
+        return size() == 0U;
+    }
+
+    [[nodiscard]] std::string_view operator[](std::size_t index) const
+    {
+        return m_argv[index];
+    }
+
+    /** @brief The argv table, nullptr terminated. Must not be written to. */
+    [[nodiscard]] char* const* argv() const
+    {
+        return m_argv.data();
+    }
+
+    [[nodiscard]] CommandLine to_command_line() const;
+
+    /** @brief The arguments escaped and joined, like ProcessBuilder::windows_args(). */
+    [[nodiscard]] std::string windows_command_line() const;
+
+private:
+    std::string m_arena;
+    std::vector<char*> m_argv;
+};
+
 /** @brief Details about a completed process. */
 struct CompletedProcess
 {
-    CommandLine args;        ///< Args used for the process (including executable)
-    int64_t returncode = -1; ///< Negative number -N means terminated by signal N
-    std::string cout;        ///< Captured stdout
-    std::string cerr;        ///< Captured stderr
+    CommandLine args;                       ///< Args used for the process (including executable)
+    std::shared_ptr<const ArgvBuffer> argv; ///< The same args as spawned, shared with the Popen
+    int64_t returncode = -1;                ///< Negative number -N means terminated by signal N
+    std::string cout;                       ///< Captured stdout
+    std::string cerr;                       ///< Captured stderr
+    ResourceUsage usage;                    ///< Resources used, see Popen::resource_usage()
+    MappedFile cout_file;                   ///< Captured stdout with PipeOption::mmap_file, cout is then empty
+    MappedFile cerr_file;                   ///< Captured stderr with PipeOption::mmap_file, cerr is then empty
 
     /** @brief Implicit conversion to bool.
      *
@@ -9,14 +9,25 @@
 #endif
 #include <errno.h>
 #include <signal.h>
+#include <sys/resource.h>
 #else
+#include <io.h>
+#include <psapi.h>
+
 #include "tlhelp32.h"
 #endif
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <mutex>
+#include <optional>
+#include <system_error>
 #include <thread>
 
+#include "reactor.h"
 #include "shellutils.h"
+#include "trace.h"
 #include "utf8_to_utf16.h"
 
 namespace subprocess
@@ -38,15 +49,9 @@ void throw_os_error(const char* function, int ec)
 {
     if (ec != 0)
     {
-        char buf[256];
-        // Returns zero if the entire message was successfully stored in buf,
-        // non-zero otherwise. No more than bufsz-1 bytes are written, the buffer
-        // is always null-terminated. If the message had to be truncated to fit
-        // the buffer and bufsz is greater than 3, then only bufsz-4 bytes are
-        // written, and the characters "..." are appended before the null
-        // terminator
-        (void)strerror_s(&buf[0], sizeof(buf), ec);
-        std::string message = std::format("{} failed with code {}:{}", std::string{function}, std::to_string(ec), buf);
+        std::string message =
+            std::format("{} failed with code {}:{}", std::string{function}, std::to_string(ec),
+                        std::generic_category().message(ec));
         throw OSError(message);
     }
 }
@@ -62,152 +67,761 @@ void throw_os_error(const char* function, int ec)
     return watch.seconds();
 }
 
-struct AutoClosePipe
+namespace
+{
+/** @brief A transfer that owns its pipe. */
+class PipeTransfer : public IoTransfer
 {
-    AutoClosePipe(PipeHandle handle, bool autoclose)
+public:
+    explicit PipeTransfer(PipeHandle handle) : m_handle(handle)
+    {
+    }
+
+    ~PipeTransfer() override
     {
-        m_handle = autoclose ? handle : kBadPipeValue;
+        (void)pipe_close(m_handle);
     }
 
-    ~AutoClosePipe()
+    PipeTransfer(const PipeTransfer&) = delete;
+    PipeTransfer& operator=(const PipeTransfer&) = delete;
+
+    [[nodiscard]] PipeHandle handle() const override
     {
-        close();
+        return m_handle;
     }
 
 private:
-    void close()
+    PipeHandle m_handle;
+};
+
+/** @brief Reads a pipe until its end, handing everything to consume(). */
+class ReadTransfer : public PipeTransfer
+{
+public:
+    using PipeTransfer::PipeTransfer;
+
+    [[nodiscard]] bool is_write() const override
     {
-        if (m_handle != kBadPipeValue)
+        return false;
+    }
+
+    IoStatus on_ready() override
+    {
+        char buffer[2048U];
+        ssize_t transfered = pipe_read(handle(), &buffer[0U], sizeof(buffer));
+        IoStatus result;
+
+        if (transfered > 0)
+        {
+            consume(&buffer[0U], static_cast<size_t>(transfered));
+            result = IoStatus::pending;
+        }
+        else if (transfered < 0 && pipe_would_block())
         {
-            (void)pipe_close(m_handle);
-            m_handle = kBadPipeValue;
+            result = IoStatus::blocked;
         }
+        else
+        {
+            finish();
+            result = IoStatus::done;
+        }
+
+        return result;
     }
 
-    PipeHandle m_handle;
+protected:
+    virtual void consume(const char* data, size_t size) = 0;
+
+    /** @brief Called once at end-of-file or on error. */
+    virtual void finish()
+    {
+    }
 };
 
-void pipe_thread(PipeHandle input, std::ostream* output)
+/**
+ * @brief Writes to a pipe whatever next() produces, until it produces nothing.
+ *
+ * A chunk the pipe only partially accepts is kept and finished first.
+ */
+class WriteTransfer : public PipeTransfer
 {
-    std::thread thread(
-        [=]()
+public:
+    using PipeTransfer::PipeTransfer;
+
+    [[nodiscard]] bool is_write() const override
+    {
+        return true;
+    }
+
+    IoStatus on_ready() override
+    {
+        if (m_pending.empty())
         {
-            std::vector<char> buffer(2048U);
-            while (true)
+            m_pending = next();
+        }
+
+        IoStatus result = IoStatus::done;
+        if (!m_pending.empty())
+        {
+            ssize_t transfered = pipe_write(handle(), m_pending.data(), m_pending.size());
+            if (transfered > 0)
             {
-                ssize_t transfered = pipe_read(input, buffer.data(), buffer.size());
-                if (transfered > 0)
-                {
-                    (void)output->write(buffer.data(), transfered);
-                }
-                else
-                {
-                    break;
-                }
+                m_pending.remove_prefix(static_cast<size_t>(transfered));
+                result = IoStatus::pending;
             }
-        });
-    thread.detach();
-}
+            else if (transfered == 0)
+            {
+                result = IoStatus::blocked;
+            }
+            // else the child closed its end, the rest of the input is dropped.
+        }
+
+        return result;
+    }
 
-void pipe_thread(PipeHandle input, FILE* output)
+protected:
+    /** @brief The next chunk to write, valid until the next call. Empty at the end. */
+    virtual std::string_view next() = 0;
+
+private:
+    std::string_view m_pending;
+};
+
+class PipeToOstream final : public ReadTransfer
 {
-    std::thread thread(
-        [=]()
+public:
+    PipeToOstream(PipeHandle input, std::ostream* output) : ReadTransfer(input), m_output(output)
+    {
+    }
+
+protected:
+    void consume(const char* data, size_t size) override
+    {
+        (void)m_output->write(data, static_cast<std::streamsize>(size));
+    }
+
+private:
+    std::ostream* m_output;
+};
+
+class PipeToFile final : public ReadTransfer
+{
+public:
+    PipeToFile(PipeHandle input, FILE* output) : ReadTransfer(input), m_output(output)
+    {
+    }
+
+protected:
+    void consume(const char* data, size_t size) override
+    {
+        (void)fwrite(data, 1U, size, m_output);
+    }
+
+private:
+    FILE* m_output;
+};
+
+class PipeToCallback final : public ReadTransfer
+{
+public:
+    PipeToCallback(PipeHandle input, OutputCallback output) : ReadTransfer(input), m_output(std::move(output))
+    {
+    }
+
+protected:
+    void consume(const char* data, size_t size) override
+    {
+        m_output({data, size});
+    }
+
+    void finish() override
+    {
+        m_output.finish();
+    }
+
+private:
+    OutputCallback m_output;
+};
+
+/**
+ * @brief Fans a pipe out to the sinks of a Tee.
+ *
+ * Output is read straight into the ring, and direct sinks are handed what was just read. Each handle sink keeps
+ * its position in the stream and is written from the ring as far as it accepts; the ring is reclaimed behind the
+ * slowest one. While the ring is full with Backpressure::block, or at the end while sinks still lag, the transfer
+ * has the reactor wait for a lagging sink to be writable instead of for the child's pipe.
+ */
+class TeeTransfer final : public PipeTransfer
+{
+public:
+    TeeTransfer(PipeHandle input, const Tee& tee)
+        : PipeTransfer(input), m_tee(tee), m_ring(tee.buffer_size()), m_capacity(tee.buffer_size())
+    {
+        for (const Tee::Sink& sink : tee.sinks())
         {
-            std::vector<char> buffer(2048U);
-            while (true)
+            if (const auto* handle = std::get_if<PipeHandle>(&sink); handle != nullptr)
             {
-                ssize_t transfered = pipe_read(input, buffer.data(), buffer.size());
-                if (transfered > 0)
-                {
-                    (void)fwrite(buffer.data(), 1U, static_cast<size_t>(transfered), output);
-                }
-                else
+                // The handle is the caller's, and its mode is shared with every other user of it. It is put
+                // back once the Tee is done.
+                m_writers.push_back(Writer{.handle = *handle, .was_blocking = pipe_is_blocking(*handle)});
+                if (m_writers.back().was_blocking)
                 {
-                    break;
+                    pipe_set_blocking(*handle, false);
                 }
             }
-        });
-    thread.detach();
-}
+            else
+            {
+                m_direct.push_back(sink);
+            }
+        }
+    }
 
-void pipe_thread(FILE* input, PipeHandle output, bool bautoclose)
-{
-    std::thread thread(
-        [=]()
+    ~TeeTransfer() override
+    {
+        for (Writer& writer : m_writers)
         {
-            AutoClosePipe autoclose(output, bautoclose);
-            std::vector<char> buffer(2048U);
-            while (true)
+            close_spill(writer);
+            if (writer.was_blocking)
             {
-                size_t transfered = fread(buffer.data(), 1U, buffer.size(), input);
-                if (transfered > 0U)
+                try
                 {
-                    (void)pipe_write(output, buffer.data(), transfered);
+                    pipe_set_blocking(writer.handle, true);
                 }
-                else
+                catch (const std::exception&)
                 {
-                    break;
+                    // The caller closed the handle already, nothing is left to restore.
                 }
             }
-        });
-    thread.detach();
-}
+        }
+    }
 
-void pipe_thread(const std::string& input, PipeHandle output, bool bautoclose)
-{
-    std::thread thread(
-        [input, output, bautoclose]()
+    TeeTransfer(const TeeTransfer&) = delete;
+    TeeTransfer& operator=(const TeeTransfer&) = delete;
+
+    [[nodiscard]] PipeHandle handle() const override
+    {
+        return m_waiting < m_writers.size() ? m_writers[m_waiting].handle : PipeTransfer::handle();
+    }
+
+    [[nodiscard]] bool is_write() const override
+    {
+        return m_waiting < m_writers.size();
+    }
+
+    IoStatus on_ready() override
+    {
+        IoStatus result = IoStatus::pending;
+        if (!is_write() && !m_eof)
+        {
+            result = read();
+        }
+
+        bool progress = false;
+        for (Writer& writer : m_writers)
         {
-            AutoClosePipe autoclose(output, bautoclose);
+            progress = flush(writer) || progress;
+        }
 
-            std::size_t pos = 0U;
-            while (pos < input.size())
+        if (!m_eof && space() == 0U && m_tee.policy() != Backpressure::block)
+        {
+            // Only the sinks the ring waits for lose their part of it, which frees at least one byte.
+            uint64_t base = this->base();
+            for (Writer& writer : m_writers)
             {
-                ssize_t transfered = pipe_write(output, input.c_str() + pos, input.size() - pos);
-                if (transfered > 0)
+                if (!writer.closed && writer.position == base)
                 {
-                    pos += static_cast<size_t>(transfered);
+                    if (m_tee.policy() == Backpressure::drop)
+                    {
+                        m_tee.count_dropped(m_end - writer.position);
+                        writer.position = m_end;
+                    }
+                    else
+                    {
+                        spill(writer);
+                    }
                 }
-                else
+            }
+        }
+
+        bool waited = is_write();
+        m_waiting = kNone;
+        if (m_eof)
+        {
+            m_waiting = lagging(false);
+            if (m_waiting == kNone)
+            {
+                result = IoStatus::done;
+            }
+        }
+        else if (space() == 0U)
+        {
+            m_waiting = lagging(true);
+        }
+        else
+        {
+        }
+
+        // A sink that took nothing is not polled again straight away, see IoReactor.
+        if (waited && result != IoStatus::done)
+        {
+            result = progress ? IoStatus::pending : IoStatus::blocked;
+        }
+        return result;
+    }
+
+private:
+    static constexpr std::size_t kNone = static_cast<std::size_t>(-1);
+    static constexpr std::size_t kSpillChunk = 64U * 1024U;
+
+    struct Writer
+    {
+        PipeHandle handle{kBadPipeValue};
+        bool was_blocking{false};   ///< Mode of handle before the Tee, restored after
+        uint64_t position{0U};      ///< In the stream, of the next byte to take from the ring
+        FILE* spill{nullptr};       ///< What was moved out of the ring, comes before position
+        int64_t spill_read{0};      ///< Offset in spill of what is not in pending yet
+        std::string buffer{};       ///< Read back from spill
+        std::string_view pending{}; ///< The part of buffer not written yet
+        bool closed{false};         ///< The reader is gone, the rest is dropped
+    };
+
+    /** @brief The oldest byte still needed. */
+    [[nodiscard]] uint64_t base() const
+    {
+        uint64_t result = m_end;
+        for (const Writer& writer : m_writers)
+        {
+            if (!writer.closed)
+            {
+                result = std::min(result, writer.position);
+            }
+        }
+        return result;
+    }
+
+    [[nodiscard]] std::size_t space() const
+    {
+        return m_capacity - static_cast<std::size_t>(m_end - base());
+    }
+
+    /** @brief The longest contiguous part of the ring starting at position. */
+    [[nodiscard]] std::string_view view(uint64_t position) const
+    {
+        auto index = static_cast<std::size_t>(position % m_capacity);
+        auto size = static_cast<std::size_t>(std::min<uint64_t>(m_end - position, m_capacity - index));
+        return {m_ring.data() + index, size};
+    }
+
+    /** @brief The slowest writer with data left, or only one the ring waits for if at_base. */
+    [[nodiscard]] std::size_t lagging(bool at_base) const
+    {
+        uint64_t base = this->base();
+        for (std::size_t i = 0U; i < m_writers.size(); ++i)
+        {
+            const Writer& writer = m_writers[i];
+            if (!writer.closed && (at_base ? writer.position == base
+                                           : writer.position < m_end || writer.spill != nullptr ||
+                                                 !writer.pending.empty()))
+            {
+                return i;
+            }
+        }
+        return kNone;
+    }
+
+    IoStatus read()
+    {
+        auto index = static_cast<std::size_t>(m_end % m_capacity);
+        std::size_t size = std::min(space(), m_capacity - index);
+        if (size == 0U)
+        {
+            return IoStatus::pending;
+        }
+
+        char* data = m_ring.data() + index;
+        ssize_t transfered = pipe_read(PipeTransfer::handle(), data, size);
+        IoStatus result = IoStatus::pending;
+        if (transfered > 0)
+        {
+            std::string_view chunk{data, static_cast<std::size_t>(transfered)};
+            for (Tee::Sink& sink : m_direct)
+            {
+                write_direct(sink, chunk);
+            }
+            m_end += static_cast<uint64_t>(transfered);
+        }
+        else if (transfered < 0 && pipe_would_block())
+        {
+            result = IoStatus::blocked;
+        }
+        else
+        {
+            m_eof = true;
+            for (Tee::Sink& sink : m_direct)
+            {
+                if (auto* callback = std::get_if<OutputCallback>(&sink); callback != nullptr)
                 {
-                    break;
+                    callback->finish();
                 }
             }
-        });
-    thread.detach();
+        }
+        return result;
+    }
+
+    static void write_direct(Tee::Sink& sink, std::string_view data)
+    {
+        if (auto* target = std::get_if<std::string*>(&sink); target != nullptr)
+        {
+            (void)(*target)->append(data);
+        }
+        else if (auto* stream = std::get_if<std::ostream*>(&sink); stream != nullptr)
+        {
+            (void)(*stream)->write(data.data(), static_cast<std::streamsize>(data.size()));
+        }
+        else if (auto* file = std::get_if<FILE*>(&sink); file != nullptr)
+        {
+            (void)fwrite(data.data(), 1U, data.size(), *file);
+        }
+        else if (auto* callback = std::get_if<OutputCallback>(&sink); callback != nullptr)
+        {
+            (*callback)(data);
+        }
+        else
+        {
+        }
+    }
+
+    /**
+     * @brief Writes what writer accepts without blocking, spilled data first.
+     * @return True if it took anything.
+     */
+    bool flush(Writer& writer)
+    {
+        bool result = false;
+        while (!writer.closed)
+        {
+            bool spilled = !writer.pending.empty() || refill(writer);
+            std::string_view data = spilled ? writer.pending : view(writer.position);
+            if (data.empty())
+            {
+                break;
+            }
+
+            ssize_t transfered = pipe_write(writer.handle, data.data(), data.size());
+            if (transfered < 0)
+            {
+                writer.closed = true;
+                close_spill(writer);
+                break;
+            }
+            if (transfered == 0)
+            {
+                break;
+            }
+
+            result = true;
+            if (spilled)
+            {
+                writer.pending.remove_prefix(static_cast<std::size_t>(transfered));
+            }
+            else
+            {
+                writer.position += static_cast<uint64_t>(transfered);
+            }
+        }
+        return result;
+    }
+
+    /** @brief Reads the next chunk back from the spill file, closing it once it is used up. */
+    static bool refill(Writer& writer)
+    {
+        std::size_t size = 0U;
+        if (writer.spill != nullptr && seek(writer.spill, writer.spill_read, SEEK_SET))
+        {
+            writer.buffer.resize(kSpillChunk);
+            size = fread(writer.buffer.data(), 1U, writer.buffer.size(), writer.spill);
+            writer.spill_read += static_cast<int64_t>(size);
+        }
+
+        writer.pending = std::string_view{writer.buffer.data(), size};
+        if (size == 0U)
+        {
+            close_spill(writer);
+        }
+        return size > 0U;
+    }
+
+    /** @brief Moves what writer has not taken from the ring to the end of its spill file, or drops it. */
+    void spill(Writer& writer)
+    {
+        if (writer.spill == nullptr)
+        {
+            writer.spill = std::tmpfile();
+            writer.spill_read = 0;
+        }
+
+        bool spilled = writer.spill != nullptr && seek(writer.spill, 0, SEEK_END);
+        while (writer.position < m_end)
+        {
+            std::string_view data = view(writer.position);
+            spilled = spilled && fwrite(data.data(), 1U, data.size(), writer.spill) == data.size();
+            if (!spilled)
+            {
+                m_tee.count_dropped(data.size());
+            }
+            writer.position += data.size();
+        }
+    }
+
+    /** @brief fseek for files beyond 2 GiB. */
+    static bool seek(FILE* file, int64_t offset, int origin)
+    {
+#ifdef _WIN32
+        return _fseeki64(file, offset, origin) == 0;
+#else
+        return fseeko(file, static_cast<off_t>(offset), origin) == 0;
+#endif
+    }
+
+    static void close_spill(Writer& writer)
+    {
+        if (writer.spill != nullptr)
+        {
+            (void)fclose(writer.spill);
+            writer.spill = nullptr;
+        }
+        writer.buffer = {};
+        writer.pending = {};
+    }
+
+    Tee m_tee;
+    std::vector<Tee::Sink> m_direct;
+    std::vector<Writer> m_writers;
+    std::vector<char> m_ring;
+    std::size_t m_capacity;
+    uint64_t m_end{0U}; ///< In the stream, one past the newest byte in the ring
+    std::size_t m_waiting{kNone};
+    bool m_eof{false};
+};
+
+/** @brief Writes in-memory input, kept alive by owner unless it belongs to the caller. */
+class StringToPipe final : public WriteTransfer
+{
+public:
+    StringToPipe(std::string_view input, std::shared_ptr<const void> owner, PipeHandle output)
+        : WriteTransfer(output), m_input(input), m_owner(std::move(owner))
+    {
+    }
+
+protected:
+    std::string_view next() override
+    {
+        std::string_view result = m_done ? std::string_view{} : m_input;
+        m_done = true;
+        return result;
+    }
+
+private:
+    std::string_view m_input;
+    std::shared_ptr<const void> m_owner;
+    bool m_done{false};
+};
+
+class IstreamToPipe final : public WriteTransfer
+{
+public:
+    IstreamToPipe(std::istream* input, PipeHandle output) : WriteTransfer(output), m_input(input)
+    {
+    }
+
+protected:
+    std::string_view next() override
+    {
+        size_t transfered = 0U;
+        if (!m_input->bad() && !m_input->eof())
+        {
+            (void)m_input->read(&m_buffer[0U], static_cast<std::streamsize>(sizeof(m_buffer)));
+            transfered = static_cast<size_t>(std::max<std::streamsize>(m_input->gcount(), 0));
+        }
+        return {&m_buffer[0U], transfered};
+    }
+
+private:
+    std::istream* m_input;
+    char m_buffer[65536U]{};
+};
+
+/**
+ * @brief Writes the input of an InputProducer, gathering small pieces into a batch. A piece that does not fit in
+ * the batch is written from where it is, and nothing more is asked for until it is.
+ */
+class ProducerToPipe final : public PipeTransfer
+{
+public:
+    ProducerToPipe(InputProducer producer, PipeHandle output) : PipeTransfer(output), m_producer(std::move(producer))
+    {
+        m_batch.reserve(kBatchSize);
+    }
+
+    [[nodiscard]] bool is_write() const override
+    {
+        return true;
+    }
+
+    IoStatus on_ready() override
+    {
+        fill();
+
+        std::string_view buffers[2U];
+        std::size_t count = 0U;
+        if (m_written < m_batch.size())
+        {
+            buffers[count++] = {m_batch.data() + m_written, m_batch.size() - m_written};
+        }
+
+        if (!m_piece.empty())
+        {
+            buffers[count++] = m_piece;
+        }
+
+        if (count == 0U)
+        {
+            return IoStatus::done;
+        }
+
+        ssize_t transfered = pipe_write_gather(handle(), &buffers[0U], count);
+        if (transfered < 0)
+        {
+            // The child closed its end, the rest of the input is dropped.
+            return IoStatus::done;
+        }
+
+        if (transfered == 0)
+        {
+            return IoStatus::blocked;
+        }
+
+        auto size = static_cast<std::size_t>(transfered);
+        std::size_t from_batch = std::min(size, m_batch.size() - m_written);
+        m_written += from_batch;
+        m_piece.remove_prefix(size - from_batch);
+        if (m_written == m_batch.size())
+        {
+            m_batch.clear();
+            m_written = 0U;
+        }
+        return IoStatus::pending;
+    }
+
+private:
+    static constexpr std::size_t kBatchSize = 65536U;
+
+    /** @brief Asks for input until the batch is full, a piece has to be written in place, or the input ends. */
+    void fill()
+    {
+        while (!m_end && m_piece.empty() && m_batch.size() < kBatchSize)
+        {
+            std::span<const std::byte> next = m_producer();
+            std::string_view piece{reinterpret_cast<const char*>(next.data()), next.size()}; // NOLINT
+            if (piece.empty())
+            {
+                m_end = true;
+            }
+            else if (piece.size() <= kBatchSize - m_batch.size())
+            {
+                m_batch.insert(m_batch.end(), piece.begin(), piece.end());
+            }
+            else
+            {
+                m_piece = piece;
+            }
+        }
+    }
+
+    InputProducer m_producer;
+    std::vector<char> m_batch;
+    std::size_t m_written{0U}; ///< Bytes at the start of the batch the child has taken
+    std::string_view m_piece;  ///< A piece written in place, valid until the producer is called again
+    bool m_end{false};
+};
+
+class FileToPipe final : public WriteTransfer
+{
+public:
+    FileToPipe(FILE* input, PipeHandle output) : WriteTransfer(output), m_input(input)
+    {
+    }
+
+protected:
+    std::string_view next() override
+    {
+        return {&m_buffer[0U], fread(&m_buffer[0U], 1U, sizeof(m_buffer), m_input)};
+    }
+
+private:
+    FILE* m_input;
+    char m_buffer[65536U]{};
+};
+
+/**
+ * @brief Gets the descriptor behind a FILE*, so the child can use it directly
+ * and the data never passes through this process.
+ *
+ * The stream is flushed first. For input, the descriptor is moved to the
+ * stream's position, which requires a seekable file; otherwise read-ahead
+ * buffered in the stream would be lost.
+ *
+ * @return kBadPipeValue if the stream has no usable descriptor, e.g. one
+ * from fmemopen, or is unseekable input.
+ */
+PipeHandle file_pipe_handle(FILE* file, bool input)
+{
+    PipeHandle result = kBadPipeValue;
+
+#ifdef _WIN32
+    int fd = file != nullptr ? _fileno(file) : -1;
+    if (fd >= 0)
+    {
+        auto handle = reinterpret_cast<PipeHandle>(_get_osfhandle(fd));
+        if (handle != INVALID_HANDLE_VALUE && handle != reinterpret_cast<PipeHandle>(-2))
+        {
+            int64_t position = input ? _ftelli64(file) : 0;
+            if (position >= 0 && fflush(file) == 0 && (!input || _lseeki64(fd, position, SEEK_SET) == position))
+            {
+                result = handle;
+            }
+        }
+    }
+#else
+    int fd = file != nullptr ? fileno(file) : -1;
+    if (fd >= 0)
+    {
+        off_t position = input ? ftello(file) : 0;
+        if (position >= 0 && fflush(file) == 0 && (!input || lseek(fd, position, SEEK_SET) == position))
+        {
+            result = fd;
+        }
+    }
+#endif
+
+    return result;
 }
 
-void pipe_thread(std::istream* input, PipeHandle output, bool bautoclose)
+void pipe_redirect(std::unique_ptr<IoTransfer> transfer, std::shared_ptr<IoCompletion>& completion)
 {
-    std::thread thread(
-        [=]()
-        {
-            AutoClosePipe autoclose(output, bautoclose);
-            std::vector<char> buffer(2048U);
-            while (true)
-            {
-                (void)input->read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
-                ssize_t transfered = input->gcount();
-                if (input->bad() || (transfered <= 0 && input->eof()))
-                {
-                    break;
-                }
-
-                if (transfered > 0)
-                {
-                    (void)pipe_write(output, &buffer[0U], static_cast<size_t>(transfered));
-                }
-            }
-        });
-    thread.detach();
+    if (!completion)
+    {
+        completion = std::make_shared<IoCompletion>();
+    }
+    IoReactor::instance().add(std::move(transfer), completion);
 }
 
-void setup_redirect_stream(PipeHandle input, PipeVar& output)
+bool setup_redirect_stream(PipeHandle input, const PipeVar& output, std::shared_ptr<IoCompletion>& completion)
 {
     auto index = static_cast<PipeVarIndex>(output.index());
+    bool result;
 
-    if (index == PipeVarIndex::istream)
+    if (index == PipeVarIndex::istream || index == PipeVarIndex::producer)
     {
         throw std::domain_error("expected something to output to");
     }
@@ -216,21 +830,36 @@ void setup_redirect_stream(PipeHandle input, PipeVar& output)
         switch (index)
         {
             case PipeVarIndex::ostream:
-                pipe_thread(input, std::get<std::ostream*>(output));
+                pipe_redirect(std::make_unique<PipeToOstream>(input, std::get<std::ostream*>(output)), completion);
+                result = true;
                 break;
 
             case PipeVarIndex::file:
-                pipe_thread(input, std::get<FILE*>(output));
+                pipe_redirect(std::make_unique<PipeToFile>(input, std::get<FILE*>(output)), completion);
+                result = true;
+                break;
+
+            case PipeVarIndex::callback:
+                pipe_redirect(std::make_unique<PipeToCallback>(input, std::get<OutputCallback>(output)), completion);
+                result = true;
+                break;
+
+            case PipeVarIndex::tee:
+                pipe_redirect(std::make_unique<TeeTransfer>(input, std::get<Tee>(output)), completion);
+                result = true;
                 break;
 
             default:
-                //  PipeVarIndex::handle, PipeVarIndex::option, PipeVarIndex::string
+                //  PipeVarIndex::handle, PipeVarIndex::option, and the in-memory input ones
+                result = false;
                 break;
         }
     }
+
+    return result;
 }
 
-bool setup_redirect_stream(PipeVar& input, PipeHandle output)
+bool setup_redirect_stream(const PipeVar& input, PipeHandle output, std::shared_ptr<IoCompletion>& completion)
 {
     auto index = static_cast<PipeVarIndex>(input.index());
     bool result;
@@ -239,27 +868,58 @@ bool setup_redirect_stream(PipeVar& input, PipeHandle output)
     {
         throw std::domain_error("reading from std::ostream doesn't make sense");
     }
+    else if (index == PipeVarIndex::callback)
+    {
+        throw std::domain_error("reading from an OutputCallback doesn't make sense");
+    }
+    else if (index == PipeVarIndex::tee)
+    {
+        throw std::domain_error("reading from a Tee doesn't make sense");
+    }
     else
     {
         switch (index)
         {
             case PipeVarIndex::string:
             {
-                pipe_thread(std::get<std::string>(input), output, true);
+                auto data = std::make_shared<const std::string>(std::get<std::string>(input));
+                pipe_redirect(std::make_unique<StringToPipe>(*data, data, output), completion);
+                result = true;
+                break;
+            }
+
+            case PipeVarIndex::view:
+            {
+                pipe_redirect(std::make_unique<StringToPipe>(*get_pipe_input(input), nullptr, output), completion);
+                result = true;
+                break;
+            }
+
+            case PipeVarIndex::shared:
+            {
+                const auto& data = std::get<std::shared_ptr<const std::string>>(input);
+                pipe_redirect(std::make_unique<StringToPipe>(*get_pipe_input(input), data, output), completion);
                 result = true;
                 break;
             }
 
             case PipeVarIndex::istream:
             {
-                pipe_thread(std::get<std::istream*>(input), output, true);
+                pipe_redirect(std::make_unique<IstreamToPipe>(std::get<std::istream*>(input), output), completion);
                 result = true;
                 break;
             }
 
             case PipeVarIndex::file:
             {
-                pipe_thread(std::get<FILE*>(input), output, true);
+                pipe_redirect(std::make_unique<FileToPipe>(std::get<FILE*>(input), output), completion);
+                result = true;
+                break;
+            }
+
+            case PipeVarIndex::producer:
+            {
+                pipe_redirect(std::make_unique<ProducerToPipe>(std::get<InputProducer>(input), output), completion);
                 result = true;
                 break;
             }
@@ -275,25 +935,34 @@ bool setup_redirect_stream(PipeVar& input, PipeHandle output)
 
     return result;
 }
+} // namespace
 
-Popen::Popen(CommandLine command, const RunOptions& optionsIn)
+Popen::Popen(CommandLine command, const RunOptions& options)
 {
-    // We have to make a copy because of const
-    RunOptions options = optionsIn;
     init(command, options);
 }
 
-Popen::Popen(CommandLine command, RunOptions&& optionsIn)
+Popen::Popen(CommandLine command, RunOptions&& options)
 {
-    RunOptions options = std::move(optionsIn);
+    // The reactor takes the input over instead of copying it.
+    if (auto* input = std::get_if<std::string>(&options.cin); input != nullptr)
+    {
+        options.cin = std::make_shared<const std::string>(std::move(*input));
+    }
     init(command, options);
 }
 
-void Popen::init(CommandLine& command, RunOptions& options)
+Popen::Popen(CommandLine& command, const RunOptions& options, bool redirect)
+{
+    init(command, options, redirect);
+}
+
+void Popen::init(CommandLine& command, const RunOptions& options, bool redirect)
 {
     ProcessBuilder builder;
 
-    auto setPipeOption = [](PipeHandle& pipe, PipeOption& pipeOpt, PipeVar& pipeVar, const std::string& errMsg)
+    auto setPipeOption = [](PipeHandle& pipe, PipeOption& pipeOpt, const PipeVar& pipeVar, bool input,
+                            const std::string& errMsg)
     {
         if (pipeOpt = get_pipe_option(pipeVar); pipeOpt == PipeOption::specific)
         {
@@ -302,37 +971,118 @@ void Popen::init(CommandLine& command, RunOptions& options)
                 throw std::invalid_argument(errMsg);
             }
         }
+        else if (const auto* file = std::get_if<FILE*>(&pipeVar); file != nullptr)
+        {
+            // A FILE* on a real file, socket or pipe is handed to the child as is, others go through the reactor.
+            if (pipe = file_pipe_handle(*file, input); pipe != kBadPipeValue)
+            {
+                pipeOpt = PipeOption::specific;
+            }
+        }
     };
 
     setPipeOption(builder.cin_pipe,   //
                   builder.cin_option, //
                   options.cin,        //
+                  true,               //
                   "Bad pipe value for cin");
 
     setPipeOption(builder.cout_pipe,   //
                   builder.cout_option, //
                   options.cout,        //
+                  false,               //
                   "Bad pipe value for cout");
 
     setPipeOption(builder.cerr_pipe,   //
                   builder.cerr_option, //
                   options.cerr,        //
+                  false,               //
                   "Bad pipe value for cerr");
 
-    builder.new_process_group = options.new_process_group;
-    builder.create_no_window = options.create_no_window;
-    builder.detached_process = options.detached_process;
-    builder.env = options.env;
-    builder.cwd = options.cwd;
+    if (builder.cin_option == PipeOption::mmap_file)
+    {
+        throw std::domain_error("PipeOption::mmap_file is only for output");
+    }
+
+    builder.apply_options(options);
+
+    // The child writes straight into the files, nothing has to be serviced while it runs.
+    PipeHandle cout_file = kBadPipeValue;
+    PipeHandle cerr_file = kBadPipeValue;
+    auto close_files = [&cout_file, &cerr_file]()
+    {
+        for (PipeHandle file : {cout_file, cerr_file})
+        {
+            if (file != kBadPipeValue)
+            {
+                (void)pipe_close(file);
+            }
+        }
+    };
+
+    auto setFileOption = [](PipeOption& pipeOpt, PipeHandle& pipe, PipeHandle& file)
+    {
+        if (pipeOpt == PipeOption::mmap_file)
+        {
+            pipe = file = temp_file_create();
+            pipeOpt = PipeOption::specific;
+        }
+    };
+
+    try
+    {
+        setFileOption(builder.cout_option, builder.cout_pipe, cout_file);
+        setFileOption(builder.cerr_option, builder.cerr_pipe, cerr_file);
+    }
+    catch (...)
+    {
+        close_files();
+        throw;
+    }
+
+    try
+    {
+        *this = builder.run_command(std::move(command));
+    }
+    catch (...)
+    {
+        close_files();
+        throw;
+    }
+    m_cout_file = cout_file;
+    m_cerr_file = cerr_file;
 
-    *this = builder.run_command(command);
+    // What run() services itself, in-memory input and callbacks, stays a plain pipe.
+    SUBPROCESS_TRACE_SCOPE(TracePhase::redirect, static_cast<int64_t>(pid));
+    auto redirected = [redirect](bool serviced)
+    {
+        return redirect || !serviced;
+    };
+
+    // A terminal is serviced like a pipe. cerr has none when it shares the terminal of cout.
+    auto piped = [](PipeOption option, PipeHandle handle)
+    {
+        return (option == PipeOption::pipe || option == PipeOption::pty) && handle != kBadPipeValue;
+    };
 
-    if (setup_redirect_stream(options.cin, cin))
+    if (redirected(get_pipe_input(options.cin).has_value()) && piped(builder.cin_option, cin) &&
+        setup_redirect_stream(options.cin, cin, m_streams))
     {
         cin = kBadPipeValue;
     }
-    setup_redirect_stream(cout, options.cout);
-    setup_redirect_stream(cerr, options.cerr);
+
+    // The reactor owns the redirected pipes from now on.
+    if (redirected(std::holds_alternative<OutputCallback>(options.cout)) && piped(builder.cout_option, cout) &&
+        setup_redirect_stream(cout, options.cout, m_streams))
+    {
+        cout = kBadPipeValue;
+    }
+
+    if (redirected(std::holds_alternative<OutputCallback>(options.cerr)) && piped(builder.cerr_option, cerr) &&
+        setup_redirect_stream(cerr, options.cerr, m_streams))
+    {
+        cerr = kBadPipeValue;
+    }
 }
 
 Popen::Popen(Popen&& other) noexcept
@@ -350,11 +1100,24 @@ Popen& Popen::operator=(Popen&& other) noexcept
     pid = other.pid;
     returncode = other.returncode;
     args = std::move(other.args);
+    m_argv = std::move(other.m_argv);
     m_soft_kill = other.m_soft_kill;
+    m_streams = std::move(other.m_streams);
+    m_cout_file = std::exchange(other.m_cout_file, kBadPipeValue);
+    m_cerr_file = std::exchange(other.m_cerr_file, kBadPipeValue);
 
 #ifdef _WIN32
     process_info = other.process_info;
     other.process_info = {};
+    m_job = std::exchange(other.m_job, nullptr);
+    m_pty = std::move(other.m_pty);
+    m_exit_signal = std::move(other.m_exit_signal);
+#else
+    m_pty = std::exchange(other.m_pty, kBadPipeValue);
+    m_pidfd = std::exchange(other.m_pidfd, kBadPipeValue);
+    m_kill_group = std::exchange(other.m_kill_group, false);
+    m_usage = std::exchange(other.m_usage, {});
+    m_started = other.m_started;
 #endif
 
     other.cin = kBadPipeValue;
@@ -391,18 +1154,59 @@ void Popen::close()
     }
 
     // do this to not have zombie processes.
-    if (pid > 0U)
+    if (pid > 0)
     {
         (void)wait();
 #ifdef _WIN32
+        m_exit_signal.reset(); // waits for its callback, which must not see a closed handle
         (void)CloseHandle(process_info.hProcess);
         (void)CloseHandle(process_info.hThread);
 #endif
     }
 
+#ifdef _WIN32
+    if (m_job != nullptr)
+    {
+        (void)CloseHandle(m_job);
+        m_job = nullptr;
+    }
+#else
+    m_kill_group = false;
+    m_usage = {};
+    if (m_pidfd != kBadPipeValue)
+    {
+        (void)pipe_close(m_pidfd);
+        m_pidfd = kBadPipeValue;
+    }
+#endif
+
+    // Output still in flight must reach the std::ostream or FILE* before they may go away.
+    (void)wait_streams();
+    m_streams.reset();
+
+    for (PipeHandle* file : {&m_cout_file, &m_cerr_file})
+    {
+        if (*file != kBadPipeValue)
+        {
+            (void)pipe_close(*file);
+            *file = kBadPipeValue;
+        }
+    }
+
+#ifdef _WIN32
+    m_pty.reset();
+#else
+    if (m_pty != kBadPipeValue)
+    {
+        (void)pipe_close(m_pty);
+        m_pty = kBadPipeValue;
+    }
+#endif
+
     pid = 0U;
     returncode = kBadReturnCode;
     args.clear();
+    m_argv.reset();
 }
 
 #ifdef _WIN32
@@ -475,7 +1279,14 @@ int64_t Popen::wait(double timeout)
 {
     if (this->returncode == kBadReturnCode)
     {
-        auto ms = static_cast<DWORD>(timeout < 0.0F ? INFINITE : timeout * 1000.0);
+        SUBPROCESS_TRACE_SCOPE(TracePhase::wait, static_cast<int64_t>(pid));
+        DWORD ms = INFINITE;
+        if (timeout >= 0.0)
+        {
+            // Rounded up, so the process is never given up on early.
+            auto limit = std::chrono::ceil<std::chrono::milliseconds>(StopWatch::to_duration(timeout)).count();
+            ms = static_cast<DWORD>(std::min<std::int64_t>(limit, INFINITE - 1U));
+        }
         DWORD wr = WaitForSingleObject(process_info.hProcess, ms);
         if (wr == WAIT_TIMEOUT) // NOLINT
         {
@@ -549,98 +1360,342 @@ void TerminateChildProcesses(DWORD parentProcessID)
     CloseHandle(hSnapshot);
 }
 
-std::vector<DWORD> GetChildProcessIDs(DWORD parentProcessID)
+std::vector<DWORD> GetChildProcessIDs(DWORD parentProcessID)
+{
+    std::vector<DWORD> childProcessIDs;
+
+    // Take a snapshot of all processes in the system
+    HANDLE hSnapshot = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
+    if (hSnapshot == INVALID_HANDLE_VALUE)
+    {
+        return childProcessIDs;
+    }
+
+    // Initialize the process entry structure
+    PROCESSENTRY32 pe32;
+    pe32.dwSize = sizeof(PROCESSENTRY32);
+
+    // Retrieve information about the first process in the snapshot
+    if (Process32First(hSnapshot, &pe32))
+    {
+        do
+        {
+            // Check if the process is a child of the specified parent
+            if (pe32.th32ParentProcessID == parentProcessID)
+            {
+                // Add the child process ID to the vector
+                childProcessIDs.push_back(pe32.th32ProcessID);
+            }
+        } while (Process32Next(hSnapshot, &pe32));
+    }
+
+    // Close the process snapshot handle
+    CloseHandle(hSnapshot);
+
+    return childProcessIDs;
+}
+
+void TerminateProcessByID(DWORD processID)
+{
+    HANDLE hProcess = OpenProcess(PROCESS_TERMINATE, FALSE, processID);
+    if (hProcess != NULL)
+    {
+        TerminateProcess(hProcess, 0);
+        CloseHandle(hProcess);
+    }
+}
+
+bool Popen::send_signal(SigNum signum) const
+{
+    bool result;
+
+    if (returncode != kBadReturnCode)
+    {
+        result = false;
+    }
+    else
+    {
+        if (signum == SigNum::PSIGKILL && m_job != nullptr)
+        {
+            // 137 just like when a process is killed SIGKILL. One call, whatever the size of the tree.
+            result = TerminateJobObject(m_job, 137U);
+        }
+        else if (signum == SigNum::PSIGKILL)
+        {
+            auto ids = GetChildProcessIDs(process_info.dwProcessId);
+            // 137 just like when a process is killed SIGKILL
+            result = TerminateProcess(process_info.hProcess, 137U);
+            for (auto id: ids)
+            {
+                TerminateProcessByID(id);
+            }
+        }
+        else if (signum == SigNum::PSIGINT)
+        {
+            // pid can be used as a process group id.The signals are sent to the
+            // entire process group, including parents.This event simulates the
+            // pressing of Ctrl+C in the console window, the associated process
+            // may handle the event to perform cleanup or terminate gracefully.
+            result = GenerateConsoleCtrlEvent(static_cast<DWORD>(CTRL_C_EVENT), 0); // pid must be 0
+        }
+        else
+        { // Simulates the pressing of Ctrl+Break, triggering a more forceful
+            // termination of the process.
+            result = GenerateConsoleCtrlEvent(static_cast<DWORD>(CTRL_BREAK_EVENT), pid);
+        }
+    }
+
+    if (!result)
+    {
+        std::string str = LastErrorString();
+        std::cout << "error: " << str << "\n";
+    }
+
+    return result;
+}
+
+namespace
+{
+/** @brief Converts a FILETIME, which counts 100 nanoseconds, into seconds. */
+double filetime_seconds(const FILETIME& value)
+{
+    ULARGE_INTEGER ticks;
+    ticks.LowPart = value.dwLowDateTime;
+    ticks.HighPart = value.dwHighDateTime;
+    return static_cast<double>(ticks.QuadPart) * 1e-7;
+}
+} // namespace
+
+ResourceUsage Popen::resource_usage() const
+{
+    ResourceUsage usage;
+    if (process_info.hProcess == nullptr)
+    {
+        return usage;
+    }
+
+    FILETIME creation{};
+    FILETIME exit{};
+    FILETIME kernel{};
+    FILETIME user{};
+    if (GetProcessTimes(process_info.hProcess, &creation, &exit, &kernel, &user))
+    {
+        FILETIME now{};
+        GetSystemTimeAsFileTime(&now);
+        usage.wall_seconds = filetime_seconds(returncode != kBadReturnCode ? exit : now) - filetime_seconds(creation);
+        usage.user_seconds = filetime_seconds(user);
+        usage.system_seconds = filetime_seconds(kernel);
+    }
+
+    PROCESS_MEMORY_COUNTERS memory{};
+    if (GetProcessMemoryInfo(process_info.hProcess, &memory, sizeof(memory)))
+    {
+        usage.max_rss = memory.PeakWorkingSetSize;
+        usage.peak_memory = memory.PeakPagefileUsage;
+        usage.page_faults = memory.PageFaultCount;
+    }
+
+    IO_COUNTERS io{};
+    if (GetProcessIoCounters(process_info.hProcess, &io))
+    {
+        usage.read_operations = io.ReadOperationCount;
+        usage.write_operations = io.WriteOperationCount;
+        usage.read_bytes = io.ReadTransferCount;
+        usage.write_bytes = io.WriteTransferCount;
+    }
+
+    if (m_job == nullptr)
+    {
+        return usage;
+    }
+
+    JOBOBJECT_BASIC_AND_IO_ACCOUNTING_INFORMATION accounting{};
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION limits{};
+    if (!QueryInformationJobObject(m_job, JobObjectBasicAndIoAccountingInformation, &accounting, sizeof(accounting),
+                                   nullptr) ||
+        !QueryInformationJobObject(m_job, JobObjectExtendedLimitInformation, &limits, sizeof(limits), nullptr))
+    {
+        throw OSError("QueryInformationJobObject failed: " + LastErrorString());
+    }
+
+    // Job times are in units of 100 nanoseconds.
+    usage.user_seconds = static_cast<double>(accounting.BasicInfo.TotalUserTime.QuadPart) * 1e-7;
+    usage.system_seconds = static_cast<double>(accounting.BasicInfo.TotalKernelTime.QuadPart) * 1e-7;
+    usage.peak_memory = limits.PeakJobMemoryUsed;
+    usage.page_faults = accounting.BasicInfo.TotalPageFaultCount;
+    usage.read_operations = accounting.IoInfo.ReadOperationCount;
+    usage.write_operations = accounting.IoInfo.WriteOperationCount;
+    usage.read_bytes = accounting.IoInfo.ReadTransferCount;
+    usage.write_bytes = accounting.IoInfo.WriteTransferCount;
+    usage.process_count = accounting.BasicInfo.TotalProcesses;
+    return usage;
+}
+#else
+namespace
+{
+/**
+ * @brief Converts a waitpid status into a return code.
+ * @return The exit code, or -N if the process was terminated by signal N.
+ */
+int64_t returncode_from_status(int status)
+{
+    int64_t result;
+
+    if (WIFEXITED(status))
+    {
+        result = static_cast<int64_t>(WEXITSTATUS(status));
+    }
+    else if (WIFSIGNALED(status))
+    {
+        result = -static_cast<int64_t>(WTERMSIG(status));
+    }
+    else
+    {
+        result = kBadReturnCode;
+    }
+
+    return result;
+}
+
+double timeval_seconds(const timeval& value)
+{
+    return static_cast<double>(value.tv_sec) + static_cast<double>(value.tv_usec) * 1e-6;
+}
+
+/** @brief Converts what wait4 reports about a reaped process, with the wall time since it was started. */
+ResourceUsage usage_from_rusage(const rusage& usage, std::chrono::steady_clock::time_point started)
+{
+    ResourceUsage result;
+    result.wall_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    result.user_seconds = timeval_seconds(usage.ru_utime);
+    result.system_seconds = timeval_seconds(usage.ru_stime);
+#ifdef __APPLE__
+    result.max_rss = static_cast<uint64_t>(usage.ru_maxrss); // bytes on macOS, KiB elsewhere
+#else
+    result.max_rss = static_cast<uint64_t>(usage.ru_maxrss) * 1024U;
+#endif
+    result.page_faults = static_cast<uint64_t>(usage.ru_minflt) + static_cast<uint64_t>(usage.ru_majflt);
+    result.read_operations = static_cast<uint64_t>(usage.ru_inblock);
+    result.write_operations = static_cast<uint64_t>(usage.ru_oublock);
+    return result;
+}
+} // namespace
+
+[[maybe_unused]] bool Popen::poll()
 {
-    std::vector<DWORD> childProcessIDs;
+    bool result{false};
 
-    // Take a snapshot of all processes in the system
-    HANDLE hSnapshot = CreateToolhelp32Snapshot(TH32CS_SNAPPROCESS, 0);
-    if (hSnapshot == INVALID_HANDLE_VALUE)
+    if (this->returncode != kBadReturnCode)
     {
-        return childProcessIDs;
+        result = true;
     }
-
-    // Initialize the process entry structure
-    PROCESSENTRY32 pe32;
-    pe32.dwSize = sizeof(PROCESSENTRY32);
-
-    // Retrieve information about the first process in the snapshot
-    if (Process32First(hSnapshot, &pe32))
+    else
     {
+        int status = 0;
+        rusage usage{};
+        pid_t ret;
         do
         {
-            // Check if the process is a child of the specified parent
-            if (pe32.th32ParentProcessID == parentProcessID)
-            {
-                // Add the child process ID to the vector
-                childProcessIDs.push_back(pe32.th32ProcessID);
-            }
-        } while (Process32Next(hSnapshot, &pe32));
-    }
+            ret = wait4(pid, &status, WNOHANG, &usage);
+        } while (ret < 0 && errno == EINTR);
 
-    // Close the process snapshot handle
-    CloseHandle(hSnapshot);
+        if (ret < 0)
+        {
+            details::throw_os_error("wait4", errno);
+        }
+        else if (ret == pid)
+        {
+            returncode = returncode_from_status(status);
+            m_usage = usage_from_rusage(usage, m_started);
+            result = true;
+        }
+        else
+        {
+            result = false;
+        }
+    }
 
-    return childProcessIDs;
+    return result;
 }
 
-void TerminateProcessByID(DWORD processID)
+int64_t Popen::wait(double timeout)
 {
-    HANDLE hProcess = OpenProcess(PROCESS_TERMINATE, FALSE, processID);
-    if (hProcess != NULL)
+    if (this->returncode == kBadReturnCode)
     {
-        TerminateProcess(hProcess, 0);
-        CloseHandle(hProcess);
+        SUBPROCESS_TRACE_SCOPE(TracePhase::wait, static_cast<int64_t>(pid));
+        if (timeout < 0.0F)
+        {
+            int status = 0;
+            rusage usage{};
+            pid_t ret;
+            do
+            {
+                ret = wait4(pid, &status, 0, &usage);
+            } while (ret < 0 && errno == EINTR);
+
+            if (ret < 0)
+            {
+                details::throw_os_error("wait4", errno);
+            }
+            returncode = returncode_from_status(status);
+            m_usage = usage_from_rusage(usage, m_started);
+        }
+        else
+        {
+            // POSIX has no waitpid with a timeout. Poll with an exponential backoff so short-lived children are
+            // reaped within microseconds while long waits cost only a few wake-ups per second.
+            StopWatch watch;
+            double interval = 0.0001;
+            while (!poll())
+            {
+                double remaining = watch.remaining(timeout);
+                if (remaining <= 0.0)
+                {
+                    throw TimeoutExpired("timeout of " + std::to_string(timeout) + " expired");
+                }
+                std::this_thread::sleep_for(std::chrono::duration<double>(std::min(interval, remaining)));
+                interval = std::min(interval * 2.0, 0.01);
+            }
+        }
     }
+
+    return this->returncode;
 }
 
 bool Popen::send_signal(SigNum signum) const
 {
     bool result;
 
-    if (returncode != kBadReturnCode)
+    if (returncode != kBadReturnCode || pid <= 0)
     {
         result = false;
     }
     else
     {
-        if (signum == SigNum::PSIGKILL)
-        {
-            auto ids = GetChildProcessIDs(process_info.dwProcessId);
-            // 137 just like when a process is killed SIGKILL
-            result = TerminateProcess(process_info.hProcess, 137U);
-            for (auto id: ids)
-            {
-                TerminateProcessByID(id);
-            }
-        }
-        else if (signum == SigNum::PSIGINT)
-        {
-            // pid can be used as a process group id.The signals are sent to the
-            // entire process group, including parents.This event simulates the
-            // pressing of Ctrl+C in the console window, the associated process
-            // may handle the event to perform cleanup or terminate gracefully.
-            result = GenerateConsoleCtrlEvent(static_cast<DWORD>(CTRL_C_EVENT), 0); // pid must be 0
-        }
-        else
-        { // Simulates the pressing of Ctrl+Break, triggering a more forceful
-            // termination of the process.
-            result = GenerateConsoleCtrlEvent(static_cast<DWORD>(CTRL_BREAK_EVENT), pid);
-        }
-    }
-
-    if (!result)
-    {
-        std::string str = LastErrorString();
-        std::cout << "error: " << str << "\n";
+        // The group of a RunOptions::job_object process has the pid as its id.
+        pid_t target = m_kill_group && signum == SigNum::PSIGKILL ? -pid : pid;
+        result = ::kill(target, static_cast<int>(signum)) == 0;
     }
 
     return result;
 }
-#else
 
+ResourceUsage Popen::resource_usage() const
+{
+    return m_usage;
+}
 #endif
 
+MappedFile Popen::mapped_cout() const
+{
+    return m_cout_file != kBadPipeValue ? file_map(m_cout_file) : MappedFile{};
+}
+
+MappedFile Popen::mapped_cerr() const
+{
+    return m_cerr_file != kBadPipeValue ? file_map(m_cerr_file) : MappedFile{};
+}
+
 [[maybe_unused]] bool Popen::terminate() const
 {
     return send_signal(SigNum::PSIGTERM);
@@ -688,77 +1743,268 @@ void Popen::close_cin()
     return ProcessBuilder::windows_args(this->command);
 }
 
-std::string ProcessBuilder::windows_args(const CommandLine& cmd)
+namespace
+{
+/**
+ * @brief Escapes and joins args into one string, like escape_shell_arg() on each of them but without a string per
+ * argument.
+ */
+template <typename Args>
+std::string join_windows_args(const Args& args, std::size_t count)
 {
-    std::string args;
-    for (unsigned int i = 0U; i < cmd.size(); ++i)
+#ifdef _WIN32
+    constexpr bool kEscape = false; // Do not add quote
+#else
+    constexpr bool kEscape = true;
+#endif
+
+    std::size_t size = 0U;
+    for (std::size_t i = 0U; i < count; ++i)
+    {
+        size += std::string_view(args[i]).size() + 3U; // a separator and maybe quotes
+    }
+
+    std::string result;
+    result.reserve(size);
+    for (std::size_t i = 0U; i < count; ++i)
     {
         if (i > 0U)
         {
-            args += ' ';
+            result += ' ';
         }
+        details::append_shell_arg(result, args[i], kEscape);
+    }
+    return result;
+}
+} // namespace
 
-#ifdef _WIN32
-        args += escape_shell_arg(cmd[i], false); // Do not add quote
-#else
-        args += escape_shell_arg(cmd[i]);
-#endif
+std::string ProcessBuilder::windows_args(const CommandLine& cmd)
+{
+    return join_windows_args(cmd, cmd.size());
+}
+
+ArgvBuffer::ArgvBuffer(const CommandLine& command)
+{
+    std::size_t size = 0U;
+    for (const auto& arg : command)
+    {
+        size += arg.size() + 1U;
+    }
+
+    // Reserved up front, so the arena never moves and the pointers into it stay valid.
+    m_arena.reserve(size);
+    m_argv.reserve(command.size() + 1U);
+    for (const auto& arg : command)
+    {
+        m_argv.push_back(m_arena.data() + m_arena.size());
+        (void)m_arena.append(arg).append(1U, '\0');
     }
-    return args;
+    m_argv.push_back(nullptr);
 }
 
-[[maybe_unused]] CompletedProcess run(Popen& popen, bool check)
+CommandLine ArgvBuffer::to_command_line() const
 {
-    CompletedProcess completed;
-    std::thread cout_thread;
-    std::thread cerr_thread;
-    if (popen.cout != kBadPipeValue)
+    CommandLine result;
+    result.reserve(size());
+    for (std::size_t i = 0U; i < size(); ++i)
     {
-        cout_thread = std::thread(
-            [&]()
-            {
-                try
-                {
-                    completed.cout = pipe_read_all(popen.cout);
-                }
-                catch (...)
-                {
-                }
-                (void)pipe_close(popen.cout);
-                popen.cout = kBadPipeValue;
-            });
+        result.emplace_back((*this)[i]);
     }
-    if (popen.cerr != kBadPipeValue)
+    return result;
+}
+
+std::string ArgvBuffer::windows_command_line() const
+{
+    return join_windows_args(*this, size());
+}
+
+Popen ProcessBuilder::run_command(const CommandLine& cmdline)
+{
+    return run_command(CommandLine(cmdline));
+}
+
+void ProcessBuilder::apply_options(const RunOptions& options)
+{
+    if (options.pty)
     {
-        cerr_thread = std::thread(
-            [&]()
+        for (PipeOption* option : {&cin_option, &cout_option, &cerr_option})
+        {
+            if (*option == PipeOption::pipe)
             {
-                try
-                {
-                    completed.cerr = pipe_read_all(popen.cerr);
-                }
-                catch (...)
-                {
-                }
-                (void)pipe_close(popen.cerr);
-                popen.cerr = kBadPipeValue;
-            });
+                *option = PipeOption::pty;
+            }
+        }
+    }
+    pty_size = options.pty.value_or(PtySize{});
+
+    new_process_group = options.new_process_group;
+    job_object = options.job_object;
+    limits = options.limits;
+    create_no_window = options.create_no_window;
+    detached_process = options.detached_process;
+    env = options.env;
+    cwd = options.cwd;
+    cout_pipe_size = options.cout_size_hint;
+    cerr_pipe_size = options.cerr_size_hint;
+}
+
+namespace
+{
+/**
+ * @brief The loop behind Popen::communicate and run().
+ * @return False if the timeout expired before all pipes were done.
+ */
+bool communicate_loop(Popen& popen, std::string_view input, std::string& out, std::string& err, double timeout,
+                      OutputCallback* out_callback = nullptr, OutputCallback* err_callback = nullptr)
+{
+    SUBPROCESS_TRACE_SCOPE(TracePhase::capture, popen.pid);
+    StopWatch watch;
+    std::size_t pos = 0U;
+
+    if (popen.cin != kBadPipeValue)
+    {
+        if (input.empty())
+        {
+            popen.close_cin();
+        }
+        else
+        {
+            pipe_set_blocking(popen.cin, false);
+        }
+    }
+
+#ifndef _WIN32
+    std::optional<details::SigPipeGuard> sigpipe_guard;
+    if (popen.cin != kBadPipeValue)
+    {
+        sigpipe_guard.emplace();
     }
+#endif
+
+    // Reads end on EOF or on any error, except for a signal interrupting the call. With a callback, target is
+    // only the read buffer, and is emptied again after each read.
+    auto drain = [](PipeHandle& handle, std::string& target, size_t& chunk, OutputCallback* callback,
+                    [[maybe_unused]] TraceCounter counter)
+    {
+        ssize_t transfered = pipe_read_append(handle, target, chunk);
+        SUBPROCESS_TRACE_COUNT(counter, static_cast<uint64_t>(std::max<ssize_t>(transfered, 0)));
+        if (callback != nullptr && transfered > 0)
+        {
+            (*callback)(target);
+            target.clear();
+        }
+
+        if (transfered == 0 || (transfered < 0 && !pipe_would_block()))
+        {
+            (void)pipe_close(handle);
+            handle = kBadPipeValue;
+            if (callback != nullptr)
+            {
+                callback->finish();
+            }
+        }
+    };
 
-    if (cout_thread.joinable())
+    bool cin_stalled = false;
+    bool result = true;
+    size_t out_chunk = 0U;
+    size_t err_chunk = 0U;
+
+    while (popen.cin != kBadPipeValue || popen.cout != kBadPipeValue || popen.cerr != kBadPipeValue)
     {
-        cout_thread.join();
+        double remaining = -1.0;
+        if (timeout >= 0.0)
+        {
+            remaining = watch.remaining(timeout);
+            if (remaining <= 0.0)
+            {
+                result = false;
+                break;
+            }
+        }
+
+        // A pipe that accepted nothing is left out for a millisecond, so a full cin on Windows, where writability
+        // cannot be polled, does not turn into a busy loop.
+        PipePollItem items[3] = {{cin_stalled ? kBadPipeValue : popen.cin, true}, {popen.cout}, {popen.cerr}};
+        double wait = cin_stalled ? (remaining < 0.0 ? 0.001 : std::min(remaining, 0.001)) : remaining;
+        cin_stalled = false;
+
+        if (pipe_poll(&items[0], 3U, wait) == 0)
+        {
+            continue;
+        }
+
+        if (items[0].ready)
+        {
+            std::size_t size = std::min<std::size_t>(input.size() - pos, 65536U);
+            ssize_t transfered = pipe_write(popen.cin, input.data() + pos, size);
+            if (transfered > 0)
+            {
+                pos += static_cast<size_t>(transfered);
+                SUBPROCESS_TRACE_COUNT(TraceCounter::cin_bytes, static_cast<uint64_t>(transfered));
+            }
+            else if (transfered == 0)
+            {
+                cin_stalled = true;
+            }
+            else
+            {
+                // The child closed its end, the rest of the input is dropped like in Python.
+                pos = input.size();
+            }
+
+            if (pos >= input.size())
+            {
+                popen.close_cin();
+            }
+        }
+
+        if (items[1].ready)
+        {
+            drain(popen.cout, out, out_chunk, out_callback, TraceCounter::cout_bytes);
+        }
+
+        if (items[2].ready)
+        {
+            drain(popen.cerr, err, err_chunk, err_callback, TraceCounter::cerr_bytes);
+        }
     }
 
-    if (cerr_thread.joinable())
+    return result;
+}
+} // namespace
+
+bool Popen::wait_streams(double timeout)
+{
+    return !m_streams || m_streams->wait(timeout);
+}
+
+std::pair<std::string, std::string> Popen::communicate(std::string_view input, double timeout)
+{
+    std::pair<std::string, std::string> result;
+
+    if (!communicate_loop(*this, input, result.first, result.second, timeout))
     {
-        cerr_thread.join();
+        throw TimeoutExpired("timeout of " + std::to_string(timeout) + " expired", args, timeout,
+                             std::move(result.first), std::move(result.second));
     }
 
+    return result;
+}
+
+[[maybe_unused]] CompletedProcess run(Popen& popen, bool check)
+{
+    CompletedProcess completed;
+    (void)communicate_loop(popen, {}, completed.cout, completed.cerr, -1.0);
+
     (void)popen.wait();
     completed.returncode = popen.returncode;
+    completed.usage = popen.resource_usage();
+    completed.cout_file = popen.mapped_cout();
+    completed.cerr_file = popen.mapped_cerr();
+    completed.argv = popen.argv();
     completed.args = CommandLine(popen.args.begin() + 1, popen.args.end());
-    if (check)
+    if (check && completed.returncode != 0)
     {
         throw CalledProcessError{"failed to execute " + popen.args[0U], popen.args, completed.returncode,
                                  completed.cout, completed.cerr};
@@ -768,104 +2014,73 @@ std::string ProcessBuilder::windows_args(const CommandLine& cmd)
 
 CompletedProcess run(CommandLine command, const RunOptions& options)
 {
-    Popen popen(command, options);
+    StopWatch watch;
+    Popen popen(command, options, false); // command is moved into popen.args
     CompletedProcess completed;
-    std::thread cout_thread;
-    std::thread cerr_thread;
-
-    if (popen.cout != kBadPipeValue)
-    {
-        cout_thread = std::thread(
-            [&]()
-            {
-                try
-                {
-                    completed.cout = pipe_read_all(popen.cout);
-                }
-                catch (...)
-                {
-                }
-                (void)pipe_close(popen.cout);
-                popen.cout = kBadPipeValue;
-            });
-    }
+    completed.cout.reserve(options.cout_size_hint);
+    completed.cerr.reserve(options.cerr_size_hint);
 
-    if (popen.cerr != kBadPipeValue)
+    std::string_view input = get_pipe_input(options.cin).value_or(std::string_view{});
+    std::optional<OutputCallback> out_callback;
+    std::optional<OutputCallback> err_callback;
+    if (const auto* callback = std::get_if<OutputCallback>(&options.cout); callback != nullptr)
     {
-        cerr_thread = std::thread(
-            [&]()
-            {
-                try
-                {
-                    completed.cerr = pipe_read_all(popen.cerr);
-                }
-                catch (...)
-                {
-                }
-                (void)pipe_close(popen.cerr);
-                popen.cerr = kBadPipeValue;
-            });
+        out_callback = *callback;
     }
-
-    if (cout_thread.joinable())
+    if (const auto* callback = std::get_if<OutputCallback>(&options.cerr); callback != nullptr)
     {
-        cout_thread.join();
+        err_callback = *callback;
     }
 
-    if (cerr_thread.joinable())
-    {
-        cerr_thread.join();
-    }
+    bool in_time = communicate_loop(popen, input, completed.cout, completed.cerr, options.timeout,
+                                    out_callback ? &*out_callback : nullptr, err_callback ? &*err_callback : nullptr);
 
     try
     {
-        (void)popen.wait(options.timeout);
+        if (!in_time)
+        {
+            throw subprocess::TimeoutExpired{"timeout of " + std::to_string(options.timeout) + " expired"};
+        }
+
+        double remaining = watch.remaining(options.timeout);
+        (void)popen.wait(remaining);
     }
     catch (subprocess::TimeoutExpired&)
     {
         (void)popen.send_signal(subprocess::SigNum::PSIGTERM);
         (void)popen.wait();
-        throw subprocess::TimeoutExpired{"subprocess::run timeout reached", command, options.timeout, completed.cout,
-                                         completed.cerr};
+        throw subprocess::TimeoutExpired{"subprocess::run timeout reached", popen.args, options.timeout,
+                                         completed.cout, completed.cerr};
     }
 
     completed.returncode = popen.returncode;
-    completed.args = command;
+    completed.usage = popen.resource_usage();
+    completed.cout_file = popen.mapped_cout();
+    completed.cerr_file = popen.mapped_cerr();
+    completed.argv = popen.argv();
+    completed.args = std::move(popen.args);
     if (options.raise_on_nonzero && completed.returncode != 0)
     {
-        throw CalledProcessError{"failed to execute " + command[0U], command, completed.returncode, completed.cout,
-                                 completed.cerr};
+        throw CalledProcessError{"failed to execute " + completed.args[0U], completed.args, completed.returncode,
+                                 completed.cout, completed.cerr};
     }
     return completed;
 }
 
-double StopWatch::monotonic_seconds()
+StopWatch::duration StopWatch::now()
 {
-    static bool needs_init = true;
-    static std::chrono::steady_clock::time_point begin;
-    static double last_value = 0.0F;
-
-    if (needs_init)
+    // Ticks since the epoch of steady_clock, so there is no origin to initialize. steady_clock is built on
+    // CLOCK_MONOTONIC or QueryPerformanceCounter.
+    static std::atomic<duration::rep> last{0};
+    duration::rep ticks =
+        std::chrono::duration_cast<duration>(std::chrono::steady_clock::now().time_since_epoch()).count();
+
+    // Some OS's have had clocks going backwards between cores. The latest value handed out wins.
+    duration::rep previous = last.load(std::memory_order_relaxed);
+    while (ticks > previous && !last.compare_exchange_weak(previous, ticks, std::memory_order_relaxed))
     {
-        begin = std::chrono::steady_clock::now();
-        needs_init = false;
     }
-
-    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
-    std::chrono::duration<double> duration = now - begin;
-    double result = duration.count();
-
-    // Some OS's have bugs and not exactly monotonic, or perhaps there are
-    // floating point errors or something. I don't know.
-    if (result < last_value)
-    {
-        result = last_value;
-    }
-    else
-    {
-        last_value = result;
-    }
-    return result;
+    return duration{std::max(ticks, previous)};
 }
 
 } // namespace subprocess
\ No newline at end of file
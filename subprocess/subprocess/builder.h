@@ -1,10 +1,16 @@
 #pragma once
 
+#include <chrono>
+#include <cstdint>
 #include <initializer_list>
+#include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <utility>
 #include <vector>
 
+#include "environ.h"
 #include "pipe.h"
 #include "pipevar.hpp"
 
@@ -15,6 +21,54 @@ namespace subprocess
 std::string LastErrorString();
 #endif
 
+/**
+ * @brief Limits applied to a child process when it is started, see
+ * RunOptions::limits.
+ *
+ * On POSIX they are set as soft limits with setrlimit() and the affinity with
+ * sched_setaffinity() in the child, which then goes through fork() instead of
+ * posix_spawn(). On Windows the child is put in a Job Object carrying the
+ * limits, as with RunOptions::job_object.
+ */
+struct ResourceLimits
+{
+    /**
+     * @brief CPU time in seconds, negative for no limit.
+     *
+     * RLIMIT_CPU, rounded up to whole seconds, on POSIX, where the process
+     * gets SIGXCPU once exceeded. On Windows the user mode time of each
+     * process in the job, which is then terminated.
+     */
+    double cpu_seconds{-1.0}; // NOLINT
+
+    /** @brief Address space in bytes, RLIMIT_AS, or the committed memory of each process on Windows. 0 for none. */
+    uint64_t address_space{0U}; // NOLINT
+
+    /** @brief Number of open file descriptors, RLIMIT_NOFILE. 0 for none, ignored on Windows. */
+    uint64_t open_files{0U}; // NOLINT
+
+    /**
+     * @brief CPUs the process may run on, empty for all.
+     *
+     * Supported on Linux and Windows, where only the first 64 CPUs can be
+     * used. Elsewhere the spawn throws std::domain_error.
+     */
+    std::vector<int> cpus{}; // NOLINT
+
+    /**
+     * @brief NUMA node whose CPUs the process may run on, negative for any.
+     *
+     * Restricts cpus further if both are given. Supported like cpus.
+     */
+    int numa_node{-1}; // NOLINT
+
+    /** @brief True if no limit is set. */
+    [[nodiscard]] bool empty() const
+    {
+        return cpu_seconds < 0.0 && address_space == 0U && open_files == 0U && cpus.empty() && numa_node < 0;
+    }
+};
+
 /**
  * @brief Struct representing options for configuring a subprocess.
  *
@@ -36,6 +90,23 @@ struct RunOptions
      *
      * If a pipe handle is used, it will be made inheritable automatically
      * when the process is created and closed on the parent's end.
+     *
+     * A FILE* on a seekable file is handed to the child as a handle, starting
+     * at the stream's position. Other FILE* input is copied over by the
+     * IoReactor.
+     *
+     * In-memory input is written from where it is, without a copy, if given
+     * as a std::span<const std::byte>, which must stay valid until the input
+     * is written, or as a std::shared_ptr<const std::string>. A std::string
+     * is copied once by a Popen created from const RunOptions, and moved
+     * otherwise. For example, to pass a large buffer:
+     *
+     * @code
+     * subprocess::run({"wc", "-c"}, {.cin = std::as_bytes(std::span{buffer})});
+     * @endcode
+     *
+     * Input generated while the child runs is pulled from an InputProducer,
+     * as fast as the child takes it.
      */
     PipeVar cin{PipeOption::inherit}; // NOLINT
 
@@ -44,6 +115,19 @@ struct RunOptions
      *
      * If a pipe handle is used, it will be made inheritable automatically
      * when the process is created and closed on the parent's end.
+     *
+     * A FILE* with a descriptor is flushed and handed to the child as a
+     * handle, so the output never passes through this process.
+     *
+     * An OutputCallback receives the output while the child runs. run()
+     * calls it from its own loop, with CompletedProcess::cout left empty;
+     * a Popen has it called from an IoReactor worker.
+     *
+     * PipeOption::mmap_file has the child write into an anonymous file, so
+     * huge output takes neither heap nor a pass through this process. run()
+     * maps it into CompletedProcess::cout_file, see Popen::mapped_cout().
+     *
+     * A Tee sends the output to several sinks at once, with bounded memory.
      */
     PipeVar cout{PipeOption::inherit}; // NOLINT
 
@@ -52,6 +136,12 @@ struct RunOptions
      *
      * If a pipe handle is used, it will be made inheritable automatically
      * when the process is created and closed on the parent's end.
+     *
+     * A FILE* with a descriptor is flushed and handed to the child as a
+     * handle, so the output never passes through this process.
+     *
+     * An OutputCallback is called as for cout, PipeOption::mmap_file output
+     * ends up in CompletedProcess::cerr_file, and a Tee works as for cout.
      */
     PipeVar cerr{PipeOption::inherit}; // NOLINT
 
@@ -76,6 +166,24 @@ struct RunOptions
      */
     bool new_process_group{false}; // NOLINT
 
+    /**
+     * @brief Set to true to track the process and all its descendants as one
+     * tree.
+     *
+     * On Windows the process is started suspended and assigned to a new Job
+     * Object before it runs. kill() then ends the whole job at once with
+     * TerminateJobObject, and resource_usage() reports CPU time, peak memory
+     * and I/O of the job. On POSIX the process leads a new process group,
+     * which kill() signals as a whole. Descendants that leave the job or the
+     * group are not reached.
+     */
+    bool job_object{false}; // NOLINT
+
+    /**
+     * @brief Resource limits and CPU affinity of the new process.
+     */
+    ResourceLimits limits{}; // NOLINT
+
     /**
      * @brief Current working directory for the new process to use.
      */
@@ -85,6 +193,7 @@ struct RunOptions
      * @brief Timeout in seconds. Raises TimeoutExpired exception if exceeded.
      *
      * This option is only available when using the subprocess_run function.
+     * It covers reading the output as well as waiting for the exit.
      */
     double timeout{-1}; // NOLINT
 
@@ -96,11 +205,64 @@ struct RunOptions
 
     /**
      * @brief If empty, inherits environment variables from the current process.
+     *
+     * Assigning an EnvMap encodes it on the spot. Build an EnvBlock once to
+     * share it between many spawns, with EnvBlock::with() for variations.
+     */
+    EnvBlock env{}; // NOLINT
+
+    /**
+     * @brief Expected size of the cout output in bytes, 0 if unknown.
+     *
+     * subprocess::run() reserves CompletedProcess::cout once instead of
+     * growing it, and the cout pipe gets a buffer of up to this size, so the
+     * child blocks less often. See pipe_create for the limits.
+     */
+    std::size_t cout_size_hint{0U}; // NOLINT
+
+    /**
+     * @brief Expected size of the cerr output in bytes, 0 if unknown.
+     *
+     * See cout_size_hint.
      */
-    EnvMap env{}; // NOLINT
+    std::size_t cerr_size_hint{0U}; // NOLINT
+
+    /**
+     * @brief If set, runs the child on a new pseudo-terminal of this size.
+     *
+     * Tools that block-buffer, or write a byte at a time, when their output
+     * is not a terminal then stream it in their interactive modes. Every
+     * stream that would get a pipe, i.e. PipeOption::pipe, in-memory input,
+     * streams, callbacks and Tee, is connected to the terminal instead and
+     * serviced as before. PipeOption::pty selects the terminal for a single
+     * stream, at 80x24 unless this is set.
+     *
+     * There is one terminal: cerr output on it arrives in cout if cout is on
+     * it too, leaving Popen::cerr unset. Input is not echoed, but output is
+     * otherwise as a terminal makes it, e.g. lines end in "\r\n". Closing cin
+     * does not end the input, the terminal's end-of-file character, "\x04" at
+     * the start of a line, does. See Popen::resize_pty().
+     *
+     * POSIX uses posix_openpt, and the child leads a new session with the
+     * terminal as its controlling terminal. Windows uses a pseudo console,
+     * CreatePseudoConsole, which takes all of cin, cout and cerr, so the
+     * other streams must be left to inherit, and its output is VT text.
+     */
+    std::optional<PtySize> pty{}; // NOLINT
 };
 
 class ProcessBuilder;
+class IoCompletion;
+class AsyncWait;
+template <typename T>
+class Task;
+
+namespace details
+{
+class ExitWatcher;
+struct ExitSignal;
+struct PseudoConsole;
+} // namespace details
 
 /**
  * @brief Represents an active running process, similar in design to
@@ -129,6 +291,9 @@ public:
 
     /**
      * @brief Constructor that starts a command with specified options.
+     *
+     * A std::string cin is moved to the IoReactor instead of copied.
+     *
      * @param command The command line to be executed.
      * @param options The run options for the process.
      */
@@ -156,7 +321,8 @@ public:
 
     /**
      * @brief Stream to get output of the process. Ownership is held by
-     * this class.
+     * this class. For PipeOption::pipe on Windows it is overlapped, see
+     * pipe_create_overlapped(); read it with pipe_read.
      */
     PipeHandle cout{kBadPipeValue}; // NOLINT
 
@@ -181,6 +347,15 @@ public:
      */
     CommandLine args{}; // NOLINT
 
+    /**
+     * @brief The arguments as they were spawned, in one block, see
+     * CompletedProcess::argv. nullptr for a Popen that was not started.
+     */
+    [[nodiscard]] const std::shared_ptr<const ArgvBuffer>& argv() const
+    {
+        return m_argv;
+    }
+
     /**
      * @brief Ignores and closes the cout stream.
      */
@@ -212,8 +387,80 @@ public:
      */
     int64_t wait(double timeout = -1.0F);
 
+    /**
+     * @brief Writes input to cin, then reads cout and cerr to end-of-file.
+     *
+     * All pipes are served from a single poll loop on the calling thread, no
+     * threads are created. cin is closed once all input has been written,
+     * cout and cerr are closed once drained. Pipes not connected to the parent
+     * are skipped. Similar to Popen.communicate in Python, this does not wait
+     * for the process to exit.
+     *
+     * @param input Data to write to cin, ignored if cin is not a pipe.
+     * @param timeout Timeout in seconds. Defaults to -1 (wait forever).
+     * @return The output read from cout and cerr.
+     * @throws TimeoutExpired If the pipes are not drained in time. The
+     * exception carries the output read so far.
+     * @throws OSError If there was an OS-level error.
+     */
+    std::pair<std::string, std::string> communicate(std::string_view input = {}, double timeout = -1.0);
+
+    /**
+     * @brief Waits for the redirections set up from RunOptions to finish.
+     *
+     * std::string, std::istream and FILE* input and std::ostream and FILE*
+     * output are serviced by the IoReactor. Output is complete once the
+     * child, and anything it handed its pipes to, closed them. close() calls
+     * this, so a redirected stream only has to outlive the Popen.
+     *
+     * @note An std::istream that blocks, e.g. an interactive std::cin, keeps
+     * the wait going until it returns.
+     * @param timeout Timeout in seconds. Defaults to -1 (wait forever).
+     * @return False if the timeout expired first.
+     */
+    bool wait_streams(double timeout = -1.0);
+
+    /**
+     * @brief Awaitable version of wait(), for use with co_await.
+     *
+     * The coroutine is resumed once the process has exited and was reaped,
+     * co_await yields the return code. See async.h.
+     */
+    [[nodiscard]] AsyncWait async_wait();
+
+    /**
+     * @brief Maps the output written so far to a PipeOption::mmap_file cout.
+     *
+     * Once the process has exited the mapping holds all of it. It stays
+     * valid after the Popen is closed.
+     *
+     * @return The mapped output, empty if cout is not a PipeOption::mmap_file.
+     * @throws OSError If the file could not be mapped.
+     */
+    [[nodiscard]] MappedFile mapped_cout() const;
+
+    /**
+     * @brief Maps the output written so far to a PipeOption::mmap_file cerr.
+     * See mapped_cout().
+     */
+    [[nodiscard]] MappedFile mapped_cerr() const;
+
+    /**
+     * @brief Gives the resources used by the process.
+     *
+     * On POSIX the usage is known once the process has been waited for, and
+     * all fields are 0 before. On Windows it is queried from the process, or
+     * its job, as long as the Popen is not closed.
+     *
+     * @throws OSError If the job could not be queried.
+     */
+    [[nodiscard]] ResourceUsage resource_usage() const;
+
     /**
      * @brief Sends a signal to the process.
+     *
+     * With RunOptions::job_object, PSIGKILL reaches the whole process tree.
+     *
      * @param signal The signal to send.
      * @return True if the signal was successfully sent.
      */
@@ -241,6 +488,13 @@ public:
      */
     void close_cin();
 
+    /**
+     * @brief Changes the size of the terminal of RunOptions::pty. The child
+     * gets SIGWINCH on POSIX.
+     * @return False if the process has no terminal, or it could not be resized.
+     */
+    bool resize_pty(PtySize size);
+
     /**
      * Kills the process by sending CTRL_BREAK_EVENT signal. This makes kill()
      * the same as terminate().
@@ -252,22 +506,65 @@ public:
     }
 
     friend ProcessBuilder;
+    friend details::ExitWatcher;
+    friend AsyncWait;
+    friend CompletedProcess run(CommandLine command, const RunOptions& options);
+    friend Task<CompletedProcess> async_run(CommandLine command, RunOptions options);
 
 private:
+    /**
+     * @brief Constructor used by run(), which writes in-memory cin data
+     * and calls OutputCallback output itself instead of redirecting them.
+     * command is moved into args.
+     */
+    Popen(CommandLine& command, const RunOptions& options, bool redirect);
+
     /**
      * @brief Initializes the Popen object with the given command and options.
-     * @param pipe The command line to be executed.
+     * @param pipe The command line to be executed, moved into args once
+     * the process started.
      * @param pipeOpt The run options for the process.
+     * @param redirect If false, in-memory cin data and OutputCallback
+     * output get plain pipes and the caller is responsible for servicing
+     * them.
      */
-    void init(CommandLine& pipe, RunOptions& pipeOpt);
+    void init(CommandLine& pipe, const RunOptions& pipeOpt, bool redirect = true);
 
 #ifdef _WIN32
     /**
      * @brief Process information specific to Windows.
      */
     PROCESS_INFORMATION process_info{};
+
+    /** @brief The job of RunOptions::job_object, owned by this class. */
+    HANDLE m_job{nullptr};
+
+    /** @brief The pseudo console of RunOptions::pty, closed once the process exits. */
+    std::shared_ptr<details::PseudoConsole> m_pty;
+
+    /** @brief The thread pool wait of details::ExitWatcher, registered once on first use. */
+    std::shared_ptr<details::ExitSignal> m_exit_signal;
+#else
+    /** @brief The terminal of RunOptions::pty, owned by this class. */
+    PipeHandle m_pty{kBadPipeValue};
+
+    /** @brief The pidfd of details::ExitWatcher, opened once on first use and owned by this class. */
+    PipeHandle m_pidfd{kBadPipeValue};
+
+    /** @brief True if pid leads a process group of RunOptions::job_object. */
+    bool m_kill_group{false};
+
+    /** @brief Filled in from wait4() when the process is reaped. */
+    ResourceUsage m_usage{};
+    std::chrono::steady_clock::time_point m_started{};
 #endif
     bool m_soft_kill {false};
+    std::shared_ptr<IoCompletion> m_streams;
+    std::shared_ptr<const ArgvBuffer> m_argv;
+
+    /** @brief The files of PipeOption::mmap_file output, owned by this class. */
+    PipeHandle m_cout_file{kBadPipeValue};
+    PipeHandle m_cerr_file{kBadPipeValue};
 };
 
 /**
@@ -335,22 +632,54 @@ public:
      */
     bool new_process_group{false}; // NOLINT
 
+    /**
+     * @brief Flag indicating the process tree is tracked by a job object, or a
+     * process group on POSIX.
+     */
+    bool job_object{false}; // NOLINT
+
+    /**
+     * @brief Resource limits and CPU affinity of the child process.
+     */
+    ResourceLimits limits{}; // NOLINT
+
     /**
      * @brief Command line to be executed. If empty, inherits from the
      * current process.
      */
     CommandLine command{}; // NOLINT
 
+    /**
+     * @brief The resolved path of the program to run, empty to look up the
+     * first argument with find_program on each run_command. See SpawnTemplate.
+     */
+    std::string program{}; // NOLINT
+
     /**
      * @brief Environment variables for the child process.
      */
-    EnvMap env{}; // NOLINT
+    EnvBlock env{}; // NOLINT
 
     /**
      * @brief Current working directory for the child process.
      */
     std::string cwd{}; // NOLINT
 
+    /**
+     * @brief Requested buffer size of the cout pipe, 0 for the system default.
+     */
+    std::size_t cout_pipe_size{0U}; // NOLINT
+
+    /**
+     * @brief Requested buffer size of the cerr pipe, 0 for the system default.
+     */
+    std::size_t cerr_pipe_size{0U}; // NOLINT
+
+    /**
+     * @brief Size of the terminal of PipeOption::pty streams.
+     */
+    PtySize pty_size{}; // NOLINT
+
     /**
      * @brief Gets the Windows command string.
      * @return The Windows command string, which is supposed to be the first
@@ -373,6 +702,14 @@ public:
      */
     static std::string windows_args(const CommandLine& cmd);
 
+    /**
+     * @brief Takes over the options that are not about the streams, and
+     * turns PipeOption::pipe streams into PipeOption::pty ones if
+     * RunOptions::pty is set. The streams must be set before.
+     * @param options The options of Popen or SpawnTemplate.
+     */
+    void apply_options(const RunOptions& options);
+
     /**
      * @brief Runs the process using the stored command line.
      * @return The Popen object representing the running process.
@@ -388,6 +725,12 @@ public:
      * @return The Popen object representing the running process.
      */
     Popen run_command(const CommandLine& cmdline);
+
+    /**
+     * @brief Like run_command(const CommandLine&), but moves cmdline into
+     * Popen::args instead of copying it.
+     */
+    Popen run_command(CommandLine&& cmdline);
 };
 
 /**
@@ -487,6 +830,17 @@ struct RunBuilder
         return *this;
     }
 
+    /**
+     * @brief Sets the cin option, moving e.g. a std::string in.
+     * @param cin The input option for the command.
+     * @return A reference to the RunBuilder.
+     */
+    RunBuilder& cin(PipeVar&& cin)
+    {
+        options.cin = std::move(cin);
+        return *this;
+    }
+
     /**
      * @brief Sets the cout option. Could be a PipeOption, output handle.
      * @param cout The output option for the command.
@@ -527,7 +881,7 @@ struct RunBuilder
      * @param env The environment variables for the subprocess.
      * @return A reference to the RunBuilder.
      */
-    [[maybe_unused]] RunBuilder& env(const EnvMap& env)
+    [[maybe_unused]] RunBuilder& env(const EnvBlock& env)
     {
         options.env = env;
         return *this;
@@ -555,6 +909,61 @@ struct RunBuilder
         return *this;
     }
 
+    /**
+     * @brief Sets the expected size of the cout output.
+     * @param size The expected size in bytes.
+     * @return A reference to the RunBuilder.
+     */
+    [[maybe_unused]] RunBuilder& cout_size_hint(std::size_t size)
+    {
+        options.cout_size_hint = size;
+        return *this;
+    }
+
+    /**
+     * @brief Sets the expected size of the cerr output.
+     * @param size The expected size in bytes.
+     * @return A reference to the RunBuilder.
+     */
+    [[maybe_unused]] RunBuilder& cerr_size_hint(std::size_t size)
+    {
+        options.cerr_size_hint = size;
+        return *this;
+    }
+
+    /**
+     * @brief Runs the child on a pseudo-terminal, see RunOptions::pty.
+     * @param size The size of the terminal.
+     * @return A reference to the RunBuilder.
+     */
+    [[maybe_unused]] RunBuilder& pty(PtySize size = {})
+    {
+        options.pty = size;
+        return *this;
+    }
+
+    /**
+     * @brief Sets to true to track the process tree, see RunOptions::job_object.
+     * @param job Flag to indicate whether to use a job object.
+     * @return A reference to the RunBuilder.
+     */
+    [[maybe_unused]] RunBuilder& job_object(bool job)
+    {
+        options.job_object = job;
+        return *this;
+    }
+
+    /**
+     * @brief Sets the resource limits and CPU affinity of the process.
+     * @param limits The limits to apply.
+     * @return A reference to the RunBuilder.
+     */
+    [[maybe_unused]] RunBuilder& limits(const ResourceLimits& limits)
+    {
+        options.limits = limits;
+        return *this;
+    }
+
     [[maybe_unused]] RunBuilder& create_no_window(bool no_window)
     {
         options.create_no_window = no_window;
@@ -605,28 +1014,75 @@ struct RunBuilder
  */
 [[maybe_unused]] double sleep_seconds(double seconds);
 
+/**
+ * @brief Measures time from its start, on a monotonic clock in integer
+ * nanoseconds that is safe to read from any thread.
+ *
+ * Timeouts in seconds are converted to ticks once, so deadlines are compared
+ * without floating point rounding.
+ */
 class StopWatch
 {
 public:
-    StopWatch() : m_start(0.0F)
+    using duration = std::chrono::nanoseconds;
+
+    StopWatch() : m_start(now())
     {
-        Start();
     }
 
     void Start()
     {
-        m_start = monotonic_seconds();
+        m_start = now();
+    }
+
+    /** @brief The time since the start. */
+    [[nodiscard]] duration elapsed() const
+    {
+        return now() - m_start;
     }
 
     [[nodiscard]] double seconds() const
     {
-        return monotonic_seconds() - m_start;
+        return std::chrono::duration<double>(elapsed()).count();
     }
 
-private:
-    static double monotonic_seconds();
+    /**
+     * @brief The seconds left of a timeout counted from the start.
+     * @return 0.0 once expired, -1.0 for a negative timeout, which expires never.
+     */
+    [[nodiscard]] double remaining(double timeout) const
+    {
+        if (timeout < 0.0)
+        {
+            return -1.0;
+        }
 
-    double m_start;
+        duration left = to_duration(timeout) - elapsed();
+        return left.count() <= 0 ? 0.0 : std::chrono::duration<double>(left).count();
+    }
+
+    /** @brief True if a non-negative timeout counted from the start has passed. */
+    [[nodiscard]] bool expired(double timeout) const
+    {
+        return timeout >= 0.0 && elapsed() >= to_duration(timeout);
+    }
+
+    /**
+     * @brief The current time of the clock. It never goes backwards, also not
+     * between threads.
+     */
+    [[nodiscard]] static duration now();
+
+    /** @brief Converts seconds to ticks, saturating for huge values. */
+    [[nodiscard]] static duration to_duration(double seconds)
+    {
+        constexpr double kMaxSeconds = 9.2e9; // a bit less than duration::max()
+        return seconds >= kMaxSeconds ? duration::max()
+                                      : std::chrono::duration_cast<duration>(std::chrono::duration<double>(seconds));
+    }
+
+private:
+    duration m_start;
 };
 
 #ifndef _WIN32
@@ -0,0 +1,822 @@
+#ifndef _WIN32
+
+#include "builder.h"
+
+#include <fcntl.h>
+#include <sched.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <format>
+#include <fstream>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+
+#include "environ.h"
+#include "shellutils.h"
+#include "trace.h"
+
+extern "C" char** environ;
+
+// posix_spawn_file_actions_addchdir_np is available since glibc 2.29 and macOS 10.15. Without it, a cwd request
+// has to go through the fork() fallback below.
+#if defined(__APPLE__) || (defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29)))
+#define SUBPROCESS_HAVE_ADDCHDIR_NP 1
+#else
+#define SUBPROCESS_HAVE_ADDCHDIR_NP 0
+#endif
+
+namespace subprocess
+{
+
+namespace
+{
+
+/**
+ * @brief A single step of the child's file descriptor layout.
+ *
+ * The layout is recorded once and then either translated to posix_spawn file actions, or replayed by hand in the
+ * child of the fork() fallback, so both paths produce exactly the same standard handles.
+ */
+struct FdAction
+{
+    enum class Kind
+    {
+        dup2, ///< dup2(source, fd)
+        open  ///< open(path, flags) as fd
+    };
+
+    Kind kind;
+    int fd;
+    int source;
+    const char* path;
+    int flags;
+};
+
+/** @brief RAII wrapper of posix_spawn_file_actions_t. */
+class SpawnFileActions
+{
+public:
+    SpawnFileActions()
+    {
+        details::throw_os_error("posix_spawn_file_actions_init", posix_spawn_file_actions_init(&m_actions));
+    }
+
+    ~SpawnFileActions()
+    {
+        (void)posix_spawn_file_actions_destroy(&m_actions);
+    }
+
+    SpawnFileActions(const SpawnFileActions&) = delete;
+    SpawnFileActions& operator=(const SpawnFileActions&) = delete;
+
+    void add(const FdAction& action)
+    {
+        if (action.kind == FdAction::Kind::dup2)
+        {
+            details::throw_os_error("posix_spawn_file_actions_adddup2",
+                                    posix_spawn_file_actions_adddup2(&m_actions, action.source, action.fd));
+        }
+        else
+        {
+            details::throw_os_error(
+                "posix_spawn_file_actions_addopen",
+                posix_spawn_file_actions_addopen(&m_actions, action.fd, action.path, action.flags, 0));
+        }
+    }
+
+#if SUBPROCESS_HAVE_ADDCHDIR_NP
+    void add_chdir(const std::string& path)
+    {
+        details::throw_os_error("posix_spawn_file_actions_addchdir_np",
+                                posix_spawn_file_actions_addchdir_np(&m_actions, path.c_str()));
+    }
+#endif
+
+    posix_spawn_file_actions_t* get()
+    {
+        return &m_actions;
+    }
+
+private:
+    posix_spawn_file_actions_t m_actions{};
+};
+
+/** @brief RAII wrapper of posix_spawnattr_t. */
+class SpawnAttr
+{
+public:
+    SpawnAttr()
+    {
+        details::throw_os_error("posix_spawnattr_init", posix_spawnattr_init(&m_attr));
+    }
+
+    ~SpawnAttr()
+    {
+        (void)posix_spawnattr_destroy(&m_attr);
+    }
+
+    SpawnAttr(const SpawnAttr&) = delete;
+    SpawnAttr& operator=(const SpawnAttr&) = delete;
+
+    posix_spawnattr_t* get()
+    {
+        return &m_attr;
+    }
+
+private:
+    posix_spawnattr_t m_attr{};
+};
+
+/**
+ * @brief A new pseudo-terminal for PipeOption::pty. Both ends are close-on-exec, the child opens the terminal by
+ * its path, which makes it the controlling terminal of its new session.
+ */
+class PtyPair
+{
+public:
+    PtyPair() = default;
+
+    ~PtyPair()
+    {
+        close_slave();
+        if (m_master >= 0)
+        {
+            (void)::close(m_master);
+        }
+    }
+
+    PtyPair(const PtyPair&) = delete;
+    PtyPair& operator=(const PtyPair&) = delete;
+
+    /**
+     * @brief Opens the terminal. Echo is turned off, so input written to cin does not come back in cout.
+     * @throws OSError If the terminal could not be opened.
+     */
+    void open(const PtySize& size)
+    {
+#ifdef __APPLE__
+        // Only O_RDWR and O_NOCTTY are accepted here.
+        m_master = posix_openpt(O_RDWR | O_NOCTTY);
+        if (m_master >= 0)
+        {
+            (void)fcntl(m_master, F_SETFD, FD_CLOEXEC);
+        }
+#else
+        m_master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+#endif
+        if (m_master < 0)
+        {
+            details::throw_os_error("posix_openpt", errno);
+        }
+
+        if (grantpt(m_master) != 0 || unlockpt(m_master) != 0)
+        {
+            details::throw_os_error("grantpt", errno);
+        }
+
+        char name[128];
+        if (int ec = ptsname_r(m_master, name, sizeof(name)); ec != 0)
+        {
+            details::throw_os_error("ptsname_r", ec == -1 ? errno : ec);
+        }
+        m_path = name;
+
+        m_slave = ::open(name, O_RDWR | O_NOCTTY | O_CLOEXEC);
+        if (m_slave < 0)
+        {
+            details::throw_os_error("open", errno);
+        }
+
+        termios mode{};
+        if (tcgetattr(m_slave, &mode) == 0)
+        {
+            mode.c_lflag &= ~static_cast<tcflag_t>(ECHO | ECHONL);
+            (void)tcsetattr(m_slave, TCSANOW, &mode);
+        }
+        resize(m_master, size);
+    }
+
+    [[nodiscard]] bool is_open() const
+    {
+        return m_master >= 0;
+    }
+
+    [[nodiscard]] const char* path() const
+    {
+        return m_path.c_str();
+    }
+
+    /** @brief Closes the parent's slave, once the child has its own. */
+    void close_slave()
+    {
+        if (m_slave >= 0)
+        {
+            (void)::close(m_slave);
+            m_slave = -1;
+        }
+    }
+
+    /** @brief A new close-on-exec descriptor of the master, for one of cin, cout or cerr. */
+    [[nodiscard]] PipeHandle dup() const
+    {
+        PipeHandle result = fcntl(m_master, F_DUPFD_CLOEXEC, 0);
+        if (result < 0)
+        {
+            details::throw_os_error("fcntl", errno);
+        }
+        return result;
+    }
+
+    /** @brief Gives up ownership of the master. */
+    PipeHandle release()
+    {
+        return std::exchange(m_master, -1);
+    }
+
+    static bool resize(PipeHandle master, const PtySize& size)
+    {
+        winsize window{};
+        window.ws_col = size.columns;
+        window.ws_row = size.rows;
+        return ioctl(master, TIOCSWINSZ, &window) == 0;
+    }
+
+private:
+    PipeHandle m_master{-1};
+    PipeHandle m_slave{-1};
+    std::string m_path;
+};
+
+using RlimitResource = decltype(RLIMIT_CPU);
+
+/** @brief ResourceLimits in the form the child of fork() applies them, prepared by the parent. */
+struct ChildLimits
+{
+    std::vector<std::pair<RlimitResource, rlimit>> rlimits;
+#ifdef __linux__
+    bool affinity{false};
+    cpu_set_t cpus{};
+#endif
+
+    [[nodiscard]] bool empty() const
+    {
+#ifdef __linux__
+        return rlimits.empty() && !affinity;
+#else
+        return rlimits.empty();
+#endif
+    }
+};
+
+#ifdef __linux__
+/** @brief Reads the CPUs of a NUMA node from sysfs, where they are listed like "0-3,8-11". */
+std::vector<int> numa_node_cpus(int node)
+{
+    std::ifstream file(std::format("/sys/devices/system/node/node{}/cpulist", node));
+    if (!file)
+    {
+        throw std::invalid_argument(std::format("NUMA node {} not found", node));
+    }
+
+    std::vector<int> result;
+    std::string range;
+    while (std::getline(file, range, ','))
+    {
+        int first = 0;
+        int last = 0;
+        if (int count = std::sscanf(range.c_str(), "%d-%d", &first, &last); count == 1)
+        {
+            last = first;
+        }
+        else if (count != 2)
+        {
+            continue;
+        }
+
+        for (int cpu = first; cpu <= last; ++cpu)
+        {
+            result.push_back(cpu);
+        }
+    }
+    return result;
+}
+#endif
+
+/**
+ * @brief Validates the limits and prepares them for apply_limits().
+ *
+ * Limits are soft limits, capped by the current hard limit, so the child can
+ * neither fail on them nor lose the option to raise them again.
+ */
+ChildLimits prepare_limits(const ResourceLimits& limits)
+{
+    ChildLimits result;
+
+    auto add = [&result](RlimitResource resource, uint64_t value)
+    {
+        rlimit current{};
+        if (getrlimit(resource, &current) != 0)
+        {
+            details::throw_os_error("getrlimit", errno);
+        }
+
+        auto wanted = static_cast<rlim_t>(value);
+        if (current.rlim_max != RLIM_INFINITY)
+        {
+            wanted = std::min(wanted, current.rlim_max);
+        }
+        result.rlimits.push_back({resource, {wanted, current.rlim_max}});
+    };
+
+    if (limits.cpu_seconds >= 0.0)
+    {
+        add(RLIMIT_CPU, static_cast<uint64_t>(std::max(1.0, std::ceil(limits.cpu_seconds))));
+    }
+
+    if (limits.address_space != 0U)
+    {
+        add(RLIMIT_AS, limits.address_space);
+    }
+
+    if (limits.open_files != 0U)
+    {
+        add(RLIMIT_NOFILE, limits.open_files);
+    }
+
+    if (!limits.cpus.empty() || limits.numa_node >= 0)
+    {
+#ifdef __linux__
+        std::vector<int> cpus = limits.cpus;
+        if (limits.numa_node >= 0)
+        {
+            std::vector<int> node = numa_node_cpus(limits.numa_node);
+            if (cpus.empty())
+            {
+                cpus = std::move(node);
+            }
+            else
+            {
+                std::erase_if(cpus,
+                              [&node](int cpu) { return std::find(node.begin(), node.end(), cpu) == node.end(); });
+            }
+        }
+
+        if (cpus.empty())
+        {
+            throw std::invalid_argument("no CPU left for the affinity of the process");
+        }
+
+        CPU_ZERO(&result.cpus);
+        for (int cpu : cpus)
+        {
+            if (cpu < 0 || cpu >= CPU_SETSIZE)
+            {
+                throw std::invalid_argument(std::format("invalid CPU {} for the affinity of the process", cpu));
+            }
+            CPU_SET(cpu, &result.cpus);
+        }
+        result.affinity = true;
+#else
+        throw std::domain_error("CPU affinity is not supported on this platform");
+#endif
+    }
+
+    return result;
+}
+
+/**
+ * @brief Applies the limits in the child of fork(). Only async-signal-safe calls are allowed here.
+ * @return 0 on success, otherwise the errno of the failing call.
+ */
+int apply_limits(const ChildLimits& limits)
+{
+    for (const auto& [resource, value] : limits.rlimits)
+    {
+        if (setrlimit(resource, &value) != 0)
+        {
+            return errno;
+        }
+    }
+
+#ifdef __linux__
+    if (limits.affinity && sched_setaffinity(0, sizeof(limits.cpus), &limits.cpus) != 0)
+    {
+        return errno;
+    }
+#endif
+
+    return 0;
+}
+
+/**
+ * @brief Replays the recorded layout in the child of fork(). Only async-signal-safe calls are allowed here.
+ * @return 0 on success, otherwise the errno of the failing call.
+ */
+int apply_fd_actions(const std::vector<FdAction>& actions)
+{
+    for (const auto& action : actions)
+    {
+        if (action.kind == FdAction::Kind::dup2)
+        {
+            if (action.source == action.fd)
+            {
+                // dup2 onto itself keeps FD_CLOEXEC, clear it explicitly.
+                int flags = fcntl(action.fd, F_GETFD);
+                if (flags < 0 || fcntl(action.fd, F_SETFD, flags & ~FD_CLOEXEC) < 0)
+                {
+                    return errno;
+                }
+            }
+            else if (dup2(action.source, action.fd) < 0)
+            {
+                return errno;
+            }
+        }
+        else
+        {
+            int fd = open(action.path, action.flags);
+            if (fd < 0)
+            {
+                return errno;
+            }
+
+            if (fd != action.fd)
+            {
+                if (dup2(fd, action.fd) < 0)
+                {
+                    return errno;
+                }
+                (void)close(fd);
+            }
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * @brief Spawns with fork() + execve(). Used only when posix_spawn cannot express the request, i.e. resource limits,
+ * a cwd on a libc lacking posix_spawn_file_actions_addchdir_np, or a controlling terminal outside of Linux.
+ *
+ * A close-on-exec pipe reports the errno of a failed exec back to the parent, so failures surface the same way
+ * they do with posix_spawn. A new session makes the child the leader of a new process group as well, and if
+ * controlling_tty is not -1, that descriptor becomes the controlling terminal of the session.
+ */
+int fork_spawn(pid_t& pid, const std::string& program, const std::vector<FdAction>& actions, const std::string& cwd,
+               bool new_process_group, bool new_session, int controlling_tty, const ChildLimits& limits,
+               char* const* argv, char* const* envp)
+{
+    int report[2];
+#ifdef __APPLE__
+    if (::pipe(report) != 0)
+    {
+        return errno;
+    }
+    (void)fcntl(report[0], F_SETFD, FD_CLOEXEC);
+    (void)fcntl(report[1], F_SETFD, FD_CLOEXEC);
+#else
+    if (::pipe2(report, O_CLOEXEC) != 0)
+    {
+        return errno;
+    }
+#endif
+
+    pid = fork();
+    if (pid < 0)
+    {
+        int ec = errno;
+        (void)close(report[0]);
+        (void)close(report[1]);
+        return ec;
+    }
+
+    if (pid == 0)
+    {
+        (void)close(report[0]);
+
+        sigset_t mask;
+        (void)sigemptyset(&mask);
+        (void)sigprocmask(SIG_SETMASK, &mask, nullptr);
+        (void)signal(SIGPIPE, SIG_DFL);
+
+        int ec = 0;
+        if (new_session ? setsid() < 0 : new_process_group && setpgid(0, 0) != 0)
+        {
+            ec = errno;
+        }
+
+        if (ec == 0)
+        {
+            ec = apply_limits(limits);
+        }
+
+        if (ec == 0)
+        {
+            ec = apply_fd_actions(actions);
+        }
+
+        if (ec == 0 && controlling_tty >= 0 && ioctl(controlling_tty, TIOCSCTTY, 0) != 0)
+        {
+            ec = errno;
+        }
+
+        if (ec == 0 && !cwd.empty() && chdir(cwd.c_str()) != 0)
+        {
+            ec = errno;
+        }
+
+        if (ec == 0)
+        {
+            (void)execve(program.c_str(), argv, envp);
+            ec = errno;
+        }
+
+        (void)!write(report[1], &ec, sizeof(ec));
+        _exit(127);
+    }
+
+    (void)close(report[1]);
+
+    int ec = 0;
+    ssize_t n;
+    do
+    {
+        n = read(report[0], &ec, sizeof(ec));
+    } while (n < 0 && errno == EINTR);
+    (void)close(report[0]);
+
+    if (n == static_cast<ssize_t>(sizeof(ec)) && ec != 0)
+    {
+        // The child never ran the program, reap it right away.
+        int status;
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        {
+        }
+        pid = 0;
+        return ec;
+    }
+
+    return 0;
+}
+
+} // namespace
+
+Popen ProcessBuilder::run_command(CommandLine&& cmdline)
+{
+    SUBPROCESS_TRACE_SCOPE(TracePhase::spawn);
+    std::string program = this->program.empty() ? find_program(cmdline[0U]) : this->program;
+    if (program.empty())
+    {
+        throw CommandNotFoundError(std::format("Command \"{}\" not found.", cmdline[0U]));
+    }
+
+    Popen process{};
+
+    PipePair cin_pair;
+    PipePair cout_pair;
+    PipePair cerr_pair;
+    PtyPair pty;
+    std::vector<FdAction> actions;
+    int controlling_tty = -1;
+
+    if (cin_option == PipeOption::pty || cout_option == PipeOption::pty || cerr_option == PipeOption::pty)
+    {
+        pty.open(this->pty_size);
+    }
+
+    // Opening the terminal, rather than a dup2 of the parent's descriptor, makes it the controlling one on Linux.
+    auto open_pty = [&actions, &pty, &controlling_tty](int fd)
+    {
+        actions.push_back({FdAction::Kind::open, fd, -1, pty.path(), O_RDWR});
+        if (controlling_tty < 0)
+        {
+            controlling_tty = fd;
+        }
+    };
+
+    // Pipes are created close-on-exec, atomically with pipe2(). The dup2 onto 0, 1 or 2 in the child clears the flag
+    // on the target only, so no other pipe end leaks into this child. On macOS, without pipe2(), the flag is set
+    // right after pipe(), and a child spawned by another thread in between may still inherit the ends.
+    if (cin_option == PipeOption::close || cin_option == PipeOption::pipe)
+    {
+        cin_pair = pipe_create(false);
+        actions.push_back({FdAction::Kind::dup2, kStdInValue, cin_pair.input, nullptr, 0});
+    }
+    else if (cin_option == PipeOption::specific)
+    {
+        actions.push_back({FdAction::Kind::dup2, kStdInValue, cin_pipe, nullptr, 0});
+    }
+    else if (cin_option == PipeOption::none)
+    {
+        actions.push_back({FdAction::Kind::open, kStdInValue, -1, "/dev/null", O_RDONLY});
+    }
+    else if (cin_option == PipeOption::pty)
+    {
+        open_pty(kStdInValue);
+    }
+    else
+    {
+    }
+
+    if (cout_option == PipeOption::close || cout_option == PipeOption::pipe)
+    {
+        cout_pair = pipe_create(false, cout_pipe_size);
+        actions.push_back({FdAction::Kind::dup2, kStdOutValue, cout_pair.output, nullptr, 0});
+    }
+    else if (cout_option == PipeOption::specific)
+    {
+        actions.push_back({FdAction::Kind::dup2, kStdOutValue, cout_pipe, nullptr, 0});
+    }
+    else if (cout_option == PipeOption::none)
+    {
+        actions.push_back({FdAction::Kind::open, kStdOutValue, -1, "/dev/null", O_WRONLY});
+    }
+    else if (cout_option == PipeOption::pty)
+    {
+        open_pty(kStdOutValue);
+    }
+    else // (cout_option == PipeOption::cerr) is handled once cerr is set up
+    {
+    }
+
+    if (cerr_option == PipeOption::close || cerr_option == PipeOption::pipe)
+    {
+        cerr_pair = pipe_create(false, cerr_pipe_size);
+        actions.push_back({FdAction::Kind::dup2, kStdErrValue, cerr_pair.output, nullptr, 0});
+    }
+    else if (cerr_option == PipeOption::cout)
+    {
+        actions.push_back({FdAction::Kind::dup2, kStdErrValue, kStdOutValue, nullptr, 0});
+    }
+    else if (cerr_option == PipeOption::specific)
+    {
+        actions.push_back({FdAction::Kind::dup2, kStdErrValue, cerr_pipe, nullptr, 0});
+    }
+    else if (cerr_option == PipeOption::none)
+    {
+        actions.push_back({FdAction::Kind::open, kStdErrValue, -1, "/dev/null", O_WRONLY});
+    }
+    else if (cerr_option == PipeOption::pty)
+    {
+        open_pty(kStdErrValue);
+    }
+    else
+    {
+    }
+
+    // I don't know why someone would want to do this. But for completeness
+    if (cout_option == PipeOption::cerr)
+    {
+        actions.push_back({FdAction::Kind::dup2, kStdOutValue, kStdErrValue, nullptr, 0});
+    }
+
+    auto argv = std::make_shared<const ArgvBuffer>(cmdline);
+
+    char* const* l_env = this->env.empty() ? environ : this->env.envp();
+
+    pid_t pid = 0;
+    int ec;
+    bool new_group = this->new_process_group || this->job_object;
+    bool new_session = this->detached_process || pty.is_open();
+    ChildLimits child_limits = prepare_limits(this->limits);
+    process.m_started = std::chrono::steady_clock::now();
+
+    // Only on Linux does posix_spawn both start the session and open the terminal in the child, in that order.
+#if defined(__linux__) && defined(POSIX_SPAWN_SETSID)
+    bool spawn_tty = true;
+#else
+    bool spawn_tty = !pty.is_open();
+#endif
+
+    if (!child_limits.empty() || (!SUBPROCESS_HAVE_ADDCHDIR_NP && !this->cwd.empty()) || !spawn_tty)
+    {
+        SUBPROCESS_TRACE_SCOPE(TracePhase::exec);
+        ec = fork_spawn(pid, program, actions, this->cwd, new_group, new_session, controlling_tty, child_limits,
+                        argv->argv(), l_env);
+    }
+    else
+    {
+        SpawnFileActions file_actions;
+        for (const auto& action : actions)
+        {
+            file_actions.add(action);
+        }
+#if SUBPROCESS_HAVE_ADDCHDIR_NP
+        if (!this->cwd.empty())
+        {
+            file_actions.add_chdir(this->cwd);
+        }
+#endif
+
+        SpawnAttr attr;
+        short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+#ifdef POSIX_SPAWN_USEVFORK
+        // Modern glibc always spawns with clone(CLONE_VM | CLONE_VFORK); older ones need to be asked. Either way the
+        // page tables of the parent are never copied.
+        flags |= POSIX_SPAWN_USEVFORK;
+#endif
+#ifdef POSIX_SPAWN_SETSID
+        // The leader of a new session leads a new process group as well, and may not join another one.
+        if (new_session)
+        {
+            flags |= POSIX_SPAWN_SETSID;
+            new_group = false;
+        }
+#endif
+        if (new_group)
+        {
+            flags |= POSIX_SPAWN_SETPGROUP;
+            details::throw_os_error("posix_spawnattr_setpgroup", posix_spawnattr_setpgroup(attr.get(), 0));
+        }
+
+        // Do not let a signal mask of the spawning thread, or an ignored SIGPIPE of this process, leak into the child.
+        sigset_t mask;
+        (void)sigemptyset(&mask);
+        details::throw_os_error("posix_spawnattr_setsigmask", posix_spawnattr_setsigmask(attr.get(), &mask));
+        (void)sigaddset(&mask, SIGPIPE);
+        details::throw_os_error("posix_spawnattr_setsigdefault", posix_spawnattr_setsigdefault(attr.get(), &mask));
+        details::throw_os_error("posix_spawnattr_setflags", posix_spawnattr_setflags(attr.get(), flags));
+
+        SUBPROCESS_TRACE_SCOPE(TracePhase::exec);
+        ec = posix_spawn(&pid, program.c_str(), file_actions.get(), attr.get(), argv->argv(), l_env);
+    }
+
+    if (ec != 0)
+    {
+        // The pipe pairs close both ends on the way out.
+        throw SpawnError(std::format("posix_spawn of \"{}\" failed: {}", program, std::generic_category().message(ec)));
+    }
+
+    process.pid = pid;
+    SUBPROCESS_TRACE_COUNT(TraceCounter::spawns, 1U);
+    process.m_kill_group = this->job_object;
+
+    // Close the child's ends; PipeOption::close pipes lose both ends.
+    cin_pair.close_input();
+    cout_pair.close_output();
+    cerr_pair.close_output();
+    pty.close_slave();
+
+    // Each stream on the terminal gets its own descriptor of the master, cerr output ends up in cout if both are.
+    if (cin_option == PipeOption::pty)
+    {
+        process.cin = pty.dup();
+    }
+
+    if (cout_option == PipeOption::pty)
+    {
+        process.cout = pty.dup();
+    }
+
+    if (cerr_option == PipeOption::pty && cout_option != PipeOption::pty)
+    {
+        process.cerr = pty.dup();
+    }
+
+    if (pty.is_open())
+    {
+        process.m_pty = pty.release();
+    }
+
+    if (cin_option == PipeOption::pipe)
+    {
+        process.cin = cin_pair.output;
+        cin_pair.disown();
+    }
+
+    if (cout_option == PipeOption::pipe)
+    {
+        process.cout = cout_pair.input;
+        cout_pair.disown();
+    }
+
+    if (cerr_option == PipeOption::pipe)
+    {
+        process.cerr = cerr_pair.input;
+        cerr_pair.disown();
+    }
+
+    process.args = std::move(cmdline);
+    process.m_argv = std::move(argv);
+    return process;
+}
+
+bool Popen::resize_pty(PtySize size)
+{
+    return m_pty != kBadPipeValue && PtyPair::resize(m_pty, size);
+}
+
+} // namespace subprocess
+
+#endif
@@ -5,8 +5,13 @@
 #include <strsafe.h>
 #include <windows.h>
 
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
 #include "environ.h"
 #include "shellutils.h"
+#include "trace.h"
 
 namespace subprocess
 {
@@ -27,9 +32,121 @@ bool disable_inherit(subprocess::PipeHandle handle)
     return 0 != SetHandleInformation(handle, static_cast<DWORD>(HANDLE_FLAG_INHERIT), 0U);
 }
 
-Popen ProcessBuilder::run_command(const CommandLine& cmdline)
+/**
+ * @brief Sets the limits on the job. Open files have no equivalent and are ignored.
+ * @throws std::invalid_argument If a CPU or NUMA node cannot be used.
+ * @throws SpawnError If the job rejected the limits.
+ */
+void set_job_limits(HANDLE job, const ResourceLimits& limits)
+{
+    JOBOBJECT_EXTENDED_LIMIT_INFORMATION info{};
+    DWORD flags = 0U;
+
+    if (limits.cpu_seconds >= 0.0)
+    {
+        flags |= JOB_OBJECT_LIMIT_PROCESS_TIME;
+        info.BasicLimitInformation.PerProcessUserTimeLimit.QuadPart = static_cast<LONGLONG>(limits.cpu_seconds * 1e7);
+    }
+
+    if (limits.address_space != 0U)
+    {
+        flags |= JOB_OBJECT_LIMIT_PROCESS_MEMORY;
+        info.ProcessMemoryLimit = static_cast<SIZE_T>(limits.address_space);
+    }
+
+    if (!limits.cpus.empty() || limits.numa_node >= 0)
+    {
+        ULONGLONG mask = 0U;
+        for (int cpu : limits.cpus)
+        {
+            if (cpu < 0 || cpu >= 64)
+            {
+                throw std::invalid_argument(std::format("invalid CPU {} for the affinity of the process", cpu));
+            }
+            mask |= 1ULL << static_cast<unsigned>(cpu);
+        }
+
+        if (limits.numa_node >= 0)
+        {
+            ULONGLONG node = 0U;
+            if (limits.numa_node > 255 || !GetNumaNodeProcessorMask(static_cast<UCHAR>(limits.numa_node), &node))
+            {
+                throw std::invalid_argument(std::format("NUMA node {} not found", limits.numa_node));
+            }
+            mask = limits.cpus.empty() ? node : mask & node;
+        }
+
+        if (mask == 0U)
+        {
+            throw std::invalid_argument("no CPU left for the affinity of the process");
+        }
+        flags |= JOB_OBJECT_LIMIT_AFFINITY;
+        info.BasicLimitInformation.Affinity = static_cast<ULONG_PTR>(mask);
+    }
+
+    info.BasicLimitInformation.LimitFlags = flags;
+    if (flags != 0U && !SetInformationJobObject(job, JobObjectExtendedLimitInformation, &info, sizeof(info)))
+    {
+        throw SpawnError("SetInformationJobObject failed: " + LastErrorString());
+    }
+}
+
+/**
+ * @brief The pseudo console of RunOptions::pty. It is closed as soon as the child exits, the output pipe only
+ * ends once it is.
+ */
+struct details::PseudoConsole
+{
+    HPCON console{nullptr};
+    HANDLE wait{nullptr};
+    std::mutex mutex;
+
+    PseudoConsole() = default;
+
+    ~PseudoConsole()
+    {
+        if (wait != nullptr)
+        {
+            (void)UnregisterWaitEx(wait, INVALID_HANDLE_VALUE);
+        }
+        close();
+    }
+
+    PseudoConsole(const PseudoConsole&) = delete;
+    PseudoConsole& operator=(const PseudoConsole&) = delete;
+
+    void close()
+    {
+        std::lock_guard lock(mutex);
+        if (console != nullptr)
+        {
+            ClosePseudoConsole(console);
+            console = nullptr;
+        }
+    }
+
+    bool resize(PtySize size)
+    {
+        std::lock_guard lock(mutex);
+        COORD coord{static_cast<SHORT>(size.columns), static_cast<SHORT>(size.rows)};
+        return console != nullptr && SUCCEEDED(ResizePseudoConsole(console, coord));
+    }
+
+    static void CALLBACK on_exit(PVOID parameter, BOOLEAN /*timed_out*/)
+    {
+        static_cast<PseudoConsole*>(parameter)->close();
+    }
+};
+
+bool Popen::resize_pty(PtySize size)
+{
+    return m_pty && m_pty->resize(size);
+}
+
+Popen ProcessBuilder::run_command(CommandLine&& cmdline)
 {
-    std::string program = find_program(cmdline[0U]);
+    SUBPROCESS_TRACE_SCOPE(TracePhase::spawn);
+    std::string program = this->program.empty() ? find_program(cmdline[0U]) : this->program;
     if (program.empty())
     {
         throw CommandNotFoundError(std::format("Command \"{}\" not found.", cmdline[0U]));
@@ -60,6 +177,52 @@ Popen ProcessBuilder::run_command(const CommandLine& cmdline)
     siStartInfo.hStdError = GetStdHandle(STD_ERROR_HANDLE);   // NOLINT
     siStartInfo.dwFlags |= STARTF_USESTDHANDLES;
 
+    // A pseudo console becomes all of the standard handles of the child, so nothing else may be asked for.
+    std::shared_ptr<details::PseudoConsole> console;
+    PipePair pty_input;
+    PipePair pty_output;
+    std::vector<char> attributes;
+    STARTUPINFOEX siStartInfoEx = {0U};
+    if (cin_option == PipeOption::pty || cout_option == PipeOption::pty || cerr_option == PipeOption::pty)
+    {
+        for (PipeOption option : {cin_option, cout_option, cerr_option})
+        {
+            if (option != PipeOption::pty && option != PipeOption::inherit)
+            {
+                throw std::invalid_argument("PipeOption::pty on Windows takes all of cin, cout and cerr");
+            }
+        }
+
+        pty_input = pipe_create(false);
+        pty_output = pipe_create_overlapped(false, cout_pipe_size);
+        console = std::make_shared<details::PseudoConsole>();
+        COORD size{static_cast<SHORT>(pty_size.columns), static_cast<SHORT>(pty_size.rows)};
+        if (FAILED(CreatePseudoConsole(size, pty_input.input, pty_output.output, 0U, &console->console)))
+        {
+            throw SpawnError("CreatePseudoConsole failed: " + LastErrorString());
+        }
+
+        // The console has its own duplicates of its ends.
+        pty_input.close_input();
+        pty_output.close_output();
+
+        SIZE_T attributes_size = 0U;
+        (void)InitializeProcThreadAttributeList(nullptr, 1U, 0U, &attributes_size);
+        attributes.resize(attributes_size);
+        auto* list = reinterpret_cast<LPPROC_THREAD_ATTRIBUTE_LIST>(attributes.data()); // NOLINT
+        if (!InitializeProcThreadAttributeList(list, 1U, 0U, &attributes_size) ||
+            !UpdateProcThreadAttribute(list, 0U, PROC_THREAD_ATTRIBUTE_PSEUDOCONSOLE, console->console,
+                                       sizeof(HPCON), nullptr, nullptr))
+        {
+            throw SpawnError("UpdateProcThreadAttribute failed: " + LastErrorString());
+        }
+
+        siStartInfo.dwFlags &= ~STARTF_USESTDHANDLES;       // NOLINT
+        siStartInfoEx.StartupInfo = siStartInfo;
+        siStartInfoEx.StartupInfo.cb = sizeof(STARTUPINFOEX); // NOLINT
+        siStartInfoEx.lpAttributeList = list;
+    }
+
     if (cin_option == PipeOption::close)
     {
         cin_pair = pipe_create();
@@ -88,13 +251,14 @@ Popen ProcessBuilder::run_command(const CommandLine& cmdline)
 
     if (cout_option == PipeOption::close)
     {
-        cout_pair = pipe_create();
+        cout_pair = pipe_create(true, cout_pipe_size);
         siStartInfo.hStdOutput = cout_pair.output;
         (void)disable_inherit(cout_pair.input);
     }
     else if (cout_option == PipeOption::pipe)
     {
-        cout_pair = pipe_create();
+        // Overlapped, so the IoReactor gets a completion instead of polling while the output is redirected.
+        cout_pair = pipe_create_overlapped(true, cout_pipe_size);
         siStartInfo.hStdOutput = cout_pair.output;
         process.cout = cout_pair.input;
         (void)disable_inherit(cout_pair.input);
@@ -114,13 +278,13 @@ Popen ProcessBuilder::run_command(const CommandLine& cmdline)
 
     if (cerr_option == PipeOption::close)
     {
-        cerr_pair = pipe_create();
+        cerr_pair = pipe_create(true, cerr_pipe_size);
         siStartInfo.hStdError = cerr_pair.output;
         (void)disable_inherit(cerr_pair.input);
     }
     else if (cerr_option == PipeOption::pipe)
     {
-        cerr_pair = pipe_create();
+        cerr_pair = pipe_create_overlapped(true, cerr_pipe_size);
         siStartInfo.hStdError = cerr_pair.output;
         process.cerr = cerr_pair.input;
         (void)disable_inherit(cerr_pair.input);
@@ -148,21 +312,12 @@ Popen ProcessBuilder::run_command(const CommandLine& cmdline)
         siStartInfo.hStdOutput = siStartInfo.hStdError;
     }
     const char* l_cwd = this->cwd.empty() ? nullptr : this->cwd.c_str();
-    std::string args = windows_args(cmdline);
+    auto argv = std::make_shared<const ArgvBuffer>(cmdline);
+    std::string args = argv->windows_command_line();
 
-    void* l_env = nullptr;
-    std::u16string envblock;
-    if (!this->env.empty())
-    {
-        /*  if you use ansi there is a 37K size limit. So we use unicode
-            which is almost utf16.
-            TODO: fix by using unicode 16bit chars.
-            This won't work as expected if somewhere there is a multibyte
-            utf-16 char (4-bytes total).
-        */
-        envblock = create_env_block(this->env);
-        l_env = static_cast<void*>(envblock.data());
-    }
+    // The ANSI block has a 37K size limit, so the environment is always passed as UTF-16. CreateProcessW takes it
+    // as non-const, but does not write to it.
+    void* l_env = const_cast<char16_t*>(this->env.data()); // NOLINT
 
     DWORD process_flags = CREATE_UNICODE_ENVIRONMENT; // NOLINT
     if (this->new_process_group)
@@ -180,17 +335,42 @@ Popen ProcessBuilder::run_command(const CommandLine& cmdline)
         process_flags |= DETACHED_PROCESS; // NOLINT
     }
 
+    if (console)
+    {
+        process_flags |= EXTENDED_STARTUPINFO_PRESENT; // NOLINT
+    }
+
+    // The child must not run, and start children of its own, before it is in the job. Limits are set on a job too.
+    if (this->job_object || !this->limits.empty())
+    {
+        process.m_job = CreateJobObjectW(nullptr, nullptr);
+        if (process.m_job == nullptr)
+        {
+            throw SpawnError("CreateJobObject failed: " + LastErrorString());
+        }
+        set_job_limits(process.m_job, this->limits);
+        process_flags |= CREATE_SUSPENDED; // NOLINT
+    }
+
     // Create the child process.
-    bSuccess = CreateProcess(program.c_str(),
-                             args.data(),   // command line
-                             nullptr,       // process security attributes
-                             nullptr,       // primary thread security attributes
-                             TRUE,          // handles are inherited
-                             process_flags, // creation flags
-                             l_env,         // environment
-                             l_cwd,         // use parent's current directory
-                             &siStartInfo,  // STARTUPINFO pointer
-                             &piProcInfo);  // receives PROCESS_INFORMATION
+    {
+        SUBPROCESS_TRACE_SCOPE(TracePhase::exec);
+        bSuccess = CreateProcess(program.c_str(),
+                                 args.data(),   // command line
+                                 nullptr,       // process security attributes
+                                 nullptr,       // primary thread security attributes
+                                 TRUE,          // handles are inherited
+                                 process_flags, // creation flags
+                                 l_env,         // environment
+                                 l_cwd,         // use parent's current directory
+                                 console ? &siStartInfoEx.StartupInfo : &siStartInfo, // STARTUPINFO pointer
+                                 &piProcInfo); // receives PROCESS_INFORMATION
+    }
+
+    if (siStartInfoEx.lpAttributeList != nullptr)
+    {
+        DeleteProcThreadAttributeList(siStartInfoEx.lpAttributeList);
+    }
 
     process.process_info = piProcInfo;
     process.pid = piProcInfo.dwProcessId;
@@ -229,16 +409,50 @@ Popen ProcessBuilder::run_command(const CommandLine& cmdline)
     cout_pair.disown();
     cerr_pair.disown();
 
-    process.args = cmdline;
+    process.args = std::move(cmdline);
+    process.m_argv = std::move(argv);
     if (0 == bSuccess)
     {
         auto msg = std::format("CreateProcess failed: {}", LastErrorString());
         throw SpawnError(msg);
     }
-    else
+
+    if (process.m_job != nullptr)
+    {
+        if (!AssignProcessToJobObject(process.m_job, piProcInfo.hProcess))
+        {
+            // Fails if this process is in a job that forbids nesting, before Windows 8.
+            auto msg = std::format("AssignProcessToJobObject failed: {}", LastErrorString());
+            (void)TerminateProcess(piProcInfo.hProcess, 1U);
+            throw SpawnError(msg);
+        }
+        (void)ResumeThread(piProcInfo.hThread);
+    }
+
+    if (console)
     {
-        return process;
+        if (!RegisterWaitForSingleObject(&console->wait, piProcInfo.hProcess, &details::PseudoConsole::on_exit,
+                                         console.get(), INFINITE, WT_EXECUTEONLYONCE))
+        {
+            console->wait = nullptr;
+        }
+
+        // cerr output ends up in cout if both are on the terminal. Unused ends are closed by the pipe pairs.
+        if (cin_option == PipeOption::pty)
+        {
+            process.cin = pty_input.output;
+            pty_input.disown();
+        }
+
+        if (cout_option == PipeOption::pty || cerr_option == PipeOption::pty)
+        {
+            (cout_option == PipeOption::pty ? process.cout : process.cerr) = pty_output.input;
+            pty_output.disown();
+        }
+        process.m_pty = std::move(console);
     }
+    SUBPROCESS_TRACE_COUNT(TraceCounter::spawns, 1U);
+    return process;
 }
 
 } // namespace subprocess
@@ -1,9 +1,13 @@
 #include "environ.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cstdlib>
-#include <format>
 #include <string>
+#include <string_view>
+#include <vector>
 
+#include "trace.h"
 #include "utf8_to_utf16.h"
 
 #ifndef _WIN32
@@ -16,6 +20,88 @@ using std::to_string;
 
 Environ cenv;
 
+namespace
+{
+/** @brief Bumped by every change made through cenv, and by EnvSnapshot::invalidate(). */
+std::atomic<uint64_t> g_env_version{1U};
+
+/** @brief Serializes taking new snapshots, readers of a current one never take it. */
+std::mutex g_snapshot_mutex;
+
+#ifdef __cpp_lib_atomic_shared_ptr
+std::atomic<std::shared_ptr<const EnvSnapshot>> g_snapshot;
+
+std::shared_ptr<const EnvSnapshot> load_snapshot()
+{
+    return g_snapshot.load();
+}
+
+void store_snapshot(std::shared_ptr<const EnvSnapshot> snapshot)
+{
+    g_snapshot.store(std::move(snapshot));
+}
+#else
+std::shared_ptr<const EnvSnapshot> g_snapshot;
+
+std::shared_ptr<const EnvSnapshot> load_snapshot()
+{
+    return std::atomic_load(&g_snapshot);
+}
+
+void store_snapshot(std::shared_ptr<const EnvSnapshot> snapshot)
+{
+    std::atomic_store(&g_snapshot, std::move(snapshot));
+}
+#endif
+
+/**
+ * @brief Calls visit(name, value) for each variable of the process, in the order of the OS. Entries without a
+ * name, like the "=C:=C:\\" ones of Windows, are skipped.
+ */
+template <typename Visit>
+void for_each_env_entry(Visit visit)
+{
+#ifdef _WIN32
+    if (auto env_block = GetEnvironmentStringsW(); nullptr != env_block)
+    {
+        auto list = env_block;
+        while (0U != *list)
+        {
+            std::string u8str = utf16_to_utf8(list);
+            std::string_view entry(u8str);
+            if (std::size_t pos = entry.find('='); pos != std::string_view::npos && pos != 0U)
+            {
+                visit(entry.substr(0U, pos), entry.substr(pos + 1U));
+            }
+
+            list += strlen16(list) + 1U; // list gets updated here.
+        }
+
+        (void)FreeEnvironmentStringsW(env_block);
+    }
+#else
+    for (char** list = environ; *list; ++list)
+    {
+        std::string_view entry(*list);
+        if (std::size_t pos = entry.find('='); pos != std::string_view::npos && pos != 0U)
+        {
+            visit(entry.substr(0U, pos), entry.substr(pos + 1U));
+        }
+    }
+#endif
+}
+
+/** @brief Sorts entries by name. Only the first of equal names is kept, the one getenv finds. */
+void sort_env_entries(std::vector<EnvSnapshot::Entry>& entries)
+{
+    auto by_name = [](const EnvSnapshot::Entry& a, const EnvSnapshot::Entry& b) { return a.name < b.name; };
+    std::stable_sort(entries.begin(), entries.end(), by_name);
+    auto last = std::unique(entries.begin(), entries.end(),
+                            [](const EnvSnapshot::Entry& a, const EnvSnapshot::Entry& b) { return a.name == b.name; });
+    entries.erase(last, entries.end());
+}
+} // namespace
+
 EnvironSetter::EnvironSetter(const std::string& name)
 {
     m_name = name;
@@ -43,10 +129,6 @@ EnvironSetter& EnvironSetter::operator=(const std::string& str)
 
 EnvironSetter& EnvironSetter::operator=(const char* str)
 {
-    if (m_name == "PATH" || m_name == "Path" || m_name == "path")
-    {
-        find_program_clear_cache();
-    }
 #ifdef _WIN32
     // if it's empty windows deletes it.
     (void)_putenv_s(m_name.c_str(), nullptr != str ? str : ""); // Empty string include just null terminator.
@@ -60,6 +142,7 @@ EnvironSetter& EnvironSetter::operator=(const char* str)
         setenv(m_name.c_str(), str, true);
     }
 #endif
+    EnvSnapshot::invalidate();
     return *this;
 }
 
@@ -90,21 +173,47 @@ EnvironSetter Environ::operator[](const std::string& name)
 
 EnvGuard::~EnvGuard()
 {
-    auto new_env = current_env_copy();
-    // Remove those not existing with the old env
-    for (const auto& [name, value] : new_env)
+    EnvSnapshot::invalidate();
+    std::shared_ptr<const EnvSnapshot> now = EnvSnapshot::current();
+
+    // Both are sorted by name, a single merge finds what was added, removed or changed.
+    std::vector<std::pair<std::string, const std::string_view*>> changes;
+    const auto& before = m_env->entries();
+    const auto& after = now->entries();
+    auto old_it = before.begin();
+    auto new_it = after.begin();
+    while (old_it != before.end() || new_it != after.end())
     {
-        if (!m_env.contains(name))
+        if (new_it == after.end() || (old_it != before.end() && old_it->name < new_it->name))
         {
-            cenv[name] = nullptr;
+            changes.emplace_back(old_it->name, &old_it->value);
+            ++old_it;
+        }
+        else if (old_it == before.end() || new_it->name < old_it->name)
+        {
+            changes.emplace_back(new_it->name, nullptr);
+            ++new_it;
+        }
+        else
+        {
+            if (old_it->value != new_it->value)
+            {
+                changes.emplace_back(old_it->name, &old_it->value);
+            }
+            ++old_it;
+            ++new_it;
         }
     }
-    // Write back the old env. If new env has the same name and value, just skip.
-    for (const auto& [name, value] : m_env)
+
+    for (const auto& [name, value] : changes)
     {
-        if (!new_env.contains(name) || value != new_env[name])
+        if (value == nullptr)
+        {
+            cenv[name] = nullptr;
+        }
+        else
         {
-            cenv[name] = value;
+            cenv[name] = std::string(*value);
         }
     }
 }
@@ -112,52 +221,375 @@ EnvGuard::~EnvGuard()
 EnvMap current_env_copy()
 {
     EnvMap result{};
+    for_each_env_entry([&result](std::string_view name, std::string_view value)
+                       { (void)result.try_emplace(std::string(name), value); });
+    return result;
+}
+
+namespace
+{
+/** @brief The name of a "NAME=VALUE" entry. Windows has entries like "=C:=C:\\", so the first '=' is skipped. */
+template <typename Char>
+std::basic_string_view<Char> entry_name(std::basic_string_view<Char> entry)
+{
+    return entry.substr(0U, entry.find(static_cast<Char>('='), 1U));
+}
+} // namespace
+
+struct EnvBlock::Data
+{
 #ifdef _WIN32
-    if (auto env_block = GetEnvironmentStringsW(); nullptr != env_block)
+    std::u16string block;
+#else
+    std::shared_ptr<const Data> base; ///< Owns the entries shared with the base block
+    std::string arena;                ///< Holds the entries encoded for this block
+    std::vector<char*> envp;
+#endif
+};
+
+template <typename Entries>
+std::shared_ptr<const EnvBlock::Data> EnvBlock::encode(const Entries& entries, std::size_t size)
+{
+    auto data = std::make_shared<Data>();
+
+#ifdef _WIN32
+    data->block.reserve(size + 2U);
+    for (const auto& [name, value] : entries)
     {
-        auto list = env_block;
-        while (0U != *list)
-        {
-            std::string u8str = utf16_to_utf8(list);
-            const char* name_start = u8str.c_str();
-            const char* name_end = name_start;
+        utf8_to_utf16_append(name, data->block);
+        data->block += u'=';
+        utf8_to_utf16_append(value, data->block);
+        data->block += u'\0';
+    }
 
-            while ('=' != *name_end && '\0' != *name_end)
-            {
-                ++name_end;
-            }
+    // An empty environment still needs both of its terminators.
+    if (data->block.empty())
+    {
+        data->block += u'\0';
+    }
+    data->block += u'\0';
+#else
+    // Reserved up front, so the arena never moves and the pointers into it stay valid.
+    data->arena.reserve(size);
+    data->envp.reserve(std::size(entries) + 1U);
+    for (const auto& [name, value] : entries)
+    {
+        data->envp.push_back(data->arena.data() + data->arena.size());
+        (void)data->arena.append(name).append(1U, '=').append(value).append(1U, '\0');
+    }
+    data->envp.push_back(nullptr);
+#endif
 
-            if ('=' == *name_end && name_end != name_start)
-            {
-                const std::string name(name_start, name_end);
-                const char* value = name_end + 1;
-                result[name] = value;
-            }
+    return data;
+}
 
-            list += strlen16(list) + 1U; // list gets updated here.
+EnvBlock::EnvBlock(const EnvMap& map)
+{
+    if (map.empty())
+    {
+        return;
+    }
+
+    SUBPROCESS_TRACE_SCOPE(TracePhase::env_block);
+    std::size_t size = 0U;
+    for (const auto& [name, value] : map)
+    {
+        size += name.size() + value.size() + 2U;
+    }
+    m_data = encode(map, size);
+}
+
+EnvBlock EnvBlock::with(const EnvMap& overrides) const
+{
+    if (empty())
+    {
+        // The snapshot is encoded already, and has a block even without any variables to inherit.
+        return EnvSnapshot::current()->block().with(overrides);
+    }
+
+    SUBPROCESS_TRACE_SCOPE(TracePhase::env_block);
+    // Both sides are sorted by name, so a single merge applies the overrides.
+    auto data = std::make_shared<Data>();
+
+#ifdef _WIN32
+    std::vector<std::u16string> names;
+    std::vector<const std::string*> values;
+    names.reserve(overrides.size());
+    values.reserve(overrides.size());
+    for (const auto& [name, value] : overrides)
+    {
+        names.emplace_back();
+        utf8_to_utf16_append(name, names.back());
+        values.push_back(&value);
+    }
+
+    const std::u16string& base = m_data->block;
+    std::size_t i = 0U;
+    data->block.reserve(base.size());
+    auto emit = [&]()
+    {
+        if (!values[i]->empty())
+        {
+            (void)data->block.append(names[i]).append(1U, u'=');
+            utf8_to_utf16_append(*values[i], data->block);
+            data->block += u'\0';
         }
+        ++i;
+    };
 
-        (void)FreeEnvironmentStringsW(env_block);
+    for (std::size_t pos = 0U; pos < base.size() && base[pos] != u'\0';)
+    {
+        std::u16string_view entry(base.c_str() + pos);
+        std::u16string_view name = entry_name(entry);
+        while (i < names.size() && std::u16string_view(names[i]) < name)
+        {
+            emit();
+        }
+
+        if (i < names.size() && std::u16string_view(names[i]) == name)
+        {
+            emit();
+        }
+        else
+        {
+            (void)data->block.append(entry).append(1U, u'\0');
+        }
+        pos += entry.size() + 1U;
+    }
+
+    while (i < names.size())
+    {
+        emit();
     }
+
+    // An empty environment still needs both of its terminators.
+    if (data->block.empty())
+    {
+        data->block += u'\0';
+    }
+    data->block += u'\0';
 #else
-    for (char** list = environ; *list; ++list)
+    auto it = overrides.begin();
+    std::size_t size = 0U;
+    for (const auto& [name, value] : overrides)
+    {
+        size += value.empty() ? 0U : name.size() + value.size() + 2U;
+    }
+
+    data->base = m_data;
+    data->arena.reserve(size);
+    data->envp.reserve(m_data->envp.size() + overrides.size());
+    auto emit = [&]()
     {
-        char* name_start = *list;
-        char* name_end = name_start;
+        if (!it->second.empty())
+        {
+            data->envp.push_back(data->arena.data() + data->arena.size());
+            (void)data->arena.append(it->first).append(1U, '=').append(it->second).append(1U, '\0');
+        }
+        ++it;
+    };
 
-        while ('=' != *name_end && '\0' != *name_end)
+    for (char* const* entry = m_data->envp.data(); *entry != nullptr; ++entry)
+    {
+        std::string_view name = entry_name(std::string_view(*entry));
+        while (it != overrides.end() && std::string_view(it->first) < name)
+        {
+            emit();
+        }
+
+        if (it != overrides.end() && std::string_view(it->first) == name)
+        {
+            emit();
+        }
+        else
         {
-            ++name_end;
+            data->envp.push_back(*entry);
         }
+    }
+
+    while (it != overrides.end())
+    {
+        emit();
+    }
+    data->envp.push_back(nullptr);
+#endif
+
+    EnvBlock result;
+    result.m_data = std::move(data);
+    return result;
+}
 
-        if ('=' == *name_end && name_end != name_start)
+EnvMap EnvBlock::to_map() const
+{
+    EnvMap result;
+    if (empty())
+    {
+        return result;
+    }
+
+#ifdef _WIN32
+    const std::u16string& block = m_data->block;
+    for (std::size_t pos = 0U; pos < block.size() && block[pos] != u'\0';)
+    {
+        std::u16string_view entry(block.c_str() + pos);
+        std::u16string_view name = entry_name(entry);
+        if (name.size() < entry.size())
         {
-            const std::string name(name_start, name_end);
-            const char* value = name_end + 1;
-            result[name] = value;
+            result[utf16_to_utf8(name)] = utf16_to_utf8(entry.substr(name.size() + 1U));
+        }
+        pos += entry.size() + 1U;
+    }
+#else
+    for (char* const* entry = m_data->envp.data(); *entry != nullptr; ++entry)
+    {
+        std::string_view line(*entry);
+        std::string_view name = entry_name(line);
+        if (name.size() < line.size())
+        {
+            result[std::string(name)] = line.substr(name.size() + 1U);
         }
     }
 #endif
+
+    return result;
+}
+
+#ifdef _WIN32
+const char16_t* EnvBlock::data() const
+{
+    return empty() ? nullptr : m_data->block.c_str();
+}
+#else
+char* const* EnvBlock::envp() const
+{
+    return empty() ? nullptr : m_data->envp.data();
+}
+#endif
+
+std::shared_ptr<const EnvSnapshot> EnvSnapshot::current()
+{
+    uint64_t version = g_env_version.load(std::memory_order_acquire);
+    std::shared_ptr<const EnvSnapshot> snapshot = load_snapshot();
+    if (snapshot && snapshot->m_version == version)
+    {
+        return snapshot;
+    }
+
+    std::lock_guard lock(g_snapshot_mutex);
+    version = g_env_version.load(std::memory_order_acquire);
+    snapshot = load_snapshot();
+    if (snapshot && snapshot->m_version == version)
+    {
+        return snapshot;
+    }
+
+    // A change made while this one is taken bumps the version again, and the next reader takes another one.
+    std::shared_ptr<EnvSnapshot> result(new EnvSnapshot()); // NOLINT
+    result->m_version = version;
+
+#ifdef _WIN32
+    std::vector<std::pair<std::size_t, std::size_t>> offsets;
+    for_each_env_entry(
+        [&result, &offsets](std::string_view name, std::string_view value)
+        {
+            offsets.emplace_back(result->m_arena.size(), name.size());
+            (void)result->m_arena.append(name).append(1U, '=').append(value).append(1U, '\0');
+        });
+
+    // The arena is complete, views into it stay valid.
+    result->m_entries.reserve(offsets.size());
+    for (const auto& [pos, size] : offsets)
+    {
+        std::string_view entry(result->m_arena.c_str() + pos);
+        result->m_entries.push_back({entry.substr(0U, size), entry.substr(size + 1U)});
+    }
+    sort_env_entries(result->m_entries);
+
+    std::vector<std::pair<std::string_view, std::string_view>> pairs;
+    pairs.reserve(result->m_entries.size());
+    for (const Entry& entry : result->m_entries)
+    {
+        pairs.emplace_back(entry.name, entry.value);
+    }
+    result->m_block.m_data = EnvBlock::encode(pairs, result->m_arena.size());
+#else
+    // The entries point into environ only until the block is encoded, then into the block.
+    std::vector<Entry> entries;
+    std::size_t size = 0U;
+    for_each_env_entry(
+        [&entries, &size](std::string_view name, std::string_view value)
+        {
+            entries.push_back({name, value});
+            size += name.size() + value.size() + 2U;
+        });
+    sort_env_entries(entries);
+
+    std::vector<std::pair<std::string_view, std::string_view>> pairs;
+    pairs.reserve(entries.size());
+    for (const Entry& entry : entries)
+    {
+        pairs.emplace_back(entry.name, entry.value);
+    }
+    result->m_block.m_data = EnvBlock::encode(pairs, size);
+
+    const std::vector<char*>& envp = result->m_block.m_data->envp;
+    result->m_entries.reserve(entries.size());
+    for (std::size_t i = 0U; i < entries.size(); ++i)
+    {
+        std::string_view entry(envp[i]);
+        result->m_entries.push_back({entry.substr(0U, entries[i].name.size()),
+                                     entry.substr(entries[i].name.size() + 1U)});
+    }
+#endif
+
+    store_snapshot(result);
+    return result;
+}
+
+void EnvSnapshot::invalidate()
+{
+    (void)g_env_version.fetch_add(1U, std::memory_order_acq_rel);
+}
+
+std::optional<std::string_view> EnvSnapshot::get(std::string_view name) const
+{
+    auto it = std::lower_bound(m_entries.begin(), m_entries.end(), name,
+                               [](const Entry& entry, std::string_view key) { return entry.name < key; });
+    if (it != m_entries.end() && it->name == name)
+    {
+        return it->value;
+    }
+    return std::nullopt;
+}
+
+EnvMap EnvSnapshot::to_map() const
+{
+    EnvMap result;
+    for (const Entry& entry : m_entries)
+    {
+        (void)result.try_emplace(result.end(), std::string(entry.name), entry.value);
+    }
+    return result;
+}
+
+std::u16string create_env_block(const EnvSnapshot& snapshot)
+{
+    std::size_t size = 1U;
+    for (const auto& [name, value] : snapshot.entries())
+    {
+        size += name.size() + value.size() + 2U;
+    }
+
+    std::u16string result;
+    result.reserve(size);
+    for (const auto& [name, value] : snapshot.entries())
+    {
+        utf8_to_utf16_append(name, result);
+        result += u'=';
+        utf8_to_utf16_append(value, result);
+        result += u'\0';
+    }
+    result += u'\0';
     return result;
 }
 
@@ -171,12 +603,13 @@ std::u16string create_env_block(const EnvMap& map)
     size += 1U;
 
     std::u16string result;
-    result.reserve(size * 2U);
+    result.reserve(size);
 
     for (const auto& [name, value] : map)
     {
-        const std::string line = std::format("{}={}", name, value);
-        result += utf8_to_utf16(line);
+        utf8_to_utf16_append(name, result);
+        result += u'=';
+        utf8_to_utf16_append(value, result);
         result += static_cast<char16_t>('\0');
     }
 
@@ -1,7 +1,12 @@
 #pragma once
 
+#include <cstdint>
+#include <memory>
 #include <mutex>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <vector>
 
 #include "basic_types.hpp"
 #include "shellutils.h"
@@ -28,6 +33,10 @@ private:
     std::string m_name;
 };
 
+/**
+ * @brief Serializes code that changes the environment with calls of its own.
+ * The library reads the environment through EnvSnapshot and never takes it.
+ */
 struct EnvLock
 {
 public:
@@ -54,9 +63,136 @@ public:
  */
 extern Environ cenv;
 
-/** Creates a copy of current environment variables and returns the map */
+/**
+ * Creates a copy of current environment variables and returns the map.
+ * It always reads the environment of the process, see EnvSnapshot for a
+ * copy that is shared instead.
+ */
 EnvMap current_env_copy();
 
+/**
+ * @brief A prebuilt, immutable environment for new processes.
+ *
+ * The form the OS takes, an envp array over a single buffer on POSIX and a
+ * UTF-16 block on Windows, is encoded once, in a single pass. Copies share
+ * it, so one EnvBlock in RunOptions serves any number of spawns.
+ *
+ * with() puts a few changes on top of a block. Only the changed variables
+ * are encoded; the rest is shared with the base block on POSIX, and copied
+ * over as is on Windows, which needs one contiguous block.
+ *
+ * An empty EnvBlock stands for the environment of the current process.
+ */
+class EnvBlock
+{
+public:
+    EnvBlock() = default;
+
+    /**
+     * @brief Encodes map. An empty map gives an empty EnvBlock, which
+     * inherits the current environment.
+     */
+    EnvBlock(const EnvMap& map); // NOLINT(*-explicit-constructor)
+
+    /**
+     * @brief Gives a block with overrides applied on top of this one, or on
+     * top of EnvSnapshot::current() if this one is empty.
+     * @param overrides The variables to change. As with cenv, an empty value
+     * removes the variable.
+     */
+    [[nodiscard]] EnvBlock with(const EnvMap& overrides) const;
+
+    /** @brief True if the current environment is to be inherited. */
+    [[nodiscard]] bool empty() const
+    {
+        return m_data == nullptr;
+    }
+
+    /** @brief Decodes the block, e.g. to inspect it. */
+    [[nodiscard]] EnvMap to_map() const;
+
+#ifdef _WIN32
+    /** @brief The double null-terminated block for CreateProcessW, nullptr if empty. */
+    [[nodiscard]] const char16_t* data() const;
+#else
+    /** @brief The null-terminated array of "NAME=VALUE" for execve, nullptr if empty. */
+    [[nodiscard]] char* const* envp() const;
+#endif
+
+private:
+    friend class EnvSnapshot;
+    struct Data;
+
+    /** @brief Encodes entries, which are sorted by name, even if there are none. */
+    template <typename Entries>
+    static std::shared_ptr<const Data> encode(const Entries& entries, std::size_t count);
+
+    std::shared_ptr<const Data> m_data;
+};
+
+/**
+ * @brief An immutable copy of the environment of this process, sorted by
+ * name, shared by everyone reading it.
+ *
+ * current() loads a shared pointer and takes no lock, unless the
+ * environment changed since the snapshot was taken. Then the first reader
+ * takes a new one, with a single copy of all the variables that the entries
+ * point into, and its EnvBlock encoded in the same pass.
+ *
+ * Changes made through cenv are picked up on their own. Changes made with
+ * setenv, putenv or _putenv_s directly are seen after invalidate().
+ */
+class EnvSnapshot
+{
+public:
+    /** @brief A variable, pointing into the snapshot. */
+    struct Entry
+    {
+        std::string_view name;  // NOLINT
+        std::string_view value; // NOLINT
+    };
+
+    /** @brief The snapshot of the environment as it is now. */
+    [[nodiscard]] static std::shared_ptr<const EnvSnapshot> current();
+
+    /** @brief Has the next current() take a new snapshot. */
+    static void invalidate();
+
+    /** @brief Increases with every change of the environment, equal versions are equal snapshots. */
+    [[nodiscard]] uint64_t version() const
+    {
+        return m_version;
+    }
+
+    /** @brief The variables, sorted by name. */
+    [[nodiscard]] const std::vector<Entry>& entries() const
+    {
+        return m_entries;
+    }
+
+    /** @brief The value of a variable, nullopt if it is not set. */
+    [[nodiscard]] std::optional<std::string_view> get(std::string_view name) const;
+
+    /** @brief The environment, encoded for new processes. It has no variables if the environment has none. */
+    [[nodiscard]] const EnvBlock& block() const
+    {
+        return m_block;
+    }
+
+    /** @brief Copies the variables into a map. */
+    [[nodiscard]] EnvMap to_map() const;
+
+private:
+    EnvSnapshot() = default;
+
+    uint64_t m_version{0U};
+    EnvBlock m_block;
+#ifdef _WIN32
+    std::string m_arena; ///< The UTF-8 text of the variables, the block is UTF-16
+#endif
+    std::vector<Entry> m_entries;
+};
+
 /**
   Gives an environment block used in Windows APIs. Each item is null
   terminated, end of list is double null-terminated and conforms to
@@ -64,6 +200,13 @@ EnvMap current_env_copy();
  */
 std::u16string create_env_block(const EnvMap& map);
 
+/**
+ * @brief Gives the environment block of a snapshot, like create_env_block()
+ * of its variables. Its entries are encoded in a single pass, without an
+ * EnvMap in between.
+ */
+std::u16string create_env_block(const EnvSnapshot& snapshot);
+
 /**
  * Use this to put a guard for changing current working directory. On
  * destruction the current working directory will be reset to the old one.
@@ -88,19 +231,25 @@ private:
 /**
  * On destruction reset environment variables and current working directory
  * to as it was on construction.
+ *
+ * It keeps an EnvSnapshot of construction, and only writes back the
+ * variables that differ from the snapshot on destruction, if any. Both
+ * snapshots are read afresh, so changes not made through cenv, e.g. by a
+ * direct setenv(), are captured and undone as well.
  */
 class [[maybe_unused]] EnvGuard : public CwdGuard
 {
 public:
     EnvGuard()
     {
-        m_env = current_env_copy();
+        EnvSnapshot::invalidate();
+        m_env = EnvSnapshot::current();
     }
 
     ~EnvGuard();
 
 private:
-    EnvMap m_env;
+    std::shared_ptr<const EnvSnapshot> m_env;
 };
 
 } // namespace subprocess
\ No newline at end of file
@@ -0,0 +1,239 @@
+#include "exit_watcher.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+namespace subprocess::details
+{
+
+#ifdef _WIN32
+namespace
+{
+std::mutex g_exit_mutex;
+std::condition_variable g_exit_signaled;
+uint64_t g_exit_count{0U}; ///< Exits signaled so far, guarded by g_exit_mutex
+
+VOID CALLBACK signal_exit(PVOID context, BOOLEAN /*timed_out*/)
+{
+    static_cast<ExitSignal*>(context)->exited = true;
+    {
+        std::lock_guard lock(g_exit_mutex);
+        ++g_exit_count;
+    }
+    g_exit_signaled.notify_all();
+}
+} // namespace
+
+ExitSignal::~ExitSignal()
+{
+    if (wait != nullptr)
+    {
+        // Blocks until a running callback is done, so it never sees this destroyed.
+        (void)UnregisterWaitEx(wait, INVALID_HANDLE_VALUE);
+    }
+}
+#elif defined(SYS_pidfd_open)
+namespace
+{
+/** @brief Set once pidfd_open failed with ENOSYS, before Linux 5.3. */
+std::atomic<bool> g_no_pidfd{false};
+} // namespace
+#endif
+
+ExitWatcher::~ExitWatcher() = default;
+
+void ExitWatcher::add(Popen& popen, std::size_t id)
+{
+    PipeHandle handle = kBadPipeValue;
+
+#ifdef _WIN32
+    handle = popen.process_info.hProcess;
+#elif defined(SYS_pidfd_open)
+    // Processes without a pidfd are polled instead.
+    if (popen.m_pidfd == kBadPipeValue && !g_no_pidfd.load(std::memory_order_relaxed))
+    {
+        auto pidfd = static_cast<int>(syscall(SYS_pidfd_open, popen.pid, 0));
+        if (pidfd >= 0)
+        {
+            popen.m_pidfd = pidfd;
+        }
+        else if (errno == ENOSYS)
+        {
+            g_no_pidfd.store(true, std::memory_order_relaxed);
+        }
+    }
+    handle = popen.m_pidfd;
+#endif
+
+    m_entries.push_back({&popen, id, handle});
+}
+
+void ExitWatcher::remove(std::size_t id)
+{
+    auto it = std::find_if(m_entries.begin(), m_entries.end(), [id](const Entry& entry) { return entry.id == id; });
+    if (it != m_entries.end())
+    {
+        (void)m_entries.erase(it);
+    }
+}
+
+#ifdef _WIN32
+void ExitWatcher::register_waits()
+{
+    for (auto& entry : m_entries)
+    {
+        std::shared_ptr<ExitSignal>& signal = entry.popen->m_exit_signal;
+        if (signal != nullptr)
+        {
+            continue;
+        }
+
+        auto created = std::make_shared<ExitSignal>();
+        if (!RegisterWaitForSingleObject(&created->wait, entry.handle, &signal_exit, created.get(), INFINITE,
+                                         WT_EXECUTEONLYONCE))
+        {
+            created->wait = nullptr;
+            throw OSError("RegisterWaitForSingleObject failed: " + LastErrorString());
+        }
+        signal = std::move(created);
+    }
+}
+
+std::vector<std::size_t> ExitWatcher::wait(double timeout)
+{
+    std::vector<std::size_t> result;
+    std::vector<HANDLE> handles;
+    StopWatch watch;
+
+    // A process with a thread pool wait has its exit flagged, the others are asked.
+    auto exited = [](const Entry& entry)
+    {
+        const std::shared_ptr<ExitSignal>& signal = entry.popen->m_exit_signal;
+        return signal != nullptr ? signal->exited.load() : WaitForSingleObject(entry.handle, 0U) == WAIT_OBJECT_0;
+    };
+
+    while (!m_entries.empty())
+    {
+        double remaining = watch.remaining(timeout);
+        bool signaled = true;
+
+        if (m_entries.size() <= MAXIMUM_WAIT_OBJECTS)
+        {
+            DWORD ms = remaining < 0.0 ? INFINITE : static_cast<DWORD>(std::ceil(remaining * 1000.0));
+            handles.clear();
+            for (auto& entry : m_entries)
+            {
+                handles.push_back(entry.handle);
+            }
+            DWORD wr = WaitForMultipleObjects(static_cast<DWORD>(handles.size()), handles.data(), FALSE, ms);
+            if (wr == WAIT_FAILED)
+            {
+                throw OSError("waiting for processes failed: " + LastErrorString());
+            }
+            signaled = wr != WAIT_TIMEOUT;
+        }
+        else
+        {
+            register_waits();
+            // The count is read before the flags, so an exit flagged after them still changes it.
+            std::unique_lock lock(g_exit_mutex);
+            uint64_t count = g_exit_count;
+            if (std::none_of(m_entries.begin(), m_entries.end(), exited))
+            {
+                auto changed = [count] { return g_exit_count != count; };
+                if (remaining < 0.0)
+                {
+                    g_exit_signaled.wait(lock, changed);
+                }
+                else
+                {
+                    signaled = g_exit_signaled.wait_for(lock, StopWatch::to_duration(remaining), changed);
+                }
+            }
+        }
+
+        // Another thread's process may have been signaled, so there may be nothing to reap yet.
+        if (signaled)
+        {
+            for (auto& entry : m_entries)
+            {
+                if (exited(entry))
+                {
+                    (void)entry.popen->wait();
+                    result.push_back(entry.id);
+                    entry.popen = nullptr;
+                }
+            }
+            std::erase_if(m_entries, [](const Entry& entry) { return entry.popen == nullptr; });
+        }
+
+        if (!result.empty() || watch.expired(timeout))
+        {
+            break;
+        }
+    }
+
+    return result;
+}
+#else
+std::vector<std::size_t> ExitWatcher::wait(double timeout)
+{
+    std::vector<std::size_t> result;
+    std::vector<PipePollItem> items;
+    StopWatch watch;
+    double interval = 0.0001;
+
+    while (!m_entries.empty())
+    {
+        items.clear();
+        bool polled = false;
+        for (auto& entry : m_entries)
+        {
+            items.push_back({entry.handle});
+            polled = polled || entry.handle == kBadPipeValue;
+        }
+
+        // Entries without a pidfd are checked with waitpid after at most the backoff interval. poll() skips them,
+        // and with nothing left to watch it simply sleeps.
+        double remaining = watch.remaining(timeout);
+        double wait = remaining;
+        if (polled)
+        {
+            wait = remaining < 0.0 ? interval : std::min(interval, remaining);
+            interval = std::min(interval * 2.0, 0.01);
+        }
+        (void)pipe_poll(items.data(), items.size(), wait);
+
+        for (std::size_t i = 0U; i < m_entries.size(); ++i)
+        {
+            Entry& entry = m_entries[i];
+            bool exited = entry.handle == kBadPipeValue ? entry.popen->poll() : items[i].ready;
+            if (exited)
+            {
+                (void)entry.popen->wait(); // the pidfd being readable means this returns at once
+                result.push_back(entry.id);
+                entry.popen = nullptr;
+            }
+        }
+
+        std::erase_if(m_entries, [](const Entry& entry) { return entry.popen == nullptr; });
+
+        if (!result.empty() || watch.expired(timeout))
+        {
+            break;
+        }
+    }
+
+    return result;
+}
+#endif
+
+} // namespace subprocess::details
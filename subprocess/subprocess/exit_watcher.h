@@ -0,0 +1,99 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+#include "builder.h"
+
+namespace subprocess::details
+{
+
+/**
+ * @brief Waits for many processes at once, without a thread per process.
+ *
+ * On Linux each process gets a pidfd, which becomes readable once the
+ * process exits, and all of them are waited for with a single poll. On
+ * Windows up to MAXIMUM_WAIT_OBJECTS process handles are waited for with
+ * WaitForMultipleObjects. Beyond that the thread pool waits for them with
+ * RegisterWaitForSingleObject and wakes the waiting threads. Where neither
+ * is available, e.g. on macOS, processes are polled with waitpid with an
+ * exponential backoff.
+ *
+ * The pidfd and the thread pool wait are kept by the Popen from their first
+ * use until it is closed, so a loop that waits for the same processes over
+ * and over does not set them up anew each time.
+ */
+#ifdef _WIN32
+/** @brief Set by the thread pool once the process of a Popen exits, see ExitWatcher. */
+struct ExitSignal
+{
+    ExitSignal() = default;
+    ~ExitSignal();
+
+    ExitSignal(const ExitSignal&) = delete;
+    ExitSignal& operator=(const ExitSignal&) = delete;
+
+    HANDLE wait{nullptr};
+    std::atomic<bool> exited{false};
+};
+#endif
+
+class ExitWatcher
+{
+public:
+    ExitWatcher() = default;
+    ~ExitWatcher();
+
+    ExitWatcher(const ExitWatcher&) = delete;
+    ExitWatcher& operator=(const ExitWatcher&) = delete;
+
+    /**
+     * @brief Starts watching a process. The Popen must stay in place until
+     * it is reported or removed.
+     * @param popen The running process.
+     * @param id Reported by wait() once the process has exited.
+     */
+    void add(Popen& popen, std::size_t id);
+
+    /**
+     * @brief Stops watching the process added with id.
+     */
+    void remove(std::size_t id);
+
+    /**
+     * @brief True if no process is watched.
+     */
+    [[nodiscard]] bool empty() const
+    {
+        return m_entries.empty();
+    }
+
+    /**
+     * @brief Waits until at least one watched process has exited, or the
+     * timeout expires. Exited processes are reaped, so their returncode is
+     * set, and no longer watched.
+     * @param timeout Timeout in seconds, negative to wait forever.
+     * @return The ids of the exited processes, empty on timeout or if
+     * nothing is watched.
+     * @throws OSError If there was an OS-level error.
+     */
+    std::vector<std::size_t> wait(double timeout = -1.0);
+
+private:
+    struct Entry
+    {
+        Popen* popen;
+        std::size_t id;
+        PipeHandle handle; ///< pidfd or process handle of the Popen, kBadPipeValue if polled
+    };
+
+    std::vector<Entry> m_entries;
+
+#ifdef _WIN32
+    /** @brief Has the thread pool signal the processes, for more handles than one wait can take. */
+    void register_waits();
+#endif
+};
+
+} // namespace subprocess::details
@@ -1,10 +1,27 @@
 #include "pipe.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <shared_mutex>
 #include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "builder.h"
+#include "reactor.h"
+#include "trace.h"
 
 #ifndef _WIN32
 #include <cerrno>
+#include <cstdlib>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #endif
 
 namespace subprocess
@@ -58,6 +75,39 @@ void PipePair::close_output()
 #pragma clang diagnostic pop
 
 #ifdef _WIN32
+namespace
+{
+std::shared_mutex g_overlapped_mutex;
+std::unordered_set<PipeHandle> g_overlapped_pipes;
+
+struct SyncIoEvent
+{
+    HANDLE handle{CreateEventW(nullptr, TRUE, FALSE, nullptr)};
+
+    SyncIoEvent() = default;
+    SyncIoEvent(const SyncIoEvent&) = delete;
+    SyncIoEvent& operator=(const SyncIoEvent&) = delete;
+
+    ~SyncIoEvent()
+    {
+        if (handle != nullptr)
+        {
+            (void)CloseHandle(handle);
+        }
+    }
+};
+
+/**
+ * An event for waiting on overlapped I/O done synchronously. The low bit is set
+ * so the completion is not also queued to a port the handle is associated with.
+ */
+HANDLE sync_io_event()
+{
+    thread_local const SyncIoEvent event;
+    return reinterpret_cast<HANDLE>(reinterpret_cast<uintptr_t>(event.handle) | 1U); // NOLINT
+}
+} // namespace
+
 void pipe_set_inheritable(subprocess::PipeHandle handle, bool inheritable)
 {
     if (handle == kBadPipeValue)
@@ -76,11 +126,17 @@ void pipe_set_inheritable(subprocess::PipeHandle handle, bool inheritable)
 
 bool pipe_close(PipeHandle handle)
 {
+    {
+        // Before closing, the value may be reused as soon as it is closed.
+        std::unique_lock lock(g_overlapped_mutex);
+        (void)g_overlapped_pipes.erase(handle);
+    }
     return 0 != CloseHandle(handle);
 }
 
-PipePair pipe_create(bool inheritable)
+PipePair pipe_create(bool inheritable, size_t size)
 {
+    SUBPROCESS_TRACE_SCOPE(TracePhase::pipe_create);
     SECURITY_ATTRIBUTES security = {0U};
     security.nLength = static_cast<DWORD>(sizeof(security));
     security.bInheritHandle = inheritable;
@@ -88,7 +144,8 @@ PipePair pipe_create(bool inheritable)
     PipeHandle input;
     PipeHandle output;
 
-    bool result = CreatePipe(&input, &output, &security, 0U);
+    auto buffer_size = static_cast<DWORD>(std::min<size_t>(size, MAXDWORD));
+    bool result = CreatePipe(&input, &output, &security, buffer_size);
     if (!result)
     {
         input = kBadPipeValue;
@@ -99,20 +156,255 @@ PipePair pipe_create(bool inheritable)
     return {input, output};
 }
 
+PipePair pipe_create_overlapped(bool inheritable, size_t size)
+{
+    SUBPROCESS_TRACE_SCOPE(TracePhase::pipe_create);
+    static std::atomic<unsigned long> counter{0U};
+    std::string name = "\\\\.\\pipe\\subprocess-" + std::to_string(GetCurrentProcessId()) + "-" +
+                       std::to_string(++counter);
+
+    // Unlike CreatePipe, 0 would make the buffer as small as a single write.
+    constexpr size_t kDefaultSize = 64U * 1024U;
+    auto buffer_size = static_cast<DWORD>(std::min<size_t>(size == 0U ? kDefaultSize : size, MAXDWORD));
+
+    // The first instance flag makes creation fail rather than share a name someone else created.
+    PipeHandle input = CreateNamedPipeA(name.c_str(),
+                                        PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                                        PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                        1U, buffer_size, buffer_size, 0U, nullptr);
+    if (input == INVALID_HANDLE_VALUE)
+    {
+        throw OSError("CreateNamedPipe failed: " + LastErrorString());
+    }
+
+    SECURITY_ATTRIBUTES security = {0U};
+    security.nLength = static_cast<DWORD>(sizeof(security));
+    security.bInheritHandle = inheritable;
+
+    // Children expect ordinary synchronous handles, so only the parent end is overlapped.
+    PipeHandle output =
+        CreateFileA(name.c_str(), GENERIC_WRITE, 0U, &security, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (output == INVALID_HANDLE_VALUE)
+    {
+        std::string message = "CreateFile of a named pipe failed: " + LastErrorString();
+        (void)CloseHandle(input);
+        throw OSError(message);
+    }
+
+    std::unique_lock lock(g_overlapped_mutex);
+    (void)g_overlapped_pipes.insert(input);
+    return {input, output};
+}
+
+bool pipe_is_overlapped(PipeHandle handle)
+{
+    std::shared_lock lock(g_overlapped_mutex);
+    return g_overlapped_pipes.contains(handle);
+}
+
 ssize_t pipe_read(PipeHandle handle, void* buffer, std::size_t size)
 {
     DWORD bread = 0U;
-    bool result = ReadFile(handle, buffer, static_cast<DWORD>(size), &bread, nullptr);
+    bool result;
+    if (pipe_is_overlapped(handle))
+    {
+        OVERLAPPED overlapped{};
+        overlapped.hEvent = sync_io_event();
+        result = (0 != ReadFile(handle, buffer, static_cast<DWORD>(size), nullptr, &overlapped) ||
+                  GetLastError() == ERROR_IO_PENDING) &&
+                 0 != GetOverlappedResult(handle, &overlapped, &bread, TRUE);
+    }
+    else
+    {
+        result = ReadFile(handle, buffer, static_cast<DWORD>(size), &bread, nullptr);
+    }
+    SUBPROCESS_TRACE_COUNT(TraceCounter::pipe_reads, 1U);
+    SUBPROCESS_TRACE_COUNT(TraceCounter::bytes_read, result ? bread : 0U);
     return result ? static_cast<ssize_t>(bread) : -1;
 }
 
 ssize_t pipe_write(PipeHandle handle, const void* buffer, size_t size)
 {
     DWORD written = 0U;
-    bool result = WriteFile(handle, buffer, static_cast<DWORD>(size), &written, nullptr);
+    bool result;
+    if (pipe_is_overlapped(handle))
+    {
+        OVERLAPPED overlapped{};
+        overlapped.hEvent = sync_io_event();
+        result = (0 != WriteFile(handle, buffer, static_cast<DWORD>(size), nullptr, &overlapped) ||
+                  GetLastError() == ERROR_IO_PENDING) &&
+                 0 != GetOverlappedResult(handle, &overlapped, &written, TRUE);
+    }
+    else
+    {
+        result = WriteFile(handle, buffer, static_cast<DWORD>(size), &written, nullptr);
+    }
+    SUBPROCESS_TRACE_COUNT(TraceCounter::pipe_writes, 1U);
+    SUBPROCESS_TRACE_COUNT(TraceCounter::bytes_written, result ? written : 0U);
     return result ? static_cast<ssize_t>(written) : -1;
 }
 
+ssize_t pipe_write_gather(PipeHandle handle, const std::string_view* buffers, size_t count)
+{
+    constexpr size_t kJoinLimit = 65536U;
+    size_t total = 0U;
+    for (size_t i = 0U; i < count; ++i)
+    {
+        total += buffers[i].size();
+    }
+
+    if (count == 1U || total > kJoinLimit)
+    {
+        return count == 0U ? 0 : pipe_write(handle, buffers[0U].data(), buffers[0U].size());
+    }
+
+    thread_local std::vector<char> joined;
+    joined.clear();
+    for (size_t i = 0U; i < count; ++i)
+    {
+        joined.insert(joined.end(), buffers[i].begin(), buffers[i].end());
+    }
+    return pipe_write(handle, joined.data(), joined.size());
+}
+
+void pipe_set_blocking(PipeHandle handle, bool blocking)
+{
+    if (handle == kBadPipeValue)
+    {
+        throw std::invalid_argument("pipe_set_blocking: handle is invalid");
+    }
+
+    DWORD mode = static_cast<DWORD>(PIPE_READMODE_BYTE | (blocking ? PIPE_WAIT : PIPE_NOWAIT));
+    if (0 == SetNamedPipeHandleState(handle, &mode, nullptr, nullptr))
+    {
+        throw OSError("SetNamedPipeHandleState failed: " + LastErrorString());
+    }
+}
+
+bool pipe_is_blocking(PipeHandle handle)
+{
+    if (handle == kBadPipeValue)
+    {
+        throw std::invalid_argument("pipe_is_blocking: handle is invalid");
+    }
+
+    DWORD state = 0;
+    if (0 == GetNamedPipeHandleState(handle, &state, nullptr, nullptr, nullptr, nullptr, 0))
+    {
+        throw OSError("GetNamedPipeHandleState failed: " + LastErrorString());
+    }
+    return (state & PIPE_NOWAIT) == 0U;
+}
+
+bool pipe_would_block()
+{
+    return GetLastError() == ERROR_NO_DATA;
+}
+
+int pipe_poll(PipePollItem* items, size_t count, double timeout)
+{
+    StopWatch watch;
+    DWORD interval = 0U;
+    int ready = 0;
+
+    while (true)
+    {
+        for (size_t i = 0U; i < count; ++i)
+        {
+            PipePollItem& item = items[i];
+            item.ready = false;
+            if (item.handle == kBadPipeValue)
+            {
+                continue;
+            }
+
+            DWORD available = 0U;
+            // A failing peek means the writer is gone, which has to be reported as ready too.
+            item.ready = item.write || 0 == PeekNamedPipe(item.handle, nullptr, 0U, nullptr, &available, nullptr) ||
+                         available > 0U;
+            ready += item.ready ? 1 : 0;
+        }
+
+        if (ready > 0)
+        {
+            break;
+        }
+
+        double remaining = watch.remaining(timeout);
+        if (timeout >= 0.0 && remaining <= 0.0)
+        {
+            break;
+        }
+
+        // Back off from yielding the time slice up to 8 ms, so short bursts are picked up quickly while an idle
+        // child costs little CPU.
+        DWORD ms = interval;
+        if (timeout >= 0.0)
+        {
+            ms = std::min(ms, static_cast<DWORD>(remaining * 1000.0));
+        }
+        Sleep(ms);
+        interval = std::min(interval == 0U ? 1U : interval * 2U, 8U);
+    }
+
+    return ready;
+}
+
+PipeHandle temp_file_create()
+{
+    wchar_t dir[MAX_PATH + 1U];
+    wchar_t name[MAX_PATH + 1U];
+    if (GetTempPathW(MAX_PATH + 1U, dir) == 0U || GetTempFileNameW(dir, L"sub", 0U, name) == 0U)
+    {
+        throw OSError("GetTempFileName failed: " + LastErrorString());
+    }
+
+    // Inherited handles share the delete-on-close, so the file goes away with the last of them.
+    DWORD share = FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE;
+    HANDLE handle = CreateFileW(name, GENERIC_READ | GENERIC_WRITE, share, nullptr, CREATE_ALWAYS,
+                                FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        std::string message = "CreateFile failed: " + LastErrorString();
+        (void)DeleteFileW(name);
+        throw OSError(message);
+    }
+    return handle;
+}
+
+MappedFile file_map(PipeHandle handle)
+{
+    LARGE_INTEGER size{};
+    if (!GetFileSizeEx(handle, &size))
+    {
+        throw OSError("GetFileSizeEx failed: " + LastErrorString());
+    }
+
+    // A mapping of an empty file is an error on Windows.
+    if (size.QuadPart == 0)
+    {
+        return {};
+    }
+
+    HANDLE mapping = CreateFileMappingW(handle, nullptr, PAGE_READONLY, 0U, 0U, nullptr);
+    if (mapping == nullptr)
+    {
+        throw OSError("CreateFileMapping failed: " + LastErrorString());
+    }
+
+    // The view keeps the section alive on its own.
+    void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0U, 0U, 0U);
+    std::string message = view == nullptr ? "MapViewOfFile failed: " + LastErrorString() : std::string{};
+    (void)CloseHandle(mapping);
+    if (view == nullptr)
+    {
+        throw OSError(message);
+    }
+
+    std::shared_ptr<const void> owner(view, [](const void* data) { (void)UnmapViewOfFile(data); });
+    return {std::move(owner), static_cast<const char*>(view), static_cast<std::size_t>(size.QuadPart)};
+}
+
 #else
 void pipe_set_inheritable(PipeHandle handle, bool inherits)
 {
@@ -122,7 +414,7 @@ void pipe_set_inheritable(PipeHandle handle, bool inherits)
     int flags = fcntl(handle, F_GETFD);
 
     if (flags < 0)
-        throw_os_error("fcntl", errno);
+        details::throw_os_error("fcntl", errno);
 
     if (inherits)
         flags &= ~FD_CLOEXEC;
@@ -130,8 +422,8 @@ void pipe_set_inheritable(PipeHandle handle, bool inherits)
         flags |= FD_CLOEXEC;
 
     int result = fcntl(handle, F_SETFD, flags);
-    if (result < -1)
-        throw_os_error("fcntl", errno);
+    if (result < 0)
+        details::throw_os_error("fcntl", errno);
 }
 bool pipe_close(PipeHandle handle)
 {
@@ -141,74 +433,357 @@ bool pipe_close(PipeHandle handle)
     return ::close(handle) == 0;
 }
 
-PipePair pipe_create(bool inheritable)
+PipePair pipe_create(bool inheritable, size_t size)
 {
+    SUBPROCESS_TRACE_SCOPE(TracePhase::pipe_create);
     int fd[2];
+#ifdef __APPLE__
+    // No pipe2() here, the flag is set below. A child spawned by another thread in between may inherit the ends.
     bool success = !::pipe(fd);
+#else
+    // Close-on-exec from the start, a child spawned concurrently by another thread never sees the ends.
+    bool success = !::pipe2(fd, inheritable ? 0 : O_CLOEXEC);
+#endif
     if (!success)
     {
-        throw_os_error("pipe", errno);
+        details::throw_os_error("pipe", errno);
         return {};
     }
 
+#ifdef __APPLE__
     if (!inheritable)
     {
         pipe_set_inheritable(fd[0], false);
         pipe_set_inheritable(fd[1], false);
     }
+#endif
+
+#ifdef F_SETPIPE_SZ
+    // Unprivileged processes may go up to /proc/sys/fs/pipe-max-size, 1 MiB by default. Failing is fine, the size
+    // is only a hint.
+    constexpr size_t kMaxPipeSize = 1024U * 1024U;
+    if (size > 0U && fcntl(fd[0], F_GETPIPE_SZ) < static_cast<int>(std::min(size, kMaxPipeSize)))
+    {
+        (void)fcntl(fd[0], F_SETPIPE_SZ, static_cast<int>(std::min(size, kMaxPipeSize)));
+    }
+#else
+    (void)size;
+#endif
 
     return {fd[0], fd[1]};
 }
 
+PipePair pipe_create_overlapped(bool inheritable, size_t size)
+{
+    return pipe_create(inheritable, size);
+}
+
+bool pipe_is_overlapped(PipeHandle /*handle*/)
+{
+    return false;
+}
+
 ssize_t pipe_read(PipeHandle handle, void* buffer, size_t size)
 {
-    return ::read(handle, buffer, size);
+    ssize_t result = ::read(handle, buffer, size);
+    SUBPROCESS_TRACE_COUNT(TraceCounter::pipe_reads, 1U);
+    SUBPROCESS_TRACE_COUNT(TraceCounter::bytes_read, static_cast<uint64_t>(std::max<ssize_t>(result, 0)));
+    return result;
 }
 
 ssize_t pipe_write(PipeHandle handle, const void* buffer, size_t size)
 {
-    return ::write(handle, buffer, size);
+    ssize_t result = ::write(handle, buffer, size);
+    SUBPROCESS_TRACE_COUNT(TraceCounter::pipe_writes, 1U);
+    SUBPROCESS_TRACE_COUNT(TraceCounter::bytes_written, static_cast<uint64_t>(std::max<ssize_t>(result, 0)));
+    // Like PIPE_NOWAIT on Windows, a full pipe accepts nothing rather than failing.
+    if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        result = 0;
+    }
+    return result;
+}
+
+ssize_t pipe_write_gather(PipeHandle handle, const std::string_view* buffers, size_t count)
+{
+    constexpr size_t kMaxBuffers = 64U; // well below IOV_MAX everywhere
+    iovec vectors[kMaxBuffers];
+    count = std::min(count, kMaxBuffers);
+    for (size_t i = 0U; i < count; ++i)
+    {
+        vectors[i].iov_base = const_cast<char*>(buffers[i].data()); // NOLINT
+        vectors[i].iov_len = buffers[i].size();
+    }
+
+    ssize_t result = ::writev(handle, &vectors[0U], static_cast<int>(count));
+    SUBPROCESS_TRACE_COUNT(TraceCounter::pipe_writes, 1U);
+    SUBPROCESS_TRACE_COUNT(TraceCounter::bytes_written, static_cast<uint64_t>(std::max<ssize_t>(result, 0)));
+    if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    {
+        result = 0;
+    }
+    return result;
+}
+
+void pipe_set_blocking(PipeHandle handle, bool blocking)
+{
+    if (handle == kBadPipeValue)
+        throw std::invalid_argument("pipe_set_blocking: handle is invalid");
+
+    int flags = fcntl(handle, F_GETFL);
+    if (flags < 0)
+        details::throw_os_error("fcntl", errno);
+
+    if (blocking)
+        flags &= ~O_NONBLOCK;
+    else
+        flags |= O_NONBLOCK;
+
+    if (fcntl(handle, F_SETFL, flags) < 0)
+        details::throw_os_error("fcntl", errno);
+}
+
+bool pipe_is_blocking(PipeHandle handle)
+{
+    if (handle == kBadPipeValue)
+        throw std::invalid_argument("pipe_is_blocking: handle is invalid");
+
+    int flags = fcntl(handle, F_GETFL);
+    if (flags < 0)
+        details::throw_os_error("fcntl", errno);
+
+    return (flags & O_NONBLOCK) == 0;
 }
+
+bool pipe_would_block()
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+int pipe_poll(PipePollItem* items, size_t count, double timeout)
+{
+    constexpr size_t kStackItems = 8U;
+    pollfd stack_fds[kStackItems];
+    std::vector<pollfd> heap_fds;
+    pollfd* fds = stack_fds;
+    if (count > kStackItems)
+    {
+        heap_fds.resize(count);
+        fds = heap_fds.data();
+    }
+
+    for (size_t i = 0U; i < count; ++i)
+    {
+        // poll() ignores negative descriptors, which is exactly kBadPipeValue.
+        fds[i].fd = items[i].handle;
+        fds[i].events = items[i].write ? POLLOUT : POLLIN;
+        fds[i].revents = 0;
+        items[i].ready = false;
+    }
+
+    int ms = timeout < 0.0 ? -1 : static_cast<int>(std::ceil(timeout * 1000.0));
+    int ready = ::poll(fds, static_cast<nfds_t>(count), ms);
+    if (ready < 0)
+    {
+        if (errno != EINTR)
+            details::throw_os_error("poll", errno);
+        ready = 0;
+    }
+
+    for (size_t i = 0U; i < count; ++i)
+    {
+        items[i].ready = (fds[i].revents & (POLLIN | POLLOUT | POLLHUP | POLLERR | POLLNVAL)) != 0;
+    }
+
+    return ready;
+}
+
+namespace details
+{
+SigPipeGuard::SigPipeGuard()
+{
+    sigset_t block;
+    sigset_t pending;
+    (void)sigemptyset(&block);
+    (void)sigaddset(&block, SIGPIPE);
+    (void)pthread_sigmask(SIG_BLOCK, &block, &m_old_mask);
+    (void)sigpending(&pending);
+    m_was_pending = sigismember(&pending, SIGPIPE) == 1 || sigismember(&m_old_mask, SIGPIPE) == 1;
+}
+
+SigPipeGuard::~SigPipeGuard()
+{
+    if (!m_was_pending)
+    {
+        sigset_t pending;
+        (void)sigpending(&pending);
+        if (sigismember(&pending, SIGPIPE) == 1)
+        {
+            // It is pending, so sigwait returns immediately.
+            sigset_t set;
+            int signum;
+            (void)sigemptyset(&set);
+            (void)sigaddset(&set, SIGPIPE);
+            (void)sigwait(&set, &signum);
+        }
+    }
+    (void)pthread_sigmask(SIG_SETMASK, &m_old_mask, nullptr);
+}
+} // namespace details
+
+PipeHandle temp_file_create()
+{
+    int fd = -1;
+#ifdef MFD_CLOEXEC
+    fd = memfd_create("subprocess-output", MFD_CLOEXEC);
 #endif
 
-std::string pipe_read_all(PipeHandle handle)
+    // Without memfd, e.g. before Linux 3.17 or on macOS, an unlinked file in the temporary directory does the same.
+    if (fd < 0)
+    {
+        const char* dir = std::getenv("TMPDIR");
+        std::string name = std::string(dir != nullptr && *dir != '\0' ? dir : "/tmp") + "/subprocess-XXXXXX";
+        fd = mkostemp(name.data(), O_CLOEXEC);
+        if (fd < 0)
+        {
+            details::throw_os_error("mkostemp", errno);
+        }
+        (void)unlink(name.c_str());
+    }
+
+    return fd;
+}
+
+MappedFile file_map(PipeHandle handle)
+{
+    struct stat status{};
+    if (fstat(handle, &status) != 0)
+    {
+        details::throw_os_error("fstat", errno);
+    }
+
+    auto size = static_cast<std::size_t>(status.st_size);
+    if (size == 0U)
+    {
+        return {};
+    }
+
+    void* data = mmap(nullptr, size, PROT_READ, MAP_SHARED, handle, 0);
+    if (data == MAP_FAILED)
+    {
+        details::throw_os_error("mmap", errno);
+    }
+
+    std::shared_ptr<const void> owner(data,
+                                      [size](const void* mapped) { (void)munmap(const_cast<void*>(mapped), size); });
+    return {std::move(owner), static_cast<const char*>(data), size};
+}
+#endif
+
+ssize_t pipe_read_append(PipeHandle handle, std::string& target, size_t& chunk)
+{
+    constexpr size_t kMinChunk = 16U * 1024U;
+    constexpr size_t kMaxChunk = 1024U * 1024U;
+    chunk = std::clamp(chunk, kMinChunk, kMaxChunk);
+
+    size_t size = target.size();
+    ssize_t transfered = -1;
+#ifdef __cpp_lib_string_resize_and_overwrite
+    target.resize_and_overwrite(size + chunk,
+                                [&](char* data, size_t)
+                                {
+                                    transfered = pipe_read(handle, data + size, chunk);
+                                    return size + static_cast<size_t>(std::max<ssize_t>(transfered, 0));
+                                });
+#else
+    // The string grows geometrically, so the zero fill is the only overhead left.
+    target.resize(size + chunk);
+    transfered = pipe_read(handle, &target[size], chunk);
+    target.resize(size + static_cast<size_t>(std::max<ssize_t>(transfered, 0)));
+#endif
+
+    if (transfered > 0 && static_cast<size_t>(transfered) == chunk)
+    {
+        chunk = std::min(chunk * 2U, kMaxChunk);
+    }
+
+    return transfered;
+}
+
+std::string pipe_read_all(PipeHandle handle, size_t size_hint)
 {
     std::string result{};
 
     if (handle != kBadPipeValue)
     {
-        constexpr size_t buf_size = 2048U;
-        uint8_t buf[buf_size];
-        ssize_t transfered;
-
-        do
+        result.reserve(size_hint);
+        size_t chunk = 0U;
+        while (pipe_read_append(handle, result, chunk) > 0)
         {
-            if (transfered = pipe_read(handle, static_cast<void*>(&buf[0]), buf_size); transfered > 0)
-            {
-                (void)result.insert(result.end(), &buf[0], &buf[transfered]);
-            }
-        } while (transfered > 0);
+        }
     }
 
     return result;
 }
 
+namespace
+{
+/** Reads and discards everything, for pipe_ignore_and_close. */
+class DiscardTransfer final : public IoTransfer
+{
+public:
+    explicit DiscardTransfer(PipeHandle handle) : m_handle(handle)
+    {
+    }
+
+    ~DiscardTransfer() override
+    {
+        (void)pipe_close(m_handle);
+    }
+
+    [[nodiscard]] PipeHandle handle() const override
+    {
+        return m_handle;
+    }
+
+    [[nodiscard]] bool is_write() const override
+    {
+        return false;
+    }
+
+    IoStatus on_ready() override
+    {
+        uint8_t buffer[1024U];
+        ssize_t transfered = pipe_read(m_handle, &buffer[0U], sizeof(buffer));
+        IoStatus result;
+
+        if (transfered > 0)
+        {
+            result = IoStatus::pending;
+        }
+        else if (transfered < 0 && pipe_would_block())
+        {
+            result = IoStatus::blocked;
+        }
+        else
+        {
+            result = IoStatus::done;
+        }
+
+        return result;
+    }
+
+private:
+    PipeHandle m_handle;
+};
+} // namespace
+
 void pipe_ignore_and_close(PipeHandle handle)
 {
     if (handle != kBadPipeValue)
     {
-        std::thread thread(
-            [handle]()
-            {
-                std::vector<uint8_t> buffer(1024U);
-                while (pipe_read(handle, &buffer[0U], buffer.size()) >= 0)
-                {
-                }
-                (void)pipe_close(handle);
-            });
-
-        thread.detach();
+        IoReactor::instance().add(std::make_unique<DiscardTransfer>(handle));
     }
 }
 
-} // namespace subprocess
\ No newline at end of file
+} // namespace subprocess
@@ -84,10 +84,39 @@ bool pipe_close(PipeHandle handle);
  * Creates a pair of pipes for input/output.
  *
  * @param inheritable If true, subprocesses will inherit the pipe.
+ * @param size Requested buffer size in bytes, 0 for the system default. This
+ *        is a hint: Linux raises the size with F_SETPIPE_SZ as far as the
+ *        unprivileged limit allows, Windows passes it to CreatePipe, other
+ *        systems ignore it.
  * @throw OSError if the system call fails.
  * @return Pipe pair. If failure, returned pipes will have values of kBadPipeValue.
  */
-PipePair pipe_create(bool inheritable = true);
+PipePair pipe_create(bool inheritable = true, size_t size = 0U);
+
+/**
+ * Creates a pipe whose input end, the one read from, supports overlapped I/O,
+ * so the IoReactor is told by an I/O completion port when data arrives instead
+ * of polling for it.
+ *
+ * On Windows this is a uniquely named pipe, \\.\pipe\subprocess-<pid>-<n>,
+ * rejecting remote clients. Its input end is opened with FILE_FLAG_OVERLAPPED
+ * and is never inheritable. The output end is an ordinary synchronous handle,
+ * for a child to write to. pipe_read and pipe_write handle both kinds, but
+ * ReadFile without an OVERLAPPED must not be used on the input end, and it must
+ * be closed with pipe_close(). Elsewhere this is pipe_create().
+ *
+ * @param inheritable If true, subprocesses will inherit the output end.
+ * @param size Buffer size in bytes, 0 for 64 KiB on Windows. As pipe_create
+ *        elsewhere.
+ * @throw OSError if the system call fails.
+ */
+PipePair pipe_create_overlapped(bool inheritable = true, size_t size = 0U);
+
+/**
+ * Checks whether handle is the input end of a pipe_create_overlapped() pipe.
+ * Always false off Windows.
+ */
+bool pipe_is_overlapped(PipeHandle handle);
 
 /**
  * Sets the pipe to be inheritable or not for subprocess.
@@ -108,33 +137,163 @@ void pipe_set_inheritable(PipeHandle handle, bool inheritable);
  */
 ssize_t pipe_read(PipeHandle handle, void* buffer, size_t size);
 
+/**
+ * Reads once from the pipe, appending the data to target in place, without
+ * an intermediate buffer. The read size adapts to the data: it starts at
+ * 16 KiB and doubles up to 1 MiB while reads fill it completely.
+ *
+ * @param handle The pipe handle.
+ * @param target The string to append to.
+ * @param chunk The read size, updated for the next call. Start with 0.
+ * @return As pipe_read.
+ */
+ssize_t pipe_read_append(PipeHandle handle, std::string& target, size_t& chunk);
+
 /**
  * Writes to the pipe.
  *
  * @param handle The pipe handle.
  * @param buffer The buffer containing data to write.
  * @param size The size of the buffer.
- * @return -1 on error. If 0, it could be full or perhaps wait for more data.
+ * @return -1 on error, e.g. when the reader is gone. 0 if a non-blocking
+ *         pipe is full or a signal interrupted the call.
  */
 ssize_t pipe_write(PipeHandle handle, const void* buffer, size_t size);
 
 /**
- * Spawns a thread to read from the pipe. When no more data is available,
- * the pipe will be closed.
+ * Writes several buffers to the pipe in one call, in order, with writev on
+ * POSIX. WriteFileGather only takes page-sized buffers of unbuffered files,
+ * so on Windows buffers of up to 64 KiB in total are joined into one
+ * WriteFile, and larger ones are written one buffer per call.
+ *
+ * Like pipe_write, this may write less than all of the buffers.
+ *
+ * @param handle The pipe handle.
+ * @param buffers The buffers to write.
+ * @param count The number of buffers.
+ * @return As pipe_write, the number of bytes written over all buffers.
+ */
+ssize_t pipe_write_gather(PipeHandle handle, const std::string_view* buffers, size_t count);
+
+/**
+ * Sets the pipe to blocking or non-blocking mode. In non-blocking mode
+ * pipe_read and pipe_write return immediately, transferring what is possible.
+ *
+ * On Windows this uses PIPE_NOWAIT, which works on anonymous pipes too.
+ *
+ * @param handle The pipe handle.
+ * @param blocking If false, the pipe will be non-blocking.
+ * @throw OSError if the system call fails.
+ */
+void pipe_set_blocking(PipeHandle handle, bool blocking);
+
+/**
+ * @param handle The pipe handle.
+ * @return false if the pipe is in non-blocking mode, see pipe_set_blocking.
+ * @throw OSError if the system call fails.
+ */
+bool pipe_is_blocking(PipeHandle handle);
+
+/**
+ * Checks whether the last pipe_read on this thread that returned -1 failed
+ * only because a non-blocking pipe had no data, or because a signal
+ * interrupted it. Any other failure means the pipe is done.
+ */
+bool pipe_would_block();
+
+/** A pipe to be watched by pipe_poll. */
+struct PipePollItem
+{
+    PipeHandle handle{kBadPipeValue}; ///< The pipe to watch, kBadPipeValue entries are skipped.
+    bool write{false};                ///< If true, watch for writability instead of readability.
+    bool ready{false};                ///< Set by pipe_poll when the pipe is ready or the other end is closed.
+};
+
+/**
+ * Waits until at least one of the pipes is ready, or the timeout expires.
+ * A pipe whose other end was closed is reported ready, so the next read
+ * returns 0 or -1.
+ *
+ * On Windows anonymous pipes have no readiness notification. Readability is
+ * checked with PeekNamedPipe and the wait backs off up to a few milliseconds
+ * between checks. Pipes watched for writing are always reported ready, so
+ * they should be non-blocking, see pipe_set_blocking. The IoReactor waits on
+ * pipe_create_overlapped() pipes with a completion port instead.
+ *
+ * @param items The pipes to watch.
+ * @param count The number of items.
+ * @param timeout Timeout in seconds, negative to wait forever.
+ * @throw OSError if the system call fails.
+ * @return The number of ready pipes, 0 on timeout or interruption.
+ */
+int pipe_poll(PipePollItem* items, size_t count, double timeout);
+
+#ifndef _WIN32
+namespace details
+{
+/**
+ * Blocks SIGPIPE for the calling thread while the guard lives, so writing
+ * to a pipe whose reader is gone fails with EPIPE instead of killing the
+ * process. A SIGPIPE raised meanwhile is consumed on destruction.
+ */
+class SigPipeGuard
+{
+public:
+    SigPipeGuard();
+    ~SigPipeGuard();
+
+    SigPipeGuard(const SigPipeGuard&) = delete;
+    SigPipeGuard& operator=(const SigPipeGuard&) = delete;
+
+private:
+    sigset_t m_old_mask{};
+    bool m_was_pending{false};
+};
+} // namespace details
+#endif
+
+/**
+ * Hands the pipe to the IoReactor, which reads and discards everything.
+ * When no more data is available, the pipe will be closed.
  *
  * @param handle The pipe handle.
  */
 void pipe_ignore_and_close(PipeHandle handle);
 
+/**
+ * Creates an anonymous file, e.g. for a child to write its output into.
+ *
+ * On Linux it is a memfd, elsewhere a file in the temporary directory that is
+ * removed right away, or on Windows once the last handle is closed. Either
+ * way nothing is left behind. The handle is not inheritable.
+ *
+ * @throw OSError if the system call fails.
+ * @return The handle, to be closed with pipe_close().
+ */
+PipeHandle temp_file_create();
+
+/**
+ * Maps the whole contents of a file read-only into memory.
+ *
+ * The mapping stays valid after the handle is closed. Data appended to the
+ * file afterwards is not part of it.
+ *
+ * @param handle A handle to a regular file, e.g. from temp_file_create().
+ * @throw OSError if the system call fails.
+ * @return The mapping, empty if the file is.
+ */
+MappedFile file_map(PipeHandle handle);
+
 /**
  * Reads contents of handle until no more data is available.
  * If the pipe is non-blocking, this will end prematurely.
  *
  * @param handle The pipe handle.
+ * @param size_hint Expected size of the data, reserved upfront.
  * @return All data read from the pipe as a string object.
  *         This works fine with binary data.
  */
-std::string pipe_read_all(PipeHandle handle);
+std::string pipe_read_all(PipeHandle handle, size_t size_hint = 0U);
 
 } // namespace subprocess
 
@@ -0,0 +1,120 @@
+#include "pipeline.h"
+
+#include <sstream>
+#include <stdexcept>
+
+namespace subprocess
+{
+
+namespace
+{
+/**
+ * @brief Starts all stages of the pipeline.
+ * @param errors If not null, receives the cerr of the stages before the
+ * last one that have it set to PipeOption::pipe.
+ */
+std::vector<Popen> spawn(const Pipeline& pipeline, std::vector<std::ostringstream>* errors)
+{
+    const std::vector<RunBuilder>& stages = pipeline.stages;
+    if (stages.empty())
+    {
+        throw std::invalid_argument("Pipeline: no stages to run");
+    }
+
+    // Declared first so the pipes go first if a stage fails to start: a stage writing to a pipe nobody reads from
+    // would block, and waiting for it in ~Popen would never return.
+    std::vector<Popen> result;
+    std::vector<PipePair> pipes;
+    result.reserve(stages.size());
+    pipes.reserve(stages.size() - 1U);
+
+    for (std::size_t i = 1U; i < stages.size(); ++i)
+    {
+        pipes.push_back(pipe_create(false));
+    }
+
+    for (std::size_t i = 0U; i < stages.size(); ++i)
+    {
+        RunOptions options = stages[i].options;
+        bool last = i + 1U == stages.size();
+
+        if (i > 0U)
+        {
+            options.cin = pipes[i - 1U].input;
+        }
+
+        if (!last)
+        {
+            options.cout = pipes[i].output;
+            const auto* cerr = std::get_if<PipeOption>(&options.cerr);
+            if (errors != nullptr && cerr != nullptr && *cerr == PipeOption::pipe)
+            {
+                options.cerr = &(*errors)[i];
+            }
+        }
+
+        result.emplace_back(stages[i].command, std::move(options));
+
+        // The child has its own copies now. Ours must go, or readers never see the end of their input.
+        if (i > 0U)
+        {
+            pipes[i - 1U].close_input();
+        }
+
+        if (!last)
+        {
+            pipes[i].close_output();
+        }
+    }
+
+    return result;
+}
+} // namespace
+
+std::vector<Popen> Pipeline::popen() const
+{
+    return spawn(*this, nullptr);
+}
+
+std::vector<CompletedProcess> Pipeline::run() const
+{
+    // Only the last stage is drained on this thread. The cerr of the others goes through the reactor, so a stage
+    // filling its cerr pipe cannot stall the chain.
+    std::vector<std::ostringstream> errors(stages.size());
+    std::vector<Popen> popens = spawn(*this, &errors);
+    std::vector<CompletedProcess> result(stages.size());
+
+    // There is no input for a piped cin of the first stage, like in run(). Left open, the chain never ends.
+    if (stages.size() > 1U && popens.front().cin != kBadPipeValue)
+    {
+        popens.front().close_cin();
+    }
+
+    result.back() = subprocess::run(popens.back());
+
+    for (std::size_t i = 0U; i + 1U < stages.size(); ++i)
+    {
+        (void)popens[i].wait();
+        result[i].returncode = popens[i].returncode;
+        popens[i].close(); // waits for the cerr redirection
+        result[i].cerr = errors[i].str();
+    }
+
+    for (std::size_t i = 0U; i < stages.size(); ++i)
+    {
+        result[i].args = stages[i].command;
+    }
+
+    for (std::size_t i = 0U; i < stages.size(); ++i)
+    {
+        if (stages[i].options.raise_on_nonzero && result[i].returncode != 0)
+        {
+            throw CalledProcessError{"failed to execute " + stages[i].command[0U], stages[i].command,
+                                     result[i].returncode, result[i].cout, result[i].cerr};
+        }
+    }
+
+    return result;
+}
+
+} // namespace subprocess
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <vector>
+
+#include "builder.h"
+
+namespace subprocess
+{
+
+/**
+ * @brief A chain of processes, each stage's cout connected to the next
+ * stage's cin, like `zcat log.gz | grep error | sort` in a shell.
+ *
+ * All pipes between stages are created upfront and passed to the children
+ * as handles, so the data flows from process to process without being
+ * copied through the parent. The parent only feeds the first stage's cin
+ * and reads the last stage's cout, as configured in their RunOptions.
+ *
+ * The cin of every stage but the first and the cout of every stage but the
+ * last are replaced by the connecting pipes. Every other option, including
+ * cerr, applies per stage. PipeOption::cout as cerr of a middle stage sends
+ * its errors down the pipe as well.
+ *
+ * Built with operator|, e.g.
+ * `(RunBuilder({"zcat", "log.gz"}) | RunBuilder({"grep", "error"})).run()`.
+ */
+struct Pipeline
+{
+    std::vector<RunBuilder> stages{}; // NOLINT
+
+    /**
+     * @brief Default constructor.
+     */
+    Pipeline() = default;
+
+    /**
+     * @brief Constructs a pipeline from its stages.
+     * @param stages The stages, in order from first to last.
+     */
+    explicit Pipeline(std::vector<RunBuilder> stages) : stages(std::move(stages))
+    {
+    }
+
+    /**
+     * @brief Appends a stage.
+     * @param stage The stage to append.
+     * @return A reference to the Pipeline.
+     */
+    Pipeline& operator|=(RunBuilder stage)
+    {
+        stages.push_back(std::move(stage));
+        return *this;
+    }
+
+    /**
+     * @brief Starts all stages.
+     * @return The running stages, in order.
+     * @throws std::invalid_argument If the pipeline has no stages.
+     * @throws OSError If a pipe could not be created.
+     * @throws SpawnError If a stage could not be started. Stages already
+     * started see their input or output closed and are waited for.
+     */
+    [[nodiscard]] std::vector<Popen> popen() const;
+
+    /**
+     * @brief Runs all stages to completion.
+     *
+     * Captures the cout of the last stage and the cerr of every stage whose
+     * cerr is PipeOption::pipe. RunOptions::timeout is not applied.
+     *
+     * @return One CompletedProcess per stage, in order.
+     * @throws CalledProcessError If a stage with raise_on_nonzero returned a
+     * non-zero code, once all stages are done. The first such stage is
+     * reported.
+     * @see popen() for the other exceptions.
+     */
+    [[nodiscard]] std::vector<CompletedProcess> run() const;
+};
+
+/**
+ * @brief Connects the cout of a to the cin of b.
+ */
+inline Pipeline operator|(RunBuilder a, RunBuilder b)
+{
+    std::vector<RunBuilder> stages;
+    stages.push_back(std::move(a));
+    stages.push_back(std::move(b));
+    return Pipeline(std::move(stages));
+}
+
+/**
+ * @brief Appends b to the pipeline.
+ */
+inline Pipeline operator|(Pipeline pipeline, RunBuilder b)
+{
+    pipeline |= std::move(b);
+    return pipeline;
+}
+
+} // namespace subprocess
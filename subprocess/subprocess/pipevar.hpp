@@ -1,15 +1,281 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
 #include <cstdio>
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <variant>
+#include <vector>
 
 #include "basic_types.hpp"
 
 namespace subprocess
 {
 
+/**
+ * @brief Receives the output of a child while it runs, instead of it being
+ * collected in memory.
+ *
+ * Either every chunk is passed on as read, or the output is split into
+ * lines. Lines are passed without their "\n" or "\r\n", and straight out of
+ * the read buffer unless they span two reads, so memory use is bounded by
+ * the longest line rather than by the output.
+ *
+ * The string_view is only valid during the call.
+ *
+ * @code
+ * subprocess::run({"make"}, {.cout = subprocess::OutputCallback::lines(
+ *                                [](std::string_view line) { std::cout << line << '\n'; })});
+ * @endcode
+ */
+class OutputCallback
+{
+public:
+    using Function = std::function<void(std::string_view)>;
+
+    /** @brief Calls function with each chunk as it is read. */
+    static OutputCallback chunks(Function function)
+    {
+        return OutputCallback(std::move(function), false);
+    }
+
+    /**
+     * @brief Calls function once per line. A last line without a line
+     * terminator is passed at end-of-file.
+     */
+    static OutputCallback lines(Function function)
+    {
+        return OutputCallback(std::move(function), true);
+    }
+
+    /** @brief Passes on data just read. */
+    void operator()(std::string_view data)
+    {
+        if (!m_lines)
+        {
+            m_function(data);
+            return;
+        }
+
+        std::size_t end;
+        while ((end = data.find('\n')) != std::string_view::npos)
+        {
+            if (m_partial.empty())
+            {
+                emit_line(data.substr(0U, end));
+            }
+            else
+            {
+                (void)m_partial.append(data.substr(0U, end));
+                emit_line(m_partial);
+                m_partial.clear();
+            }
+            data.remove_prefix(end + 1U);
+        }
+        (void)m_partial.append(data);
+    }
+
+    /** @brief Passes on what is left at end-of-file. */
+    void finish()
+    {
+        if (!m_partial.empty())
+        {
+            emit_line(m_partial);
+            m_partial.clear();
+        }
+    }
+
+private:
+    OutputCallback(Function function, bool lines) : m_function(std::move(function)), m_lines(lines)
+    {
+    }
+
+    void emit_line(std::string_view line)
+    {
+        if (!line.empty() && line.back() == '\r')
+        {
+            line.remove_suffix(1U);
+        }
+        m_function(line);
+    }
+
+    Function m_function;
+    bool m_lines;
+    std::string m_partial; ///< Start of a line spanning reads, keeps its capacity
+};
+
+/**
+ * @brief Generates the input of a child while it runs, e.g. serialized
+ * records, instead of it being prepared in memory up front.
+ *
+ * The function is called from the IoReactor each time the child can take
+ * more input. Each call gives the next piece of input, which only has to
+ * stay valid until the next call. An empty span ends the input, and the
+ * function is not called again.
+ *
+ * Small pieces are gathered into batches of up to 64 KiB and written with a
+ * single writev, larger ones are written from where they are. Partial writes
+ * are resumed, and the function is only called again once the child took
+ * most of what it gave before, so a slow child slows the producer down
+ * instead of input piling up in memory. A generator coroutine fits in by
+ * returning its next value from the function.
+ *
+ * @code
+ * std::size_t i = 0U;
+ * subprocess::run({"sort"}, {.cin = subprocess::InputProducer([&]() {
+ *                                return i < records.size() ? std::as_bytes(std::span{records[i++]})
+ *                                                          : std::span<const std::byte>{};
+ *                            })});
+ * @endcode
+ */
+class InputProducer
+{
+public:
+    using Function = std::function<std::span<const std::byte>()>;
+
+    explicit InputProducer(Function function) : m_function(std::move(function))
+    {
+    }
+
+    /** @brief The next piece of input, empty at the end. */
+    std::span<const std::byte> operator()()
+    {
+        return m_function();
+    }
+
+private:
+    Function m_function;
+};
+
+/** @brief What a Tee does once a handle sink is a whole buffer behind. */
+enum class Backpressure
+{
+    block, ///< Stop reading the child, which blocks once its pipe is full too
+    drop,  ///< Drop what the sink has not taken yet, counted in Tee::dropped()
+    spill, ///< Move what the sink has not taken yet to a temporary file, and write it from there
+};
+
+/**
+ * @brief Sends the output of a child to several sinks at once, e.g. to
+ * capture it and log it, without a cat in between.
+ *
+ * The output is read once into a ring buffer of buffer_size bytes, and each
+ * sink is given views of it, so it is never copied per sink. A Tee is always
+ * serviced by an IoReactor worker, also in run(), which leaves
+ * CompletedProcess::cout or cerr empty.
+ *
+ * - std::string*, std::ostream*, FILE* and OutputCallback sinks are written
+ *   as the output arrives, on the worker.
+ * - PipeHandle sinks, e.g. the cin of another process, are non-blocking
+ *   while the Tee runs, and set back to blocking once it is done if they
+ *   were. They are written as fast as they accept data. The ring only holds
+ *   what the slowest of them has not taken yet; once that is all of it, the
+ *   policy decides, so a slow sink costs at most buffer_size bytes of
+ *   memory. A sink whose reader is gone is dropped. A sink that was full
+ *   when output last arrived gets the rest with the next output, or at the
+ *   end. The Tee is complete once every handle sink has all of the output,
+ *   or is gone.
+ *
+ * @code
+ * std::string captured;
+ * subprocess::run({"make"}, {.cout = subprocess::Tee{{&captured, &std::cout}}});
+ * @endcode
+ */
+class Tee
+{
+public:
+    using Sink = std::variant<std::string*, std::ostream*, FILE*, PipeHandle, OutputCallback>;
+
+    static constexpr std::size_t kDefaultBufferSize = 1024U * 1024U;
+
+    /**
+     * @param sinks Where the output goes, in this order.
+     * @param policy What to do about a handle sink that falls behind.
+     * @param buffer_size The size of the ring buffer, at least 4 KiB.
+     * @throw std::invalid_argument if a sink is null or kBadPipeValue.
+     */
+    explicit Tee(std::vector<Sink> sinks, Backpressure policy = Backpressure::block,
+                 std::size_t buffer_size = kDefaultBufferSize)
+        : m_sinks(std::move(sinks)), m_policy(policy), m_buffer_size(std::max<std::size_t>(buffer_size, 4096U))
+    {
+        for (const Sink& sink : m_sinks)
+        {
+            if (is_bad(sink))
+            {
+                throw std::invalid_argument("Tee: a sink is null or kBadPipeValue");
+            }
+        }
+    }
+
+    [[nodiscard]] const std::vector<Sink>& sinks() const
+    {
+        return m_sinks;
+    }
+
+    [[nodiscard]] Backpressure policy() const
+    {
+        return m_policy;
+    }
+
+    [[nodiscard]] std::size_t buffer_size() const
+    {
+        return m_buffer_size;
+    }
+
+    /** @brief Bytes dropped with Backpressure::drop, over all copies of this Tee. */
+    [[nodiscard]] uint64_t dropped() const
+    {
+        return m_dropped->load(std::memory_order_relaxed);
+    }
+
+    /** @brief Adds to dropped(), for the IoReactor worker servicing the Tee. */
+    void count_dropped(uint64_t bytes) const
+    {
+        (void)m_dropped->fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+private:
+    static bool is_bad(const Sink& sink)
+    {
+        bool result = false;
+        if (const auto* handle = std::get_if<PipeHandle>(&sink); handle != nullptr)
+        {
+            result = *handle == kBadPipeValue;
+        }
+        else if (const auto* string = std::get_if<std::string*>(&sink); string != nullptr)
+        {
+            result = *string == nullptr;
+        }
+        else if (const auto* stream = std::get_if<std::ostream*>(&sink); stream != nullptr)
+        {
+            result = *stream == nullptr;
+        }
+        else if (const auto* file = std::get_if<FILE*>(&sink); file != nullptr)
+        {
+            result = *file == nullptr;
+        }
+        else
+        {
+        }
+        return result;
+    }
+
+    std::vector<Sink> m_sinks;
+    Backpressure m_policy;
+    std::size_t m_buffer_size;
+    std::shared_ptr<std::atomic<uint64_t>> m_dropped = std::make_shared<std::atomic<uint64_t>>(0U);
+};
+
 // Enum class to represent different types in the PipeVar variant
 enum class PipeVarIndex
 {
@@ -18,11 +284,46 @@ enum class PipeVarIndex
     handle,
     istream,
     ostream,
-    file
+    file,
+    callback,
+    view,
+    shared,
+    tee,
+    producer
 };
 
 // Type alias for the PipeVar variant
-typedef std::variant<PipeOption, std::string, PipeHandle, std::istream*, std::ostream*, FILE*> PipeVar;
+typedef std::variant<PipeOption, std::string, PipeHandle, std::istream*, std::ostream*, FILE*, OutputCallback,
+                     std::span<const std::byte>, std::shared_ptr<const std::string>, Tee, InputProducer>
+    PipeVar;
+
+/**
+ * @brief Gives the in-memory input held by a PipeVar, i.e. a std::string,
+ * a span of bytes or a shared string.
+ * @return The data, std::nullopt if var holds something else.
+ */
+inline std::optional<std::string_view> get_pipe_input(const PipeVar& var)
+{
+    std::optional<std::string_view> result;
+
+    if (const auto* data = std::get_if<std::string>(&var); data != nullptr)
+    {
+        result = *data;
+    }
+    else if (const auto* bytes = std::get_if<std::span<const std::byte>>(&var); bytes != nullptr)
+    {
+        result = std::string_view{reinterpret_cast<const char*>(bytes->data()), bytes->size()}; // NOLINT
+    }
+    else if (const auto* shared = std::get_if<std::shared_ptr<const std::string>>(&var); shared != nullptr)
+    {
+        result = *shared != nullptr ? std::string_view{**shared} : std::string_view{};
+    }
+    else
+    {
+    }
+
+    return result;
+}
 
 /**
  * @brief Gets the PipeOption from the PipeVar variant.
@@ -0,0 +1,283 @@
+#include "process_pool.h"
+
+#include <algorithm>
+#include <format>
+#include <stdexcept>
+
+#include "shellutils.h"
+
+#ifndef _WIN32
+#include <csignal>
+#include <pthread.h>
+#endif
+
+namespace subprocess
+{
+
+ProcessPool::ProcessPool(CommandLine command, ProcessPoolOptions options)
+    : m_command(std::move(command)), m_options(std::move(options))
+{
+    if (m_command.empty())
+    {
+        throw std::invalid_argument("ProcessPool: command is empty");
+    }
+
+    if (m_options.workers == 0U)
+    {
+        throw std::invalid_argument("ProcessPool: at least one worker is required");
+    }
+
+    // Looked up once, so replacing a child does not search PATH again.
+    std::string program = find_program(m_command[0U]);
+    if (program.empty())
+    {
+        throw CommandNotFoundError(std::format("Command \"{}\" not found.", m_command[0U]));
+    }
+    m_command[0U] = program;
+
+    m_options.options.cin = PipeOption::pipe;
+    m_options.options.cout = PipeOption::pipe;
+    m_options.queue_capacity = std::max<std::size_t>(m_options.queue_capacity, 1U);
+
+    for (std::size_t i = 0U; i < m_options.workers; ++i)
+    {
+        auto slot = std::make_unique<Slot>();
+        spawn(*slot);
+        m_slots.push_back(std::move(slot));
+    }
+
+    for (auto& slot : m_slots)
+    {
+        slot->thread = std::thread(&ProcessPool::run_slot, this, std::ref(*slot));
+    }
+}
+
+ProcessPool::~ProcessPool()
+{
+    {
+        std::lock_guard lock(m_mutex);
+        m_stopping = true;
+    }
+    m_jobs_cv.notify_all();
+    m_space_cv.notify_all();
+
+    for (auto& slot : m_slots)
+    {
+        if (slot->thread.joinable())
+        {
+            slot->thread.join();
+        }
+        // Popen::close closes cin first, which is the children's cue to exit.
+        slot->popen.close();
+    }
+}
+
+std::future<std::string> ProcessPool::submit(std::string request)
+{
+    std::unique_lock lock(m_mutex);
+    m_space_cv.wait(lock, [this] { return m_stopping || m_jobs.size() < m_options.queue_capacity; });
+    if (m_stopping)
+    {
+        throw std::logic_error("ProcessPool::submit: the pool is shutting down");
+    }
+
+    m_jobs.push_back({std::move(request), {}});
+    std::future<std::string> result = m_jobs.back().promise.get_future();
+    lock.unlock();
+    m_jobs_cv.notify_one();
+    return result;
+}
+
+void ProcessPool::spawn(Slot& slot)
+{
+    if (slot.popen.pid != 0U)
+    {
+        // Give the child a chance to exit on its own before it is killed.
+        slot.popen.close_cin();
+        try
+        {
+            (void)slot.popen.wait(1.0);
+        }
+        catch (TimeoutExpired&)
+        {
+            (void)slot.popen.kill();
+        }
+        slot.popen.close();
+    }
+
+    slot.uses = 0U;
+    slot.buffer.clear();
+    slot.popen = Popen(m_command, m_options.options);
+
+    if (slot.popen.cerr != kBadPipeValue)
+    {
+        slot.popen.ignore_cerr();
+    }
+
+    if (!m_options.one_shot)
+    {
+        pipe_set_blocking(slot.popen.cin, false);
+        pipe_set_blocking(slot.popen.cout, false);
+    }
+}
+
+void ProcessPool::run_slot(Slot& slot)
+{
+#ifndef _WIN32
+    // A child exiting while being written to must fail the request with EPIPE rather than kill the process.
+    sigset_t block;
+    (void)sigemptyset(&block);
+    (void)sigaddset(&block, SIGPIPE);
+    (void)pthread_sigmask(SIG_BLOCK, &block, nullptr);
+#endif
+
+    while (true)
+    {
+        Job job;
+        {
+            std::unique_lock lock(m_mutex);
+            m_jobs_cv.wait(lock, [this] { return m_stopping || !m_jobs.empty(); });
+            if (m_jobs.empty())
+            {
+                break;
+            }
+            job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+        }
+        m_space_cv.notify_one();
+
+        try
+        {
+            job.promise.set_value(serve(slot, job.request));
+        }
+        catch (...)
+        {
+            job.promise.set_exception(std::current_exception());
+        }
+
+        // Replace a used up child now rather than when the next request is waiting for it.
+        bool worn = m_options.one_shot || slot.popen.pid == 0U ||
+                    (m_options.max_uses > 0U && slot.uses >= m_options.max_uses);
+        if (worn)
+        {
+            try
+            {
+                spawn(slot);
+            }
+            catch (...)
+            {
+                // serve() tries again and reports the error to the next request.
+            }
+        }
+    }
+}
+
+std::string ProcessPool::serve(Slot& slot, const std::string& request)
+{
+    if (slot.popen.pid == 0U || slot.popen.poll())
+    {
+        spawn(slot);
+    }
+
+    ++slot.uses;
+    try
+    {
+        return exchange(slot, request);
+    }
+    catch (...)
+    {
+        (void)slot.popen.kill();
+        slot.popen.close();
+        throw;
+    }
+}
+
+std::string ProcessPool::exchange(Slot& slot, const std::string& request)
+{
+    Popen& popen = slot.popen;
+
+    if (m_options.one_shot)
+    {
+        std::string response = popen.communicate(request, m_options.timeout).first;
+        (void)popen.wait();
+        if (m_options.options.raise_on_nonzero && popen.returncode != 0)
+        {
+            throw CalledProcessError{"failed to execute " + m_command[0U], m_command, popen.returncode, response, {}};
+        }
+        return response;
+    }
+
+    std::string input = request;
+    if (input.empty() || input.back() != m_options.delimiter)
+    {
+        input.push_back(m_options.delimiter);
+    }
+
+    StopWatch watch;
+    std::size_t pos = 0U;
+    std::size_t scanned = 0U;
+    std::size_t chunk = 0U;
+    bool cin_stalled = false;
+
+    while (true)
+    {
+        if (pos >= input.size())
+        {
+            std::size_t end = slot.buffer.find(m_options.delimiter, scanned);
+            if (end != std::string::npos)
+            {
+                std::string response = slot.buffer.substr(0U, end);
+                (void)slot.buffer.erase(0U, end + 1U);
+                return response;
+            }
+            scanned = slot.buffer.size();
+        }
+
+        double remaining = -1.0;
+        if (m_options.timeout >= 0.0)
+        {
+            remaining = watch.remaining(m_options.timeout);
+            if (remaining <= 0.0)
+            {
+                throw TimeoutExpired("ProcessPool: timeout of " + std::to_string(m_options.timeout) + " expired",
+                                     m_command, m_options.timeout, slot.buffer, {});
+            }
+        }
+
+        // As in Popen::communicate, a cin that accepted nothing is left out for a millisecond.
+        bool writing = pos < input.size();
+        PipePollItem items[2] = {{writing && !cin_stalled ? popen.cin : kBadPipeValue, true}, {popen.cout}};
+        double wait = cin_stalled ? (remaining < 0.0 ? 0.001 : std::min(remaining, 0.001)) : remaining;
+        cin_stalled = false;
+
+        (void)pipe_poll(&items[0], 2U, wait);
+
+        if (items[0].ready || (writing && items[0].handle == kBadPipeValue))
+        {
+            ssize_t transfered = pipe_write(popen.cin, input.data() + pos, input.size() - pos);
+            if (transfered > 0)
+            {
+                pos += static_cast<std::size_t>(transfered);
+            }
+            else if (transfered == 0)
+            {
+                cin_stalled = true;
+            }
+            else
+            {
+                throw OSError("ProcessPool: the child closed its input");
+            }
+        }
+
+        if (items[1].ready)
+        {
+            ssize_t transfered = pipe_read_append(popen.cout, slot.buffer, chunk);
+            if (transfered == 0 || (transfered < 0 && !pipe_would_block()))
+            {
+                throw OSError("ProcessPool: the child closed its output");
+            }
+        }
+    }
+}
+
+} // namespace subprocess
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "builder.h"
+
+namespace subprocess
+{
+
+/**
+ * @brief Options for a ProcessPool.
+ */
+struct ProcessPoolOptions
+{
+    /**
+     * @brief Number of children kept running, each served by its own thread.
+     */
+    std::size_t workers{2U}; // NOLINT
+
+    /**
+     * @brief Number of requests that may wait for a child. submit() blocks
+     * while the queue is full.
+     */
+    std::size_t queue_capacity{64U}; // NOLINT
+
+    /**
+     * @brief Requests a child serves before it is replaced, 0 for no limit.
+     * Ignored in one_shot mode.
+     */
+    std::size_t max_uses{0U}; // NOLINT
+
+    /**
+     * @brief If true, each child serves a single request: the request is
+     * written to cin, cin is closed and the response is cout up to its end.
+     * A replacement is started right away, so the next request finds a
+     * child that is already running.
+     *
+     * If false, a child serves many requests. Each request is written with
+     * the delimiter appended if missing, and the response is cout up to the
+     * next delimiter, which is not included.
+     */
+    bool one_shot{false}; // NOLINT
+
+    /**
+     * @brief Ends requests and responses, unless one_shot is set.
+     */
+    char delimiter{'\n'}; // NOLINT
+
+    /**
+     * @brief Timeout in seconds per request, negative to wait forever. A
+     * child that does not answer in time is killed and replaced.
+     */
+    double timeout{-1.0}; // NOLINT
+
+    /**
+     * @brief Options for starting the children. cin and cout are always
+     * pipes. A cerr of PipeOption::pipe is discarded, as nothing reads it.
+     */
+    RunOptions options{}; // NOLINT
+};
+
+/**
+ * @brief Keeps children of one command running, so frequent calls skip the
+ * cost of starting a process.
+ *
+ * The program is looked up once. Children are started upfront and replaced
+ * when they exit, time out or reach max_uses, always off the caller's path
+ * where possible. Requests are queued and served by the first free child.
+ *
+ * The pool is thread-safe. Destroying it serves the queued requests, then
+ * closes the children's cin and waits for them to exit.
+ */
+class ProcessPool
+{
+public:
+    /**
+     * @brief Starts the children.
+     * @param command The command to run, the first element is the program.
+     * @param options The pool options.
+     * @throws std::invalid_argument If command is empty or workers is 0.
+     * @throws CommandNotFoundError If the program cannot be found.
+     * @throws SpawnError If a child could not be started.
+     */
+    explicit ProcessPool(CommandLine command, ProcessPoolOptions options = {});
+
+    ~ProcessPool();
+
+    ProcessPool(const ProcessPool&) = delete;
+    ProcessPool& operator=(const ProcessPool&) = delete;
+
+    /**
+     * @brief Queues a request, blocking while the queue is full.
+     *
+     * The future throws TimeoutExpired if the child did not answer in time,
+     * OSError if it exited or closed its pipes while serving the request,
+     * and SpawnError if no child could be started for it.
+     *
+     * @param request The data to write to the child.
+     * @return The response.
+     * @throws std::logic_error If the pool is shutting down.
+     */
+    std::future<std::string> submit(std::string request);
+
+    /**
+     * @brief Sends a request and waits for the response.
+     * @see submit()
+     */
+    std::string call(std::string request)
+    {
+        return submit(std::move(request)).get();
+    }
+
+    /**
+     * @brief The command the children run, with the program resolved.
+     */
+    [[nodiscard]] const CommandLine& command() const
+    {
+        return m_command;
+    }
+
+    /**
+     * @brief The number of children.
+     */
+    [[nodiscard]] std::size_t size() const
+    {
+        return m_slots.size();
+    }
+
+private:
+    struct Job
+    {
+        std::string request;
+        std::promise<std::string> promise;
+    };
+
+    struct Slot
+    {
+        Popen popen;
+        std::size_t uses{0U};
+        std::string buffer; ///< cout read past the last response
+        std::thread thread;
+    };
+
+    void spawn(Slot& slot);
+    void run_slot(Slot& slot);
+    std::string serve(Slot& slot, const std::string& request);
+    std::string exchange(Slot& slot, const std::string& request);
+
+    CommandLine m_command;
+    ProcessPoolOptions m_options;
+    std::vector<std::unique_ptr<Slot>> m_slots;
+
+    std::mutex m_mutex;
+    std::condition_variable m_jobs_cv;
+    std::condition_variable m_space_cv;
+    std::deque<Job> m_jobs;
+    bool m_stopping{false};
+};
+
+} // namespace subprocess
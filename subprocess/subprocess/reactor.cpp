@@ -0,0 +1,439 @@
+#include "reactor.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <csignal>
+#include <pthread.h>
+#endif
+
+namespace subprocess
+{
+
+namespace
+{
+std::mutex g_reactor_config_mutex;
+std::size_t g_reactor_worker_count = 2U;
+bool g_reactor_started = false;
+} // namespace
+
+void IoCompletion::add()
+{
+    std::lock_guard lock(m_mutex);
+    ++m_pending;
+}
+
+void IoCompletion::done()
+{
+    std::vector<std::function<void()>> callbacks;
+    {
+        std::lock_guard lock(m_mutex);
+        if (m_pending > 0U && --m_pending == 0U)
+        {
+            m_cv.notify_all();
+            callbacks.swap(m_callbacks);
+        }
+    }
+
+    for (auto& callback : callbacks)
+    {
+        callback();
+    }
+}
+
+bool IoCompletion::notify(std::function<void()> callback)
+{
+    std::lock_guard lock(m_mutex);
+    bool result = m_pending > 0U;
+    if (result)
+    {
+        m_callbacks.push_back(std::move(callback));
+    }
+    return result;
+}
+
+bool IoCompletion::wait(double timeout)
+{
+    std::unique_lock lock(m_mutex);
+    bool result = true;
+
+    if (timeout < 0.0)
+    {
+        m_cv.wait(lock, [this] { return m_pending == 0U; });
+    }
+    else
+    {
+        result = m_cv.wait_for(lock, std::chrono::duration<double>(timeout), [this] { return m_pending == 0U; });
+    }
+
+    return result;
+}
+
+bool IoCompletion::is_done()
+{
+    std::lock_guard lock(m_mutex);
+    return m_pending == 0U;
+}
+
+PipeToString::~PipeToString()
+{
+    (void)pipe_close(m_handle);
+}
+
+IoStatus PipeToString::on_ready()
+{
+    ssize_t transfered = pipe_read_append(m_handle, m_output, m_chunk);
+    IoStatus result;
+
+    if (transfered > 0)
+    {
+        result = IoStatus::pending;
+    }
+    else if (transfered < 0 && pipe_would_block())
+    {
+        result = IoStatus::blocked;
+    }
+    else
+    {
+        result = IoStatus::done;
+    }
+
+    return result;
+}
+
+IoReactor& IoReactor::instance()
+{
+    static IoReactor reactor(
+        []
+        {
+            std::lock_guard lock(g_reactor_config_mutex);
+            g_reactor_started = true;
+            return g_reactor_worker_count;
+        }());
+    return reactor;
+}
+
+void IoReactor::set_worker_count(std::size_t count)
+{
+    std::lock_guard lock(g_reactor_config_mutex);
+    if (g_reactor_started)
+    {
+        throw std::logic_error("IoReactor::set_worker_count: the reactor is already running");
+    }
+    g_reactor_worker_count = std::max<std::size_t>(count, 1U);
+}
+
+IoReactor::IoReactor(std::size_t worker_count)
+{
+    m_workers.reserve(worker_count);
+    for (std::size_t i = 0U; i < worker_count; ++i)
+    {
+        auto worker = std::make_unique<Worker>();
+#ifdef _WIN32
+        worker->port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0U, 1U);
+        if (worker->port == nullptr)
+        {
+            throw OSError("CreateIoCompletionPort failed: " + LastErrorString());
+        }
+#else
+        worker->wake = pipe_create(false);
+        pipe_set_blocking(worker->wake.input, false);
+        pipe_set_blocking(worker->wake.output, false);
+#endif
+        worker->thread = std::thread(&IoReactor::run_worker, std::ref(*worker));
+        m_workers.push_back(std::move(worker));
+    }
+}
+
+IoReactor::~IoReactor()
+{
+    for (auto& worker : m_workers)
+    {
+        {
+            std::lock_guard lock(worker->mutex);
+            worker->stopping = true;
+        }
+        wake(*worker);
+    }
+
+    for (auto& worker : m_workers)
+    {
+        if (worker->thread.joinable())
+        {
+            worker->thread.join();
+        }
+#ifdef _WIN32
+        (void)CloseHandle(worker->port);
+#endif
+    }
+}
+
+void IoReactor::wake(Worker& worker)
+{
+#ifdef _WIN32
+    (void)PostQueuedCompletionStatus(worker.port, 0U, 0U, nullptr);
+#else
+    // A full wake pipe already has a wake-up pending, so a failed write is fine.
+    char byte = 0;
+    (void)pipe_write(worker.wake.output, &byte, 1U);
+#endif
+}
+
+void IoReactor::add(std::unique_ptr<IoTransfer> transfer, std::shared_ptr<IoCompletion> completion)
+{
+    if (!transfer)
+    {
+        return;
+    }
+
+    PipeHandle handle = transfer->handle();
+    bool overlapped = !transfer->is_write() && pipe_is_overlapped(handle);
+    if (!overlapped)
+    {
+        pipe_set_blocking(handle, false);
+    }
+
+    if (completion)
+    {
+        completion->add();
+    }
+
+    auto it = std::min_element(m_workers.begin(), m_workers.end(),
+                               [](const auto& a, const auto& b) { return a->load.load() < b->load.load(); });
+    Worker& worker = overlapped ? *m_workers[std::hash<PipeHandle>{}(handle) % m_workers.size()] : **it;
+    ++worker.load;
+
+    Entry entry{std::move(transfer), std::move(completion)};
+#ifdef _WIN32
+    if (overlapped)
+    {
+        // Fails if a previous transfer of this pipe associated it already, with this same port.
+        (void)CreateIoCompletionPort(handle, worker.port, 0U, 0U);
+        entry.overlapped = std::make_unique<OVERLAPPED>();
+    }
+#endif
+
+    {
+        std::lock_guard lock(worker.mutex);
+        worker.incoming.push_back(std::move(entry));
+    }
+    wake(worker);
+}
+
+void IoReactor::run_worker(Worker& worker)
+{
+#ifndef _WIN32
+    // A child closing its end early must make pipe_write fail with EPIPE rather than kill the process. The signal
+    // is thread-directed, so blocking it here for good affects nobody else.
+    sigset_t block;
+    (void)sigemptyset(&block);
+    (void)sigaddset(&block, SIGPIPE);
+    (void)pthread_sigmask(SIG_BLOCK, &block, nullptr);
+#endif
+
+    std::vector<Entry> active;
+    std::vector<PipePollItem> items;
+    std::vector<bool> blocked;
+    std::vector<bool> ready;
+#ifdef _WIN32
+    std::array<OVERLAPPED_ENTRY, 64U> packets{};
+    DWORD interval = 0U;
+    static char zero_read = 0;
+#endif
+
+    auto complete = [&worker](Entry& entry)
+    {
+#ifdef _WIN32
+        if (entry.armed)
+        {
+            // Only when abandoned at exit. The read must be over before its OVERLAPPED is freed, its packet stays
+            // in the port unread.
+            DWORD bytes = 0U;
+            (void)CancelIoEx(entry.transfer->handle(), entry.overlapped.get());
+            (void)GetOverlappedResult(entry.transfer->handle(), entry.overlapped.get(), &bytes, TRUE);
+            entry.armed = false;
+        }
+#endif
+        entry.transfer.reset(); // closes the pipe before waiters are released
+        if (entry.completion)
+        {
+            entry.completion->done();
+        }
+        --worker.load;
+    };
+
+    while (true)
+    {
+        bool woken = false;
+        ready.assign(active.size(), false);
+#ifdef _WIN32
+        // An overlapped pipe being read gets a zero-byte read, which completes on the port once data or the end is
+        // there without taking any of it. The other pipes are polled.
+        bool polled = false;
+        bool retry = false;
+        items.assign(active.size(), PipePollItem{});
+        for (std::size_t i = 0U; i < active.size(); ++i)
+        {
+            Entry& entry = active[i];
+            if (entry.overlapped && !entry.transfer->is_write())
+            {
+                if (!entry.armed)
+                {
+                    // A packet is queued whether it completes at once or later. Failing means the writer is gone,
+                    // which the transfer finds out by itself.
+                    *entry.overlapped = {};
+                    entry.armed =
+                        0 != ReadFile(entry.transfer->handle(), &zero_read, 0U, nullptr, entry.overlapped.get()) ||
+                        GetLastError() == ERROR_IO_PENDING;
+                    ready[i] = !entry.armed;
+                }
+            }
+            else if (blocked[i] && entry.transfer->is_write())
+            {
+                // Writability cannot be polled on Windows, pipe_poll always reports it. Retry a writer that just
+                // made no progress after a millisecond instead of spinning. A Tee may wait on a sink this way.
+                retry = true;
+            }
+            else
+            {
+                items[i] = {entry.transfer->handle(), entry.transfer->is_write()};
+                polled = true;
+            }
+        }
+
+        bool any = std::find(ready.begin(), ready.end(), true) != ready.end();
+        if (polled && pipe_poll(items.data(), items.size(), 0.0) > 0)
+        {
+            for (std::size_t i = 0U; i < active.size(); ++i)
+            {
+                ready[i] = ready[i] || items[i].ready;
+            }
+            any = true;
+        }
+
+        // Only polled pipes need waking up early, backing off up to 8 ms like pipe_poll.
+        DWORD timeout = INFINITE;
+        if (any)
+        {
+            timeout = 0U;
+            interval = 0U;
+        }
+        else if (polled || retry)
+        {
+            timeout = retry ? std::min<DWORD>(interval, 1U) : interval;
+            interval = std::min<DWORD>(interval == 0U ? 1U : interval * 2U, 8U);
+        }
+
+        ULONG count = 0U;
+        if (0 != GetQueuedCompletionStatusEx(worker.port, packets.data(), static_cast<ULONG>(packets.size()), &count,
+                                             timeout, FALSE))
+        {
+            for (ULONG k = 0U; k < count; ++k)
+            {
+                OVERLAPPED* overlapped = packets[k].lpOverlapped;
+                woken = woken || overlapped == nullptr;
+                for (std::size_t i = 0U; overlapped != nullptr && i < active.size(); ++i)
+                {
+                    if (active[i].overlapped.get() == overlapped)
+                    {
+                        active[i].armed = false;
+                        ready[i] = true;
+                        break;
+                    }
+                }
+            }
+        }
+
+        for (std::size_t i = 0U; retry && i < active.size(); ++i)
+        {
+            ready[i] = ready[i] || (blocked[i] && active[i].transfer->is_write());
+        }
+#else
+        items.clear();
+        items.push_back({worker.wake.input});
+        for (auto& entry : active)
+        {
+            items.push_back({entry.transfer->handle(), entry.transfer->is_write()});
+        }
+
+        (void)pipe_poll(items.data(), items.size(), -1.0);
+        woken = items[0U].ready;
+        for (std::size_t i = 0U; i < active.size(); ++i)
+        {
+            ready[i] = items[i + 1U].ready;
+        }
+#endif
+
+        for (std::size_t i = 0U; i < active.size(); ++i)
+        {
+            if (!ready[i])
+            {
+                continue;
+            }
+
+            IoStatus status;
+            try
+            {
+                status = active[i].transfer->on_ready();
+            }
+            catch (...)
+            {
+                status = IoStatus::done;
+            }
+
+            blocked[i] = status == IoStatus::blocked;
+            if (status == IoStatus::done)
+            {
+                complete(active[i]);
+            }
+        }
+
+        for (std::size_t i = active.size(); i-- > 0U;)
+        {
+            if (!active[i].transfer)
+            {
+                active.erase(active.begin() + static_cast<std::ptrdiff_t>(i));
+                blocked.erase(blocked.begin() + static_cast<std::ptrdiff_t>(i));
+            }
+        }
+
+        if (woken)
+        {
+#ifndef _WIN32
+            char buf[64];
+            while (pipe_read(worker.wake.input, &buf[0], sizeof(buf)) > 0)
+            {
+            }
+#endif
+
+            std::lock_guard lock(worker.mutex);
+            if (worker.stopping)
+            {
+                break;
+            }
+            for (auto& entry : worker.incoming)
+            {
+                active.push_back(std::move(entry));
+                blocked.push_back(false);
+            }
+            worker.incoming.clear();
+        }
+    }
+
+    // Stopping at process exit. Whatever is left is abandoned, closing its pipes.
+    for (auto& entry : active)
+    {
+        complete(entry);
+    }
+    std::lock_guard lock(worker.mutex);
+    for (auto& entry : worker.incoming)
+    {
+        complete(entry);
+    }
+    worker.incoming.clear();
+}
+
+} // namespace subprocess
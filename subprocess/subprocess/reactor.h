@@ -0,0 +1,219 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "pipe.h"
+
+namespace subprocess
+{
+
+/** @brief Outcome of IoTransfer::on_ready. */
+enum class IoStatus
+{
+    pending, ///< Data was transferred, call again once the pipe is ready
+    blocked, ///< Nothing could be transferred without blocking
+    done     ///< The transfer is complete and will be destroyed
+};
+
+/**
+ * @brief A non-blocking transfer on one pipe, serviced by the IoReactor.
+ *
+ * A transfer usually owns its pipe and closes it on destruction. on_ready()
+ * is only called from the worker the transfer was assigned to, so
+ * implementations need no locking of their own.
+ */
+class IoTransfer
+{
+public:
+    virtual ~IoTransfer() = default;
+
+    /**
+     * @brief The pipe to watch. Asked again before every wait, so together
+     * with is_write() it may change after on_ready(), see Tee.
+     */
+    [[nodiscard]] virtual PipeHandle handle() const = 0;
+
+    /**
+     * @brief True to watch the pipe for writability, false for readability.
+     */
+    [[nodiscard]] virtual bool is_write() const = 0;
+
+    /**
+     * @brief Called when the pipe is ready. Must not block on the pipe.
+     * @return The outcome. Exceptions are treated as IoStatus::done.
+     */
+    virtual IoStatus on_ready() = 0;
+};
+
+/**
+ * @brief Counts outstanding transfers, so their owner can wait for them.
+ *
+ * Popen holds one for the redirections set up from its RunOptions.
+ */
+class IoCompletion
+{
+public:
+    /** @brief Registers one more outstanding transfer. */
+    void add();
+
+    /** @brief Marks one transfer as complete. */
+    void done();
+
+    /**
+     * @brief Waits until all transfers are complete.
+     * @param timeout Timeout in seconds, negative to wait forever.
+     * @return False if the timeout expired first.
+     */
+    bool wait(double timeout = -1.0);
+
+    /** @brief True if no transfer is outstanding. */
+    [[nodiscard]] bool is_done();
+
+    /**
+     * @brief Calls callback once all transfers are complete, from the thread
+     * completing the last one.
+     * @return False if all transfers are complete already, callback is then
+     * not called.
+     */
+    bool notify(std::function<void()> callback);
+
+private:
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::size_t m_pending{0U};
+    std::vector<std::function<void()>> m_callbacks;
+};
+
+/**
+ * @brief Reads a pipe until its end, appending everything to a string.
+ *
+ * The string must outlive the transfer, use an IoCompletion to know when it
+ * is done.
+ */
+class PipeToString final : public IoTransfer
+{
+public:
+    /**
+     * @param input The pipe to read, owned by the transfer from now on.
+     * @param output The string to append to.
+     */
+    PipeToString(PipeHandle input, std::string& output) : m_handle(input), m_output(output)
+    {
+    }
+
+    ~PipeToString() override;
+
+    PipeToString(const PipeToString&) = delete;
+    PipeToString& operator=(const PipeToString&) = delete;
+
+    [[nodiscard]] PipeHandle handle() const override
+    {
+        return m_handle;
+    }
+
+    [[nodiscard]] bool is_write() const override
+    {
+        return false;
+    }
+
+    IoStatus on_ready() override;
+
+private:
+    PipeHandle m_handle;
+    std::string& m_output;
+    std::size_t m_chunk{0U};
+};
+
+/**
+ * @brief Process-wide I/O reactor multiplexing all stream redirections.
+ *
+ * Redirections between pipes and std::string, std::istream, std::ostream or
+ * FILE* are serviced by a fixed number of worker threads, each waiting on
+ * many pipes at once with pipe_poll, instead of one thread per redirection.
+ * On Windows each worker also has an I/O completion port, which reports when
+ * a pipe_create_overlapped() pipe being read has data, so captured output is
+ * not polled for. The reactor is started lazily on first use and stopped at
+ * process exit.
+ */
+class IoReactor
+{
+public:
+    /**
+     * @brief Gets the reactor, starting it on first use.
+     */
+    static IoReactor& instance();
+
+    /**
+     * @brief Sets the number of worker threads. Defaults to 2.
+     * @param count The number of workers, at least 1.
+     * @throws std::logic_error If the reactor has already been started.
+     */
+    static void set_worker_count(std::size_t count);
+
+    /**
+     * @brief The number of worker threads.
+     */
+    [[nodiscard]] std::size_t worker_count() const
+    {
+        return m_workers.size();
+    }
+
+    /**
+     * @brief Hands a transfer to the least loaded worker.
+     *
+     * On Windows, reads of an overlapped pipe always go to the same worker, as
+     * the pipe can only be associated with one completion port.
+     *
+     * @param transfer The transfer. Its pipe is made non-blocking, unless it is
+     *        an overlapped pipe being read.
+     * @param completion Notified once the transfer is complete, may be null.
+     */
+    void add(std::unique_ptr<IoTransfer> transfer, std::shared_ptr<IoCompletion> completion = nullptr);
+
+    ~IoReactor();
+
+    IoReactor(const IoReactor&) = delete;
+    IoReactor& operator=(const IoReactor&) = delete;
+
+private:
+    explicit IoReactor(std::size_t worker_count);
+
+    struct Entry
+    {
+        std::unique_ptr<IoTransfer> transfer;
+        std::shared_ptr<IoCompletion> completion;
+#ifdef _WIN32
+        std::unique_ptr<OVERLAPPED> overlapped; ///< Of the zero-byte read waiting for data, null if polled
+        bool armed{false};                      ///< Whether that read is in flight
+#endif
+    };
+
+    struct Worker
+    {
+#ifdef _WIN32
+        HANDLE port{nullptr}; ///< Woken with a null OVERLAPPED
+#else
+        PipePair wake;
+#endif
+        std::mutex mutex;
+        std::vector<Entry> incoming;
+        std::atomic<std::size_t> load{0U};
+        bool stopping{false};
+        std::thread thread;
+    };
+
+    static void run_worker(Worker& worker);
+    static void wake(Worker& worker);
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+};
+
+} // namespace subprocess
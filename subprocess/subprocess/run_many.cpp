@@ -0,0 +1,181 @@
+#include "run_many.h"
+
+#include <algorithm>
+#include <exception>
+#include <map>
+#include <memory>
+#include <thread>
+
+#include "exit_watcher.h"
+#include "reactor.h"
+#include "trace.h"
+
+namespace subprocess
+{
+
+namespace
+{
+struct Running
+{
+    Running() = default;
+
+    ~Running()
+    {
+        // Only still running if run_many is left by an exception. The captures write into its results.
+        popen.close();
+        (void)captures->wait();
+    }
+
+    Running(const Running&) = delete;
+    Running& operator=(const Running&) = delete;
+
+    Popen popen;
+    std::shared_ptr<IoCompletion> captures{std::make_shared<IoCompletion>()};
+    StopWatch started;
+    double timeout{-1.0}; ///< Negative for none
+    bool timed_out{false};
+};
+} // namespace
+
+std::vector<CompletedProcess> run_many(std::span<const RunBuilder> jobs, std::size_t max_parallel)
+{
+    if (max_parallel == 0U)
+    {
+        max_parallel = std::max(1U, std::thread::hardware_concurrency());
+    }
+
+    std::vector<CompletedProcess> results(jobs.size());
+    std::map<std::size_t, Running> running; // nodes stay in place, as the watcher requires
+    details::ExitWatcher watcher;
+    std::exception_ptr error;
+    std::size_t error_index = jobs.size();
+    std::size_t next = 0U;
+
+    auto fail = [&](std::size_t index, std::exception_ptr exception)
+    {
+        if (index < error_index)
+        {
+            error = std::move(exception);
+            error_index = index;
+        }
+    };
+
+    auto start = [&](std::size_t index)
+    {
+        const RunBuilder& job = jobs[index];
+        CompletedProcess& completed = results[index];
+        completed.cout.reserve(job.options.cout_size_hint);
+        completed.cerr.reserve(job.options.cerr_size_hint);
+
+        Popen popen(job.command, job.options);
+        Running& entry = running[index];
+        entry.popen = std::move(popen);
+
+        // The reactor owns the captured pipes from now on.
+        if (entry.popen.cout != kBadPipeValue)
+        {
+            IoReactor::instance().add(std::make_unique<PipeToString>(entry.popen.cout, completed.cout), entry.captures);
+            entry.popen.cout = kBadPipeValue;
+        }
+
+        if (entry.popen.cerr != kBadPipeValue)
+        {
+            IoReactor::instance().add(std::make_unique<PipeToString>(entry.popen.cerr, completed.cerr), entry.captures);
+            entry.popen.cerr = kBadPipeValue;
+        }
+
+        entry.started.Start();
+        entry.timeout = job.options.timeout;
+        watcher.add(entry.popen, index);
+    };
+
+    auto finish = [&](std::size_t index)
+    {
+        const RunBuilder& job = jobs[index];
+        CompletedProcess& completed = results[index];
+        Running& entry = running.at(index);
+
+        // Output is complete once the child and whatever inherited its pipes closed them, like in run().
+        (void)entry.captures->wait();
+        SUBPROCESS_TRACE_COUNT(TraceCounter::cout_bytes, completed.cout.size());
+        SUBPROCESS_TRACE_COUNT(TraceCounter::cerr_bytes, completed.cerr.size());
+        completed.returncode = entry.popen.returncode;
+        completed.usage = entry.popen.resource_usage();
+        completed.cout_file = entry.popen.mapped_cout();
+        completed.cerr_file = entry.popen.mapped_cerr();
+        completed.argv = entry.popen.argv();
+        completed.args = std::move(entry.popen.args);
+        entry.popen.close();
+
+        if (entry.timed_out)
+        {
+            fail(index, std::make_exception_ptr(TimeoutExpired{"subprocess::run timeout reached", job.command,
+                                                               job.options.timeout, completed.cout,
+                                                               completed.cerr}));
+        }
+        else if (job.options.raise_on_nonzero && completed.returncode != 0)
+        {
+            fail(index, std::make_exception_ptr(CalledProcessError{"failed to execute " + job.command[0U],
+                                                                   job.command, completed.returncode,
+                                                                   completed.cout, completed.cerr}));
+        }
+
+        (void)running.erase(index);
+    };
+
+    while (true)
+    {
+        while (!error && next < jobs.size() && running.size() < max_parallel)
+        {
+            std::size_t index = next++;
+            try
+            {
+                start(index);
+            }
+            catch (...)
+            {
+                (void)running.erase(index);
+                fail(index, std::current_exception());
+            }
+        }
+
+        if (running.empty())
+        {
+            break;
+        }
+
+        double timeout = -1.0;
+        for (auto& [index, entry] : running)
+        {
+            if (entry.timeout >= 0.0 && !entry.timed_out)
+            {
+                double remaining = entry.started.remaining(entry.timeout);
+                timeout = timeout < 0.0 ? remaining : std::min(timeout, remaining);
+            }
+        }
+
+        for (std::size_t index : watcher.wait(timeout))
+        {
+            finish(index);
+        }
+
+        for (auto& [index, entry] : running)
+        {
+            if (!entry.timed_out && entry.started.expired(entry.timeout))
+            {
+                // The exit is picked up by the watcher like any other.
+                (void)entry.popen.send_signal(SigNum::PSIGTERM);
+                entry.timed_out = true;
+            }
+        }
+    }
+
+    if (error)
+    {
+        std::rethrow_exception(error);
+    }
+
+    return results;
+}
+
+} // namespace subprocess
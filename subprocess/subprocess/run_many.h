@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <span>
+#include <vector>
+
+#include "builder.h"
+
+namespace subprocess
+{
+
+/**
+ * @brief Runs many commands, at most max_parallel at a time, and returns
+ * details about each execution.
+ *
+ * Behaves like calling subprocess::run() for every job, but without a
+ * thread per job. Captured output and std::string input are serviced by the
+ * IoReactor, and exits are waited for in one place, see
+ * details::ExitWatcher. As soon as a job exits the next one is started.
+ *
+ * A job that could not be started, timed out, or returned non-zero with
+ * raise_on_nonzero set, stops further jobs from being started. Once the
+ * running ones are done, the exception of the first failed job is thrown.
+ *
+ * @param jobs The commands and their options.
+ * @param max_parallel The maximum number of running jobs, 0 for the number
+ * of hardware threads.
+ * @return One CompletedProcess per job, in the order of jobs.
+ * @throws CalledProcessError, TimeoutExpired, CommandNotFoundError,
+ * SpawnError, OSError As subprocess::run().
+ */
+std::vector<CompletedProcess> run_many(std::span<const RunBuilder> jobs, std::size_t max_parallel = 0U);
+
+} // namespace subprocess
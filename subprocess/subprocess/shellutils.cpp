@@ -12,14 +12,27 @@
 #include <errno.h>
 #endif
 
+#include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <chrono>
+#include <cstdint>
 #include <cstdlib>
 #include <filesystem>
+#include <fstream>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <sstream>
+#include <unordered_map>
+#include <utility>
 
 #include "builder.h"
+#include "trace.h"
+
+#ifdef _WIN32
+#include "utf8_to_utf16.h"
+#endif
 
 namespace subprocess
 {
@@ -150,29 +163,139 @@ bool is_file(const std::string& path)
 /**
  * @brief Checks if the specified executable at the given path is Python 3.
  *
- * This function runs the specified executable with the "--version" argument using a subprocess
- * and examines the output to determine if it represents Python 3.
+ * The version comes from python_version(), which reads it from pyvenv.cfg,
+ * the name of the file a symlink resolves to, or the version resource on
+ * Windows, and only runs the executable with "--version" if none of them
+ * tells, caching the result.
  *
  * @param path The path to the Python executable.
  * @return True if the executable is Python 3, false otherwise.
- *
- * @note The following alternative syntax examples can be used (last one only applicable with C++20):
- *   \code{cpp}
- *   auto process = subprocess::run({path, "--version"}, RunBuilder().cout(PipeOption::pipe).cerr(PipeOption::cout));
- *   \endcode
- *   or
- *   \code{cpp}
- *   auto process = subprocess::RunBuilder({path, "--version"}).cout(PipeOption::pipe).cerr(PipeOption::cout).run();
- *   \endcode
- *   or
- *   \code{cpp}
- *   auto process = subprocess::run({path, "--version"}, {.cout = PipeOption::pipe, .cerr = PipeOption::cout});
- *   \endcode
  */
 bool is_python3(const std::string& path)
 {
-    auto process = subprocess::run({path, "--version"}, {.cout = PipeOption::pipe, .cerr = PipeOption::cout});
-    return process.cout.find("3.") != std::string::npos; // std::string::contains() only available with C++23
+    std::string version = path.empty() ? std::string{} : python_version(path);
+    return version == "3" || version.starts_with("3.");
+}
+
+struct ProbeEntry
+{
+    std::filesystem::file_time_type mtime;
+    std::uintmax_t size;
+    std::string result;
+};
+
+std::mutex g_probe_cache_mutex;
+std::map<std::string, ProbeEntry> g_probe_cache;
+
+/**
+ * @brief Gives the cached result of probe for the file at path, or runs it.
+ *
+ * A result is only reused while the file keeps its size and modification
+ * time. The lock is not held while probing, so two threads may probe the
+ * same file at once, which is harmless.
+ *
+ * @param path The file probed.
+ * @param kind Tells apart different probes of the same file.
+ */
+template <typename Probe>
+std::string cached_probe(const std::string& path, const std::string& kind, Probe probe)
+{
+    std::error_code ec;
+    std::filesystem::file_time_type mtime = std::filesystem::last_write_time(path, ec);
+    std::uintmax_t size = ec ? 0U : std::filesystem::file_size(path, ec);
+    if (ec)
+    {
+        return probe(); // cannot be validated, so it is not cached
+    }
+
+    std::string key = kind + '\0' + path;
+    {
+        std::lock_guard lock(g_probe_cache_mutex);
+        if (auto it = g_probe_cache.find(key); it != g_probe_cache.end())
+        {
+            if (it->second.mtime == mtime && it->second.size == size)
+            {
+                return it->second.result;
+            }
+        }
+    }
+
+    std::string result = probe();
+    std::lock_guard lock(g_probe_cache_mutex);
+    g_probe_cache[key] = {mtime, size, result};
+    return result;
+}
+
+/**
+ * @brief Gives the first version number in text, e.g. "3.12.1" of "Python 3.12.1".
+ */
+std::string extract_version(std::string_view text)
+{
+    std::size_t begin = text.find_first_of("0123456789");
+    if (begin == std::string_view::npos)
+    {
+        return {};
+    }
+
+    std::size_t end = text.find_first_not_of("0123456789.", begin);
+    std::string_view result = text.substr(begin, end == std::string_view::npos ? end : end - begin);
+    while (result.ends_with('.'))
+    {
+        result.remove_suffix(1U);
+    }
+    return std::string(result);
+}
+
+std::string python_version_uncached(const std::string& path)
+{
+    std::filesystem::path file(path);
+    if (file.stem().string().starts_with("python"))
+    {
+        // A virtual environment records the version of its base interpreter, next to its bin or Scripts folder.
+        std::ifstream config(file.parent_path().parent_path() / "pyvenv.cfg");
+        for (std::string line; std::getline(config, line);)
+        {
+            std::size_t equal = line.find('=');
+            std::string key = line.substr(0U, equal);
+            std::erase_if(key, [](char c) { return std::isspace(static_cast<unsigned char>(c)) != 0; });
+            if (equal != std::string::npos && (key == "version" || key == "version_info"))
+            {
+                if (std::string version = extract_version(line.substr(equal + 1U)); !version.empty())
+                {
+                    return version;
+                }
+            }
+        }
+
+#ifdef _WIN32
+        std::wstring wide = utf8_to_utf16_w(path);
+        DWORD ignored = 0U;
+        DWORD size = GetFileVersionInfoSizeW(wide.c_str(), &ignored);
+        std::vector<char> data(size);
+        VS_FIXEDFILEINFO* info = nullptr;
+        UINT length = 0U;
+        if (size > 0U && GetFileVersionInfoW(wide.c_str(), 0U, size, data.data()) &&
+            VerQueryValueW(data.data(), L"\\", reinterpret_cast<void**>(&info), &length) && info != nullptr &&
+            HIWORD(info->dwProductVersionMS) > 0U)
+        {
+            // python.exe encodes the micro version and release level in the third field, only the first two are used.
+            DWORD version = info->dwProductVersionMS;
+            return std::to_string(HIWORD(version)) + "." + std::to_string(LOWORD(version));
+        }
+#else
+        // python and python3 are usually symlinks to e.g. python3.12.
+        std::error_code ec;
+        std::string target = std::filesystem::canonical(file, ec).filename().string();
+        if (!ec && target.starts_with("python") && target.find('.') != std::string::npos &&
+            extract_version(target) == target.substr(6U))
+        {
+            return target.substr(6U);
+        }
+#endif
+    }
+
+    std::string output = probe_program(path);
+    return output.starts_with("Python ") ? extract_version(output) : std::string{};
 }
 
 /**
@@ -290,24 +413,126 @@ std::string try_exe(const std::string& path)
     return result;
 }
 
-std::mutex g_program_cache_mutex;
-std::map<std::string, std::string> g_program_cache;
+/**
+ * @brief A program looked up with a PATH. The hash of the PATH value only
+ * picks the bucket and fails comparisons early, the value itself decides.
+ */
+struct ProgramKey
+{
+    ProgramKey(std::string name_, std::string path_)
+        : name(std::move(name_)), path_hash(std::hash<std::string>{}(path_)), path(std::move(path_))
+    {
+    }
+
+    std::string name;
+    std::size_t path_hash;
+    std::string path; ///< PATH, and on Windows PATHEXT, the lookup depends on
+
+    bool operator==(const ProgramKey&) const = default;
+};
+
+struct ProgramKeyHash
+{
+    std::size_t operator()(const ProgramKey& key) const noexcept
+    {
+        return std::hash<std::string>{}(key.name) ^ (key.path_hash * 0x9E3779B97F4A7C15ULL);
+    }
+};
+
+struct ProgramEntry
+{
+    std::string path; ///< Empty if the program was not found
+    std::chrono::steady_clock::time_point added;
+};
+
+using ProgramCache = std::unordered_map<ProgramKey, ProgramEntry, ProgramKeyHash>;
+
+/**
+ * @brief Most entries of the cache. Once it is full, entries of other PATH
+ * values are dropped first, then the oldest ones.
+ */
+constexpr std::size_t kMaxProgramCache = 256U;
+
+/*
+ * The cache is an immutable snapshot, replaced as a whole when a lookup
+ * adds to it. Lookups only load the current snapshot, so concurrent spawns
+ * never wait for each other, nor for a PATH scan in progress. A null
+ * snapshot is an empty cache.
+ */
+#ifdef __cpp_lib_atomic_shared_ptr
+std::atomic<std::shared_ptr<const ProgramCache>> g_program_cache;
+
+std::shared_ptr<const ProgramCache> load_program_cache()
+{
+    return g_program_cache.load();
+}
+
+void store_program_cache(std::shared_ptr<const ProgramCache> cache)
+{
+    g_program_cache.store(std::move(cache));
+}
+
+bool replace_program_cache(std::shared_ptr<const ProgramCache>& expected, std::shared_ptr<const ProgramCache> cache)
+{
+    return g_program_cache.compare_exchange_weak(expected, std::move(cache));
+}
+#else
+std::shared_ptr<const ProgramCache> g_program_cache;
+
+std::shared_ptr<const ProgramCache> load_program_cache()
+{
+    return std::atomic_load(&g_program_cache);
+}
+
+void store_program_cache(std::shared_ptr<const ProgramCache> cache)
+{
+    std::atomic_store(&g_program_cache, std::move(cache));
+}
+
+bool replace_program_cache(std::shared_ptr<const ProgramCache>& expected, std::shared_ptr<const ProgramCache> cache)
+{
+    return std::atomic_compare_exchange_weak(&g_program_cache, &expected, std::move(cache));
+}
+#endif
+
+/** @brief Time to live of cache entries in nanoseconds, negative if they do not expire. */
+std::atomic<std::int64_t> g_program_cache_ttl{-1};
+
+void cache_program(const ProgramKey& key, const std::string& path)
+{
+    std::shared_ptr<const ProgramCache> current = load_program_cache();
+    std::shared_ptr<ProgramCache> next;
+    do
+    {
+        next = current ? std::make_shared<ProgramCache>(*current) : std::make_shared<ProgramCache>();
+        if (next->size() >= kMaxProgramCache && !next->contains(key))
+        {
+            std::erase_if(*next, [&key](const auto& item) { return item.first.path != key.path; });
+            // Names looked up with one PATH, e.g. many that are not installed, are bounded as well.
+            while (next->size() >= kMaxProgramCache)
+            {
+                next->erase(std::min_element(next->begin(), next->end(), [](const auto& a, const auto& b)
+                                             { return a.second.added < b.second.added; }));
+            }
+        }
+        (*next)[key] = {path, std::chrono::steady_clock::now()};
+    } while (!replace_program_cache(current, next));
+}
 
 /**
  * @brief Finds the absolute path of an executable program in the system's PATH.
  *
  * This function searches for the specified program name in the system's PATH
- * environment variable and returns the absolute path if found. It utilizes a
- * cache to improve performance by storing previously resolved program paths.
+ * environment variable and returns the absolute path if found. Results,
+ * including programs not found, are cached for the PATH value they were
+ * looked up with, so changing PATH never gives stale results.
  *
  * @param name The name of the program to find.
  * @return The absolute path of the program if found, an empty string otherwise.
  */
 std::string find_program_in_path(const std::string& name)
 {
-    std::tuple<bool, std::string> result{false, ""};             // {found, value}
-    std::unique_lock lock(g_program_cache_mutex);                // For cache variable thread-safety
-    std::map<std::string, std::string>& cache = g_program_cache; // Ref to global cache
+    std::tuple<bool, std::string> result{false, ""}; // {found, value}
 
     if (!name.empty())
     {
@@ -328,13 +553,36 @@ std::string find_program_in_path(const std::string& name)
 
         if (auto [found, value] = result; !found)
         {
-            if (cache.contains(name))
+            std::string path = getenv("PATH");
+#ifdef _WIN32
+            // try_exe depends on PATHEXT as well.
+            ProgramKey key{name, path + '\0' + getenv("PATHEXT")};
+#else
+            ProgramKey key{name, path};
+#endif
+
+            std::shared_ptr<const ProgramCache> cache = load_program_cache();
+            const ProgramEntry* cached = nullptr;
+            if (cache)
+            {
+                if (auto it = cache->find(key); it != cache->end())
+                {
+                    cached = &it->second;
+                }
+            }
+
+            std::int64_t ttl = g_program_cache_ttl.load(std::memory_order_relaxed);
+            if (cached != nullptr &&
+                (ttl < 0 || std::chrono::steady_clock::now() - cached->added < std::chrono::nanoseconds(ttl)))
             {
-                result = {true, cache[name]}; // already cached
+                SUBPROCESS_TRACE_COUNT(TraceCounter::program_cache_hits, 1U);
+                result = {true, cached->path}; // already cached
             }
             else
             {
-                for (std::string p : split(getenv("PATH"), kPathDelimiter))
+                SUBPROCESS_TRACE_COUNT(TraceCounter::program_cache_misses, 1U);
+                std::string program;
+                for (std::string p : split(path, kPathDelimiter))
                 {
                     if (p.empty())
                     {
@@ -343,11 +591,13 @@ std::string find_program_in_path(const std::string& name)
 
                     if (p = try_exe(std::format("{}/{}", p, name)); !p.empty() && is_file(p))
                     {
-                        cache[name] = p; // update cache
-                        result = {true, p};
+                        program = p;
                         break;
                     }
                 }
+
+                cache_program(key, program);
+                result = {true, program};
             }
         }
     }
@@ -383,6 +633,13 @@ std::string abspath(std::string dir, std::string relative)
 }
 
 std::string escape_shell_arg(const std::string& arg, bool escape)
+{
+    std::string result;
+    details::append_shell_arg(result, arg, escape);
+    return result;
+}
+
+void details::append_shell_arg(std::string& target, std::string_view arg, bool escape)
 {
     // Check if quoting is necessary
     bool needs_quote = false;
@@ -400,32 +657,27 @@ std::string escape_shell_arg(const std::string& arg, bool escape)
         }
     }
 
-    // Result string to be returned
-    std::string result;
-
-    // If quoting is not needed, return the original argument
+    // If quoting is not needed, append the original argument
     if (!needs_quote)
     {
-        result = arg;
+        target += arg;
     }
     else
     {
         // If quoting is needed, perform escaping and add quotes
-        result = "\""; // Opening double quotes
+        target += '"'; // Opening double quotes
         for (const char ch : arg)
         {
             // Escape double quotes and backslashes
             if (ch == '\"' || ch == '\\')
             {
-                result += '\\';
+                target += '\\';
             }
 
-            result += ch;
+            target += ch;
         }
-        result += "\""; // Closing double quotes.
+        target += '"'; // Closing double quotes.
     }
-
-    return result;
 }
 
 std::string get_cwd()
@@ -457,8 +709,36 @@ std::string getenv(const std::string& name)
     return result;
 }
 
+std::string probe_program(const std::string& path, const std::vector<std::string>& args)
+{
+    if (path.empty())
+    {
+        return {};
+    }
+
+    std::string kind = "run";
+    for (const std::string& arg : args)
+    {
+        (void)kind.append(1U, '\0').append(arg);
+    }
+
+    return cached_probe(path, kind,
+                        [&]()
+                        {
+                            CommandLine command{path};
+                            command.insert(command.end(), args.begin(), args.end());
+                            return run(command, {.cout = PipeOption::pipe, .cerr = PipeOption::cout}).cout;
+                        });
+}
+
+std::string python_version(const std::string& path)
+{
+    return cached_probe(path, "python-version", [&]() { return python_version_uncached(path); });
+}
+
 std::string find_program(const std::string& name)
 {
+    SUBPROCESS_TRACE_SCOPE(TracePhase::find_program);
     std::string result{};
 
     if (name != "python3")
@@ -475,8 +755,13 @@ std::string find_program(const std::string& name)
 
 void find_program_clear_cache()
 {
-    std::unique_lock<std::mutex> lock(g_program_cache_mutex);
-    g_program_cache.clear();
+    store_program_cache(nullptr);
+}
+
+void find_program_set_cache_ttl(double seconds)
+{
+    auto ttl = seconds < 0.0 ? std::int64_t{-1} : static_cast<std::int64_t>(seconds * 1e9);
+    g_program_cache_ttl.store(ttl, std::memory_order_relaxed);
 }
 
 } // namespace subprocess
\ No newline at end of file
@@ -1,5 +1,7 @@
 #pragma once
 #include <string>
+#include <string_view>
+#include <vector>
 
 namespace subprocess
 {
@@ -27,15 +29,51 @@ std::string find_program(const std::string& name);
 /**
  * Clears the cache used by find_program.
  *
- * The find_program function uses an internal cache to locate executables. If
- * you modify PATH using subprocess::cenv, this cache will be automatically
- * cleared for you. However, if a new program is added to a folder with the same
- * name as an existing program, you may want to clear the cache explicitly so
- * that the new program is found as expected, rather than the old program being
- * returned.
+ * The find_program function caches where programs were found, and that they
+ * were not found, for the value of PATH they were looked up with. Changing
+ * PATH, in any way, therefore never gives stale results. However, if a
+ * program is added to, moved or removed from a folder already on PATH, you
+ * may want to clear the cache explicitly so that the change is seen, or set
+ * a time to live with find_program_set_cache_ttl.
  */
 void find_program_clear_cache();
 
+/**
+ * Sets how long find_program trusts its cached results.
+ *
+ * @param seconds The time to live of cache entries, negative for entries
+ * to never expire, which is the default.
+ */
+void find_program_set_cache_ttl(double seconds);
+
+/**
+ * Runs the program at path with args and gives its output, cout and cerr
+ * combined, e.g. to detect the version of a tool.
+ *
+ * Results are cached per path and args, and reused for as long as the size
+ * and modification time of the program stay the same, so a tool is run once
+ * rather than on every lookup.
+ *
+ * @param path The program, e.g. as given by find_program.
+ * @param args The arguments to pass.
+ * @return The output of the program, empty if path is empty.
+ */
+std::string probe_program(const std::string& path, const std::vector<std::string>& args = {"--version"});
+
+/**
+ * Gives the version of the Python interpreter at path, e.g. "3.12.1".
+ *
+ * Where possible the interpreter is not run: the version is read from the
+ * pyvenv.cfg of a virtual environment, from the name of the file a symlink
+ * resolves to, e.g. "python3.12", or from the version resource on Windows.
+ * Otherwise "--version" is run with probe_program. The result is cached like
+ * with probe_program.
+ *
+ * @param path The interpreter, e.g. as given by find_program.
+ * @return The version, empty if path is not a Python interpreter.
+ */
+std::string python_version(const std::string& path);
+
 /**
  * Escapes the argument to make it suitable for use on the command line.
  * The purpose is to handle special characters or cases where quoting might
@@ -43,6 +81,12 @@ void find_program_clear_cache();
  */
 std::string escape_shell_arg(const std::string& arg, bool esccape = true);
 
+namespace details
+{
+/** @brief Appends escape_shell_arg(arg, escape) to target. */
+void append_shell_arg(std::string& target, std::string_view arg, bool escape);
+} // namespace details
+
 /**
  * Retrieves the current working directory of the calling process.
  */
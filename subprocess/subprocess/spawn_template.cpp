@@ -0,0 +1,73 @@
+#include "spawn_template.h"
+
+#include <format>
+#include <stdexcept>
+
+namespace subprocess
+{
+
+namespace
+{
+/** @brief Freezes one stream of the layout, as Popen::init derives it for each process. */
+void freeze_pipe(const PipeVar& var, PipeOption& option, PipeHandle& handle, const char* name)
+{
+    auto index = static_cast<PipeVarIndex>(var.index());
+    if (index == PipeVarIndex::option)
+    {
+        option = std::get<PipeOption>(var);
+        if (option == PipeOption::mmap_file)
+        {
+            throw std::invalid_argument(
+                std::format("SpawnTemplate: PipeOption::mmap_file for {} is per process", name));
+        }
+    }
+    else if (index == PipeVarIndex::handle)
+    {
+        option = PipeOption::specific;
+        handle = std::get<PipeHandle>(var);
+        if (handle == kBadPipeValue)
+        {
+            throw std::invalid_argument(std::format("SpawnTemplate: bad pipe value for {}", name));
+        }
+    }
+    else
+    {
+        throw std::invalid_argument(std::format("SpawnTemplate: {} must be a PipeOption or a handle", name));
+    }
+}
+} // namespace
+
+SpawnTemplate::SpawnTemplate(CommandLine prefix, const RunOptions& options)
+{
+    if (prefix.empty())
+    {
+        throw std::invalid_argument("SpawnTemplate: prefix is empty");
+    }
+
+    freeze_pipe(options.cin, m_builder.cin_option, m_builder.cin_pipe, "cin");
+    freeze_pipe(options.cout, m_builder.cout_option, m_builder.cout_pipe, "cout");
+    freeze_pipe(options.cerr, m_builder.cerr_option, m_builder.cerr_pipe, "cerr");
+    m_builder.apply_options(options);
+
+    m_builder.program = find_program(prefix[0U]);
+    if (m_builder.program.empty())
+    {
+        throw CommandNotFoundError(std::format("Command \"{}\" not found.", prefix[0U]));
+    }
+
+    m_builder.command = std::move(prefix);
+}
+
+Popen SpawnTemplate::spawn(const CommandLine& args) const
+{
+    CommandLine command;
+    command.reserve(m_builder.command.size() + args.size());
+    command.insert(command.end(), m_builder.command.begin(), m_builder.command.end());
+    command.insert(command.end(), args.begin(), args.end());
+
+    // run_command is not const, a copy keeps concurrent spawns apart. The env block is shared, not copied.
+    ProcessBuilder builder = m_builder;
+    return builder.run_command(std::move(command));
+}
+
+} // namespace subprocess
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <string>
+
+#include "builder.h"
+
+namespace subprocess
+{
+
+/**
+ * @brief A command prefix and its options, resolved once to start many
+ * processes that only differ in their trailing arguments.
+ *
+ * The program is looked up once, and the environment block, cwd, creation
+ * flags, limits and pipe layout are kept in a ProcessBuilder, so spawn() goes
+ * straight to creating the pipes and the process.
+ *
+ * Only options that apply to every process can be frozen: PipeOption values
+ * other than mmap_file, and handles, which are shared by all the processes.
+ * In-memory input, streams, FILE*, callbacks and Tee belong to one process,
+ * use a Popen for those.
+ *
+ * spawn() is const and may be called from many threads at once.
+ *
+ * @code
+ * subprocess::SpawnTemplate compress({"gzip", "-k"}, {.cout = subprocess::PipeOption::none});
+ * for (const auto& file : files)
+ *     compress.spawn({file}).close();
+ * @endcode
+ */
+class SpawnTemplate
+{
+public:
+    /**
+     * @param prefix The program and any leading arguments.
+     * @param options The options of every process.
+     * @throws std::invalid_argument If prefix is empty, or an option cannot be
+     *         shared between processes.
+     * @throws CommandNotFoundError If the program cannot be found.
+     */
+    explicit SpawnTemplate(CommandLine prefix, const RunOptions& options = {});
+
+    /**
+     * @brief Starts a process running the prefix followed by args.
+     * @throws SpawnError If the process could not be started.
+     */
+    [[nodiscard]] Popen spawn(const CommandLine& args = {}) const;
+
+    /**
+     * @brief The path the program was resolved to.
+     */
+    [[nodiscard]] const std::string& program() const
+    {
+        return m_builder.program;
+    }
+
+    /**
+     * @brief The program and leading arguments, as given.
+     */
+    [[nodiscard]] const CommandLine& prefix() const
+    {
+        return m_builder.command;
+    }
+
+private:
+    ProcessBuilder m_builder;
+};
+
+} // namespace subprocess
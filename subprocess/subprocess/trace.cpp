@@ -0,0 +1,219 @@
+#include "trace.h"
+
+#include <array>
+#include <atomic>
+#include <ios>
+#include <map>
+#include <memory>
+#include <sstream>
+
+#include "builder.h"
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
+
+namespace subprocess
+{
+
+namespace
+{
+constexpr std::array<std::string_view, kTracePhaseCount> kPhaseNames{
+    "find_program", "env_block", "pipe_create", "spawn", "exec", "redirect", "capture", "wait"};
+
+constexpr std::array<std::string_view, kTraceCounterCount> kCounterNames{
+    "spawns",    "pipe_reads", "pipe_writes", "bytes_read",         "bytes_written",
+    "cin_bytes", "cout_bytes", "cerr_bytes",  "program_cache_hits", "program_cache_misses"};
+
+std::array<std::atomic<uint64_t>, kTraceCounterCount> g_counters{};
+
+// Every event loads the sink, threads spawning at the same time must not wait for each other to do so.
+#ifdef __cpp_lib_atomic_shared_ptr
+std::atomic<std::shared_ptr<TraceSink>> g_sink;
+
+std::shared_ptr<TraceSink> load_sink()
+{
+    return g_sink.load();
+}
+
+void store_sink(std::shared_ptr<TraceSink> sink)
+{
+    g_sink.store(std::move(sink));
+}
+#else
+std::shared_ptr<TraceSink> g_sink;
+
+std::shared_ptr<TraceSink> load_sink()
+{
+    return std::atomic_load(&g_sink);
+}
+
+void store_sink(std::shared_ptr<TraceSink> sink)
+{
+    std::atomic_store(&g_sink, std::move(sink));
+}
+#endif
+
+std::atomic<bool> g_active{false};
+
+const StopWatch& trace_watch()
+{
+    static const StopWatch watch;
+    return watch;
+}
+
+int64_t this_process_id()
+{
+#ifdef _WIN32
+    return static_cast<int64_t>(GetCurrentProcessId());
+#else
+    return static_cast<int64_t>(getpid());
+#endif
+}
+} // namespace
+
+std::string_view trace_phase_name(TracePhase phase)
+{
+    return kPhaseNames.at(static_cast<std::size_t>(phase));
+}
+
+std::string_view trace_counter_name(TraceCounter counter)
+{
+    return kCounterNames.at(static_cast<std::size_t>(counter));
+}
+
+void set_trace_sink(std::shared_ptr<TraceSink> sink)
+{
+    (void)trace_watch(); // starts the clock before the first event
+    g_active.store(sink != nullptr, std::memory_order_relaxed);
+    store_sink(std::move(sink));
+}
+
+uint64_t trace_counter(TraceCounter counter)
+{
+    return g_counters.at(static_cast<std::size_t>(counter)).load(std::memory_order_relaxed);
+}
+
+void trace_counters_reset()
+{
+    for (auto& counter : g_counters)
+    {
+        counter.store(0U, std::memory_order_relaxed);
+    }
+}
+
+bool details::trace_active()
+{
+    return g_active.load(std::memory_order_relaxed);
+}
+
+double details::trace_clock()
+{
+    return trace_watch().seconds();
+}
+
+void details::trace_emit(TracePhase phase, double begin, int64_t pid)
+{
+    if (std::shared_ptr<TraceSink> sink = load_sink(); sink)
+    {
+        sink->on_event({phase, begin, trace_clock(), pid, std::this_thread::get_id()});
+    }
+}
+
+void details::trace_count(TraceCounter counter, uint64_t amount)
+{
+    (void)g_counters.at(static_cast<std::size_t>(counter)).fetch_add(amount, std::memory_order_relaxed);
+}
+
+void TraceRecorder::on_event(const TraceEvent& event)
+{
+    std::lock_guard lock(m_mutex);
+    if (m_events.size() < m_capacity)
+    {
+        m_events.push_back(event);
+    }
+    else
+    {
+        ++m_dropped;
+    }
+}
+
+std::vector<TraceEvent> TraceRecorder::events() const
+{
+    std::lock_guard lock(m_mutex);
+    return m_events;
+}
+
+std::size_t TraceRecorder::dropped() const
+{
+    std::lock_guard lock(m_mutex);
+    return m_dropped;
+}
+
+void TraceRecorder::clear()
+{
+    std::lock_guard lock(m_mutex);
+    m_events.clear();
+    m_dropped = 0U;
+}
+
+std::string TraceRecorder::chrome_trace_json() const
+{
+    std::vector<TraceEvent> recorded = events();
+    std::map<std::thread::id, std::size_t> threads;
+    int64_t process = this_process_id();
+
+    // Timestamps are in microseconds, to the nanosecond.
+    std::ostringstream json;
+    json << std::fixed;
+    json.precision(3);
+    json << "{\"traceEvents\":[";
+    for (std::size_t i = 0U; i < recorded.size(); ++i)
+    {
+        const TraceEvent& event = recorded[i];
+        auto [it, added] = threads.try_emplace(event.thread, threads.size() + 1U);
+        json << (i == 0U ? "\n" : ",\n") << R"({"name":")" << trace_phase_name(event.phase)
+             << R"(","cat":"subprocess","ph":"X","ts":)" << event.begin * 1e6
+             << ",\"dur\":" << (event.end - event.begin) * 1e6 << ",\"pid\":" << process << ",\"tid\":" << it->second;
+        if (event.pid != 0)
+        {
+            json << R"(,"args":{"child":)" << event.pid << "}";
+        }
+        json << "}";
+    }
+    json << "\n],\"displayTimeUnit\":\"ms\"}\n";
+    return json.str();
+}
+
+std::string TraceRecorder::prometheus_text() const
+{
+    std::array<std::size_t, kTracePhaseCount> counts{};
+    std::array<double, kTracePhaseCount> seconds{};
+    for (const TraceEvent& event : events())
+    {
+        auto index = static_cast<std::size_t>(event.phase);
+        ++counts.at(index);
+        seconds.at(index) += event.end - event.begin;
+    }
+
+    std::ostringstream text;
+    text.precision(15);
+    for (std::size_t i = 0U; i < kTraceCounterCount; ++i)
+    {
+        std::string_view name = kCounterNames.at(i);
+        text << "# TYPE subprocess_" << name << "_total counter\n"
+             << "subprocess_" << name << "_total " << g_counters.at(i).load(std::memory_order_relaxed) << '\n';
+    }
+
+    text << "# TYPE subprocess_phase_seconds summary\n";
+    for (std::size_t i = 0U; i < kTracePhaseCount; ++i)
+    {
+        text << "subprocess_phase_seconds_sum{phase=\"" << kPhaseNames.at(i) << "\"} " << seconds.at(i) << '\n'
+             << "subprocess_phase_seconds_count{phase=\"" << kPhaseNames.at(i) << "\"} " << counts.at(i) << '\n';
+    }
+    text << "# TYPE subprocess_trace_dropped_total counter\n"
+         << "subprocess_trace_dropped_total " << dropped() << '\n';
+    return text.str();
+}
+
+} // namespace subprocess
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+/*
+ * The hooks are compiled in with -DSUBPROCESS_TRACING=1, the SUBPROCESS_TRACING
+ * CMake option. Otherwise they expand to nothing, and the API below stays
+ * usable but never sees an event, and the counters stay 0.
+ */
+#ifndef SUBPROCESS_TRACING
+#define SUBPROCESS_TRACING 0
+#endif
+
+namespace subprocess
+{
+
+/** @brief True if the library was built with the tracing hooks. */
+constexpr bool kTracingEnabled = SUBPROCESS_TRACING != 0;
+
+/** @brief The steps of spawning and running a process, see TraceEvent. */
+enum class TracePhase
+{
+    find_program, ///< Looking up the program in PATH
+    env_block,    ///< Building an EnvBlock
+    pipe_create,  ///< Creating one pipe
+    spawn,        ///< The whole of starting a process, including the phases above it does
+    exec,         ///< Only the posix_spawn, fork or CreateProcess call
+    redirect,     ///< Handing a redirected stream over to the IoReactor
+    capture,      ///< Servicing input and output in run() or Popen::communicate()
+    wait,         ///< Waiting for the process to exit
+};
+
+constexpr std::size_t kTracePhaseCount = 8U;
+
+/** @brief Process-wide counters, see trace_counter(). */
+enum class TraceCounter
+{
+    spawns,               ///< Processes started
+    pipe_reads,           ///< pipe_read calls
+    pipe_writes,          ///< pipe_write calls
+    bytes_read,           ///< Bytes returned by pipe_read
+    bytes_written,        ///< Bytes accepted by pipe_write
+    cin_bytes,            ///< Bytes written to cin by run() and Popen::communicate()
+    cout_bytes,           ///< Bytes captured from cout by run(), communicate(), run_many() and async_run()
+    cerr_bytes,           ///< Bytes captured from cerr by run(), communicate(), run_many() and async_run()
+    program_cache_hits,   ///< find_program answered from its cache
+    program_cache_misses, ///< find_program scanning PATH
+};
+
+constexpr std::size_t kTraceCounterCount = 10U;
+
+/** @brief The name of phase, e.g. "find_program". */
+[[nodiscard]] std::string_view trace_phase_name(TracePhase phase);
+
+/** @brief The name of counter, e.g. "spawns". */
+[[nodiscard]] std::string_view trace_counter_name(TraceCounter counter);
+
+/** @brief One phase as it happened on one thread. */
+struct TraceEvent
+{
+    TracePhase phase;       // NOLINT
+    double begin;           ///< In seconds of a monotonic clock, the same for all events
+    double end;             // NOLINT
+    int64_t pid;            ///< Of the child, 0 if there is none yet
+    std::thread::id thread; // NOLINT
+};
+
+/**
+ * @brief Receives the events of the tracing hooks, see set_trace_sink().
+ *
+ * on_event is called on whichever thread finished the phase, often many at
+ * once, and must not throw.
+ */
+class TraceSink
+{
+public:
+    TraceSink() = default;
+    virtual ~TraceSink() = default;
+
+    TraceSink(const TraceSink&) = delete;
+    TraceSink& operator=(const TraceSink&) = delete;
+
+    virtual void on_event(const TraceEvent& event) = 0;
+};
+
+/**
+ * @brief Sets where the events of the tracing hooks go.
+ *
+ * Without a sink, the hooks only check a flag, and do not read the clock.
+ *
+ * @param sink The new sink, nullptr to stop tracing.
+ */
+void set_trace_sink(std::shared_ptr<TraceSink> sink);
+
+/** @brief The value of counter since the start, or the last trace_counters_reset(). */
+[[nodiscard]] uint64_t trace_counter(TraceCounter counter);
+
+/** @brief Sets all counters to 0. */
+void trace_counters_reset();
+
+/**
+ * @brief A TraceSink keeping the events in memory, and exporting them.
+ *
+ * @code
+ * auto recorder = std::make_shared<subprocess::TraceRecorder>();
+ * subprocess::set_trace_sink(recorder);
+ * ...
+ * std::ofstream{"trace.json"} << recorder->chrome_trace_json();
+ * @endcode
+ */
+class TraceRecorder final : public TraceSink
+{
+public:
+    /** @param capacity Events beyond this many are dropped, and counted. */
+    explicit TraceRecorder(std::size_t capacity = 100000U) : m_capacity(capacity)
+    {
+    }
+
+    void on_event(const TraceEvent& event) override;
+
+    /** @brief The events recorded, in the order they finished. */
+    [[nodiscard]] std::vector<TraceEvent> events() const;
+
+    /** @brief The number of events dropped as the recorder was full. */
+    [[nodiscard]] std::size_t dropped() const;
+
+    void clear();
+
+    /**
+     * @brief The events in the Chrome trace event format, for chrome://tracing
+     * or Perfetto. Threads are numbered in the order they were first seen.
+     */
+    [[nodiscard]] std::string chrome_trace_json() const;
+
+    /**
+     * @brief The counters, and the number and total seconds of the events per
+     * phase, in the Prometheus text exposition format.
+     */
+    [[nodiscard]] std::string prometheus_text() const;
+
+private:
+    mutable std::mutex m_mutex;
+    std::vector<TraceEvent> m_events;
+    std::size_t m_capacity;
+    std::size_t m_dropped{0U};
+};
+
+namespace details
+{
+/** @brief True if a sink is set. */
+[[nodiscard]] bool trace_active();
+
+/** @brief Seconds of the trace clock, StopWatch seconds since the first use. */
+[[nodiscard]] double trace_clock();
+
+/** @brief Passes an event that ends now to the sink, if any. */
+void trace_emit(TracePhase phase, double begin, int64_t pid);
+
+void trace_count(TraceCounter counter, uint64_t amount);
+
+/** @brief Emits an event for its lifetime, if a sink was set when it started. */
+class TraceScope
+{
+public:
+    explicit TraceScope(TracePhase phase, int64_t pid = 0)
+        : m_phase(phase), m_pid(pid), m_begin(trace_active() ? trace_clock() : -1.0)
+    {
+    }
+
+    ~TraceScope()
+    {
+        if (m_begin >= 0.0)
+        {
+            trace_emit(m_phase, m_begin, m_pid);
+        }
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    TracePhase m_phase;
+    int64_t m_pid;
+    double m_begin;
+};
+} // namespace details
+
+} // namespace subprocess
+
+#if SUBPROCESS_TRACING
+#define SUBPROCESS_TRACE_CONCAT2(a, b) a##b
+#define SUBPROCESS_TRACE_CONCAT(a, b) SUBPROCESS_TRACE_CONCAT2(a, b)
+/** @brief Traces the rest of the enclosing scope as phase, with an optional child pid. */
+#define SUBPROCESS_TRACE_SCOPE(...)                                                                                 \
+    const ::subprocess::details::TraceScope SUBPROCESS_TRACE_CONCAT(subprocess_trace_scope_, __LINE__)(__VA_ARGS__)
+/** @brief Adds amount to counter. */
+#define SUBPROCESS_TRACE_COUNT(counter, amount) ::subprocess::details::trace_count(counter, amount)
+#else
+#define SUBPROCESS_TRACE_SCOPE(...) static_cast<void>(0)
+#define SUBPROCESS_TRACE_COUNT(counter, amount) static_cast<void>(0)
+#endif
@@ -1,132 +1,326 @@
 #include "utf8_to_utf16.h"
 
-#ifdef _WIN32
-#include <memory>
-#include <string_view>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SUBPROCESS_UTF_SSE2
+#elif (defined(__ARM_NEON) && defined(__aarch64__)) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define SUBPROCESS_UTF_NEON
 #endif
 
 namespace subprocess
 {
 
-#ifndef _WIN32
-std::u16string utf8_to_utf16(const std::string& str)
+namespace
 {
-    std::wstring_convert<std::codecvt_utf8_utf16<char16_t>, char16_t> convert;
-    std::u16string dest = convert.from_bytes(str);
-    return dest;
-}
+constexpr char32_t kReplacement = 0xFFFDU;
 
-std::string utf16_to_utf8(const std::u16string& str)
+/** @brief Resizes target to size and lets fill write up to size elements, keeping what it returns. */
+template <typename Char, typename Fill>
+void overwrite(std::basic_string<Char>& target, std::size_t size, Fill fill)
 {
-    std::wstring_convert<std::codecvt_utf8_utf16<char16_t>, char16_t> convert;
-    std::string dest = convert.to_bytes(str);
-    return dest;
+#ifdef __cpp_lib_string_resize_and_overwrite
+    target.resize_and_overwrite(size, [&](Char* data, std::size_t) { return fill(data); });
+#else
+    target.resize(size);
+    target.resize(fill(target.data()));
+#endif
 }
 
-std::wstring utf8_to_utf16_w(const std::string& str)
+/**
+ * @brief Widens the ASCII prefix of input[0, size) to output.
+ * @return The length of the prefix converted, a multiple of 16 with SIMD.
+ */
+template <typename Char>
+std::size_t ascii_to_utf16(const unsigned char* input, std::size_t size, Char* output)
 {
-    std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>, wchar_t> convert;
-    std::wstring dest = convert.from_bytes(str);
-    return dest;
+    std::size_t i = 0U;
+    if constexpr (sizeof(Char) == 2U)
+    {
+#if defined(SUBPROCESS_UTF_SSE2)
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16U <= size; i += 16U)
+        {
+            __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i));
+            if (_mm_movemask_epi8(bytes) != 0)
+            {
+                break;
+            }
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(output + i), _mm_unpacklo_epi8(bytes, zero));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(output + i + 8U), _mm_unpackhi_epi8(bytes, zero));
+        }
+#elif defined(SUBPROCESS_UTF_NEON)
+        for (; i + 16U <= size; i += 16U)
+        {
+            uint8x16_t bytes = vld1q_u8(input + i);
+            if (vmaxvq_u8(bytes) >= 0x80U)
+            {
+                break;
+            }
+            vst1q_u16(reinterpret_cast<uint16_t*>(output + i), vmovl_u8(vget_low_u8(bytes)));
+            vst1q_u16(reinterpret_cast<uint16_t*>(output + i + 8U), vmovl_u8(vget_high_u8(bytes)));
+        }
+#endif
+    }
+    return i;
 }
 
-std::string utf16_to_utf8(const std::wstring& str)
+/**
+ * @brief Narrows the ASCII prefix of input[0, size) to output.
+ * @return The length of the prefix converted, a multiple of 8 with SIMD.
+ */
+template <typename Char>
+std::size_t ascii_to_utf8(const Char* input, std::size_t size, char* output)
 {
-    std::wstring_convert<std::codecvt_utf8_utf16<wchar_t>, wchar_t> convert;
-    std::string dest = convert.to_bytes(str);
-    return dest;
-}
+    std::size_t i = 0U;
+    if constexpr (sizeof(Char) == 2U)
+    {
+#if defined(SUBPROCESS_UTF_SSE2)
+        const __m128i high = _mm_set1_epi16(static_cast<short>(0xFF80));
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 8U <= size; i += 8U)
+        {
+            __m128i units = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input + i));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi16(_mm_and_si128(units, high), zero)) != 0xFFFF)
+            {
+                break;
+            }
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(output + i), _mm_packus_epi16(units, units));
+        }
+#elif defined(SUBPROCESS_UTF_NEON)
+        for (; i + 8U <= size; i += 8U)
+        {
+            uint16x8_t units = vld1q_u16(reinterpret_cast<const uint16_t*>(input + i));
+            if (vmaxvq_u16(units) >= 0x80U)
+            {
+                break;
+            }
+            vst1_u8(reinterpret_cast<uint8_t*>(output + i), vmovn_u16(units));
+        }
 #endif
+    }
+    return i;
+}
 
-#ifdef _WIN32
-
-std::u16string utf8_to_utf16(const std::string& input)
+/**
+ * @brief Decodes one UTF-8 sequence starting at input[i], advancing i.
+ *
+ * An invalid sequence gives U+FFFD and skips its longest valid prefix, at
+ * least one byte, as recommended by Unicode.
+ */
+char32_t decode_utf8(const unsigned char* input, std::size_t size, std::size_t& i)
 {
-    std::u16string result{};
+    unsigned char lead = input[i++];
+    if (lead < 0x80U)
+    {
+        return lead;
+    }
 
-    try
+    // The range of the second byte excludes overlong forms, surrogates and anything above U+10FFFF.
+    std::size_t needed = 0U;
+    char32_t code_point = 0U;
+    unsigned char low = 0x80U;
+    unsigned char high = 0xBFU;
+    if (lead >= 0xC2U && lead <= 0xDFU)
+    {
+        needed = 1U;
+        code_point = lead & 0x1FU;
+    }
+    else if (lead >= 0xE0U && lead <= 0xEFU)
+    {
+        needed = 2U;
+        code_point = lead & 0x0FU;
+        low = lead == 0xE0U ? 0xA0U : low;
+        high = lead == 0xEDU ? 0x9FU : high;
+    }
+    else if (lead >= 0xF0U && lead <= 0xF4U)
+    {
+        needed = 3U;
+        code_point = lead & 0x07U;
+        low = lead == 0xF0U ? 0x90U : low;
+        high = lead == 0xF4U ? 0x8FU : high;
+    }
+    else
     {
-        if (!input.empty())
+        return kReplacement;
+    }
+
+    for (; needed > 0U; --needed)
+    {
+        if (i >= size || input[i] < low || input[i] > high)
         {
-            auto size = input.size() + 1U;
-            auto buffer = std::make_unique<wchar_t[]>(size);
+            return kReplacement;
+        }
+        code_point = (code_point << 6U) | (input[i++] & 0x3FU);
+        low = 0x80U;
+        high = 0xBFU;
+    }
+
+    return code_point;
+}
+
+/** @brief Converts input to UTF-16 at output, which has room for input.size() code units. */
+template <typename Char>
+std::size_t utf8_to_utf16_into(std::string_view input, Char* output)
+{
+    const auto* bytes = reinterpret_cast<const unsigned char*>(input.data());
+    std::size_t size = input.size();
+    std::size_t i = 0U;
+    std::size_t n = 0U;
 
-            int n = MultiByteToWideChar(static_cast<UINT>(CP_UTF8),               //
-                                        static_cast<DWORD>(MB_ERR_INVALID_CHARS), //
-                                        input.c_str(),                            //
-                                        static_cast<int>(size),                   // Size in bytes of the source
-                                        buffer.get(),                             //
-                                        static_cast<int>(size));                  // Size in wide chars
+    while (i < size)
+    {
+        std::size_t ascii = ascii_to_utf16(bytes + i, size - i, output + n);
+        i += ascii;
+        n += ascii;
+
+        // One sequence at a time, until the input is back at an ASCII character a vector may start with.
+        while (i < size)
+        {
+            char32_t code_point = decode_utf8(bytes, size, i);
+            if (code_point >= 0x10000U)
+            {
+                code_point -= 0x10000U;
+                output[n++] = static_cast<Char>(0xD800U + (code_point >> 10U));
+                output[n++] = static_cast<Char>(0xDC00U + (code_point & 0x3FFU));
+            }
+            else
+            {
+                output[n++] = static_cast<Char>(code_point);
+            }
 
-            if (n > 0)
+            if (i < size && bytes[i] < 0x80U)
             {
-                (void)result.assign(buffer.get(), buffer.get() + n - 1);
+                break;
             }
         }
     }
-    catch (const std::bad_alloc&)
-    {
-        SetLastError(static_cast<UINT>(ERROR_NOT_ENOUGH_MEMORY));
-    }
 
-    return result;
+    return n;
 }
 
-#ifdef __MINGW32__
-// mingw doesn't define this
-constexpr int WC_ERR_INVALID_CHARS = 0;
-#endif
-
-std::string utf16_to_utf8(const std::u16string& input)
+/** @brief Converts UTF-16 input to UTF-8 at output, which has room for 3 bytes per code unit. */
+template <typename Char>
+std::size_t utf16_to_utf8_into(std::basic_string_view<Char> input, char* output)
 {
-    std::string result{};
+    std::size_t size = input.size();
+    std::size_t i = 0U;
+    std::size_t n = 0U;
+
+    auto put = [&](std::uint32_t byte) { output[n++] = static_cast<char>(byte); };
 
-    try
+    while (i < size)
     {
-        if (!input.empty())
+        std::size_t ascii = ascii_to_utf8(input.data() + i, size - i, output + n);
+        i += ascii;
+        n += ascii;
+
+        while (i < size)
         {
-            auto size = input.size() + 1U;
-            int r = WideCharToMultiByte(static_cast<UINT>(CP_UTF8),                      //
-                                        static_cast<DWORD>(WC_ERR_INVALID_CHARS),        //
-                                        reinterpret_cast<const wchar_t*>(input.c_str()), //
-                                        static_cast<int>(size),                          //
-                                        nullptr,                                         //
-                                        0,                                               //
-                                        nullptr,                                         //
-                                        nullptr);
-
-            if (r > 0)
+            // Only the low 16 bits count, a 32-bit wchar_t holds UTF-16 code units as well.
+            auto unit = static_cast<std::uint32_t>(input[i++]) & 0xFFFFU;
+            std::uint32_t code_point = unit;
+            if (unit >= 0xD800U && unit <= 0xDFFFU)
             {
-                auto buffer = std::make_unique<char[]>(static_cast<size_t>(r));
-                int m = WideCharToMultiByte(static_cast<UINT>(CP_UTF8),                      //
-                                            0U,                                              //
-                                            reinterpret_cast<const wchar_t*>(input.c_str()), //
-                                            static_cast<int>(size),                          //
-                                            buffer.get(),                                    //
-                                            r,                                               //
-                                            nullptr,                                         //
-                                            nullptr);
-
-                if (m > 0)
+                std::uint32_t next = i < size ? static_cast<std::uint32_t>(input[i]) & 0xFFFFU : 0U;
+                if (unit <= 0xDBFFU && next >= 0xDC00U && next <= 0xDFFFU)
+                {
+                    code_point = 0x10000U + ((unit - 0xD800U) << 10U) + (next - 0xDC00U);
+                    ++i;
+                }
+                else
                 {
-                    (void)result.assign(buffer.get(), buffer.get() + m - 1);
+                    code_point = kReplacement;
                 }
             }
+
+            if (code_point < 0x80U)
+            {
+                put(code_point);
+            }
+            else if (code_point < 0x800U)
+            {
+                put(0xC0U | (code_point >> 6U));
+                put(0x80U | (code_point & 0x3FU));
+            }
+            else if (code_point < 0x10000U)
+            {
+                put(0xE0U | (code_point >> 12U));
+                put(0x80U | ((code_point >> 6U) & 0x3FU));
+                put(0x80U | (code_point & 0x3FU));
+            }
+            else
+            {
+                put(0xF0U | (code_point >> 18U));
+                put(0x80U | ((code_point >> 12U) & 0x3FU));
+                put(0x80U | ((code_point >> 6U) & 0x3FU));
+                put(0x80U | (code_point & 0x3FU));
+            }
+
+            if (i < size && (static_cast<std::uint32_t>(input[i]) & 0xFFFFU) < 0x80U)
+            {
+                break;
+            }
         }
     }
-    catch (const std::bad_alloc&)
-    {
-        SetLastError(static_cast<UINT>(ERROR_NOT_ENOUGH_MEMORY));
-    }
 
+    return n;
+}
+
+template <typename Char>
+void utf8_to_utf16_append_t(std::string_view input, std::basic_string<Char>& output)
+{
+    // No sequence yields more code units than it has bytes.
+    std::size_t offset = output.size();
+    overwrite(output, offset + input.size(),
+              [&](Char* data) { return offset + utf8_to_utf16_into(input, data + offset); });
+}
+
+template <typename Char>
+std::string utf16_to_utf8_t(std::basic_string_view<Char> input)
+{
+    // A surrogate pair takes 4 bytes, everything else at most 3 per code unit.
+    std::string result;
+    overwrite(result, input.size() * 3U, [&](char* data) { return utf16_to_utf8_into(input, data); });
+    return result;
+}
+} // namespace
+
+std::u16string utf8_to_utf16(std::string_view input)
+{
+    std::u16string result;
+    utf8_to_utf16_append_t(input, result);
     return result;
 }
 
-std::string utf16_to_utf8(const std::wstring& input)
+void utf8_to_utf16_append(std::string_view input, std::u16string& output)
 {
-    return utf16_to_utf8(std::u16string{reinterpret_cast<const char16_t*>(input.c_str()), input.size()});
+    utf8_to_utf16_append_t(input, output);
 }
 
+std::string utf16_to_utf8(std::u16string_view input)
+{
+    return utf16_to_utf8_t(input);
+}
+
+std::wstring utf8_to_utf16_w(std::string_view input)
+{
+    std::wstring result;
+    utf8_to_utf16_append_t(input, result);
+    return result;
+}
+
+std::string utf16_to_utf8(std::wstring_view input)
+{
+    return utf16_to_utf8_t(input);
+}
+
+#ifdef _WIN32
+
 [[maybe_unused]] size_t strlen16(char16_t* input)
 {
     size_t size = 0U;
@@ -1,4 +1,5 @@
 #include <string>
+#include <string_view>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -6,33 +7,51 @@
 
 namespace subprocess
 {
+/*
+ * The conversions below write straight into the resulting string, with runs
+ * of ASCII converted 16 characters at a time using SSE2 or NEON where
+ * available. Invalid input, such as overlong or truncated UTF-8 sequences
+ * and unpaired surrogates, is replaced with U+FFFD.
+ */
+
 /**
  * @brief Convert UTF-8 encoded string to UTF-16 encoded string.
  * @param input The input UTF-8 string.
  * @return UTF-16 encoded string.
  */
-std::u16string utf8_to_utf16(const std::string& input);
+std::u16string utf8_to_utf16(std::string_view input);
+
+/**
+ * @brief Appends UTF-8 input to output as UTF-16, e.g. to build a block of
+ * many strings without temporaries.
+ * @param input The input UTF-8 string.
+ * @param output The UTF-16 string to append to.
+ */
+void utf8_to_utf16_append(std::string_view input, std::u16string& output);
 
 /**
  * @brief Convert UTF-16 encoded string to UTF-8 encoded string.
  * @param input The input UTF-16 string.
  * @return UTF-8 encoded string.
  */
-std::string utf16_to_utf8(const std::u16string& input);
+std::string utf16_to_utf8(std::u16string_view input);
 
 /**
  * @brief Convert UTF-8 encoded string to UTF-16 encoded wide string.
+ *
+ * Where wchar_t has 32 bits, the result still holds UTF-16 code units.
+ *
  * @param input The input UTF-8 string.
  * @return UTF-16 encoded wide string.
  */
-std::wstring utf8_to_utf16_w(const std::string& input);
+std::wstring utf8_to_utf16_w(std::string_view input);
 
 /**
  * @brief Convert UTF-16 encoded wide string to UTF-8 encoded string.
  * @param input The input UTF-16 wide string.
  * @return UTF-8 encoded string.
  */
-std::string utf16_to_utf8(const std::wstring& input);
+std::string utf16_to_utf8(std::wstring_view input);
 
 /**
  * @brief Calculate the length of a UTF-16 encoded string (char16_t array).
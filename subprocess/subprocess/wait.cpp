@@ -0,0 +1,71 @@
+#include "wait.h"
+
+#include <algorithm>
+
+#include "exit_watcher.h"
+
+namespace subprocess
+{
+
+namespace
+{
+/** @brief True if popen is a started process that has not been waited for. */
+bool is_running(const Popen* popen)
+{
+    return popen != nullptr && popen->pid != 0 && popen->returncode == kBadReturnCode;
+}
+} // namespace
+
+std::vector<std::size_t> wait_any(std::span<Popen* const> popens, double timeout)
+{
+    std::vector<std::size_t> result;
+    for (std::size_t i = 0U; i < popens.size(); ++i)
+    {
+        if (popens[i] != nullptr && popens[i]->pid != 0 && !is_running(popens[i]))
+        {
+            result.push_back(i);
+        }
+    }
+
+    if (!result.empty())
+    {
+        return result;
+    }
+
+    details::ExitWatcher watcher;
+    for (std::size_t i = 0U; i < popens.size(); ++i)
+    {
+        if (is_running(popens[i]))
+        {
+            watcher.add(*popens[i], i);
+        }
+    }
+
+    result = watcher.wait(timeout);
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+bool wait_all(std::span<Popen* const> popens, double timeout)
+{
+    details::ExitWatcher watcher;
+    for (std::size_t i = 0U; i < popens.size(); ++i)
+    {
+        if (is_running(popens[i]))
+        {
+            watcher.add(*popens[i], i);
+        }
+    }
+
+    StopWatch watch;
+    while (!watcher.empty())
+    {
+        if (watcher.wait(watch.remaining(timeout)).empty() && watch.expired(timeout))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+} // namespace subprocess
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cstddef>
+#include <span>
+#include <vector>
+
+#include "builder.h"
+
+namespace subprocess
+{
+
+/**
+ * @brief Waits until at least one of the processes has exited, or the timeout
+ * expires.
+ *
+ * The calling thread sleeps until an exit happens instead of polling each
+ * process, see details::ExitWatcher. Processes that exit are reaped, so their
+ * returncode is set. Processes already waited for count as exited right away,
+ * empty ones and nullptr are skipped. What the wait needs per process is set
+ * up once and kept by the Popen, so calling this in a loop is cheap.
+ *
+ * @param popens The processes to wait for.
+ * @param timeout Timeout in seconds, negative to wait forever.
+ * @return The indices into popens of the exited processes, in ascending
+ * order. Empty on timeout, or if there is nothing to wait for.
+ * @throws OSError If there was an OS-level error.
+ */
+std::vector<std::size_t> wait_any(std::span<Popen* const> popens, double timeout = -1.0);
+
+/**
+ * @brief Waits until all of the processes have exited, or the timeout
+ * expires.
+ *
+ * Like wait_any(), without a wake-up per process that is still running.
+ *
+ * @param popens The processes to wait for.
+ * @param timeout Timeout in seconds, negative to wait forever.
+ * @return False if the timeout expired first.
+ * @throws OSError If there was an OS-level error.
+ */
+bool wait_all(std::span<Popen* const> popens, double timeout = -1.0);
+
+} // namespace subprocess
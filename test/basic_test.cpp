@@ -7,7 +7,13 @@
 #include <doctest/doctest.h>
 // clang-format on
 
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
 #include <filesystem>
+#include <fstream>
+#include <set>
+#include <sstream>
 #include <subprocess.h>
 #include <thread>
 
@@ -73,6 +79,22 @@ TEST_CASE("TEST_CASE - utilities")
         CHECK_EQ(utf8Str, utf8StrNew);
     }
 
+    SUBCASE("can convert long and invalid utf8")
+    {
+        // Long enough for the vectorized ASCII path, with every sequence length in between.
+        std::string ascii(100U, 'a');
+        std::string utf8 = ascii + reinterpret_cast<const char*>(u8"\u00E9\u4F60\U0001F600") + ascii;
+        std::u16string utf16 = subprocess::utf8_to_utf16(utf8);
+        CHECK_EQ(utf16, std::u16string(100U, u'a') + u"\u00E9\u4F60\U0001F600" + std::u16string(100U, u'a'));
+        CHECK_EQ(subprocess::utf16_to_utf8(utf16), utf8);
+
+        // Overlong, surrogate, truncated and stray continuation bytes become U+FFFD.
+        CHECK_EQ(subprocess::utf8_to_utf16("a\xC0\xAF" "b\xED\xA0\x80" "c\xE4\xBD"),
+                 u"a\uFFFD\uFFFDb\uFFFD\uFFFD\uFFFDc\uFFFD");
+        CHECK_EQ(subprocess::utf16_to_utf8(std::u16string{u'x', static_cast<char16_t>(0xD800U), u'y'}),
+                 reinterpret_cast<const char*>(u8"x\uFFFDy"));
+    }
+
     SUBCASE("will have RAII for env guard")
     {
         std::string path = cenv["PATH"];
@@ -95,12 +117,96 @@ TEST_CASE("TEST_CASE - utilities")
         CHECK_EQ(path, new_path);
     }
 
+    SUBCASE("can share a snapshot of the environment")
+    {
+        subprocess::EnvGuard guard;
+        auto before = subprocess::EnvSnapshot::current();
+        CHECK_EQ(subprocess::EnvSnapshot::current(), before);
+        CHECK_EQ(before->get("PATH"), std::optional<std::string_view>(cenv["PATH"].to_string()));
+        CHECK_EQ(before->to_map(), subprocess::current_env_copy());
+
+        subprocess::cenv["HELLO"] = "world";
+        auto after = subprocess::EnvSnapshot::current();
+        CHECK(after->version() > before->version());
+        CHECK_EQ(after->get("HELLO"), std::optional<std::string_view>("world"));
+        CHECK_FALSE(before->get("HELLO").has_value());
+        CHECK_EQ(subprocess::EnvBlock().with({}).to_map(), after->to_map());
+        CHECK(std::is_sorted(after->entries().begin(), after->entries().end(),
+                             [](const auto& a, const auto& b) { return a.name < b.name; }));
+    }
+
+#ifndef _WIN32
+    SUBCASE("will undo changes made around cenv")
+    {
+        {
+            subprocess::EnvGuard guard;
+            ::setenv("SUBPROCESS_GUARD_PROBE", "1", 1);
+        }
+        CHECK(std::getenv("SUBPROCESS_GUARD_PROBE") == nullptr);
+
+        // A change made before the guard is part of what it restores.
+        ::setenv("SUBPROCESS_GUARD_PROBE", "2", 1);
+        {
+            subprocess::EnvGuard guard;
+            subprocess::cenv["SUBPROCESS_GUARD_PROBE"] = "3";
+        }
+        CHECK_EQ(std::string_view(std::getenv("SUBPROCESS_GUARD_PROBE")), "2");
+        ::unsetenv("SUBPROCESS_GUARD_PROBE");
+    }
+#endif
+
     SUBCASE("can find a specified program")
     {
         std::string path = subprocess::find_program("echo");
         CHECK(!path.empty());
     }
 
+    SUBCASE("will cache programs per PATH value")
+    {
+        subprocess::EnvGuard guard;
+        subprocess::find_program_clear_cache();
+
+        std::filesystem::path dir = std::filesystem::temp_directory_path() / "subprocess-cache-test";
+        std::filesystem::create_directories(dir);
+#ifdef _WIN32
+        std::filesystem::path program = dir / "cache-probe.exe";
+#else
+        std::filesystem::path program = dir / "cache-probe";
+#endif
+        std::filesystem::remove(program);
+        CHECK(subprocess::find_program("cache-probe").empty());
+
+        // A miss is cached until PATH changes, or the cache is cleared.
+        std::ofstream{program}.close();
+        CHECK(subprocess::find_program("cache-probe").empty());
+        subprocess::cenv["PATH"] = dir.string() + subprocess::kPathDelimiter + subprocess::cenv["PATH"].to_string();
+        CHECK(!subprocess::find_program("cache-probe").empty());
+
+        std::filesystem::remove(program);
+        CHECK(!subprocess::find_program("cache-probe").empty());
+        subprocess::find_program_clear_cache();
+        CHECK(subprocess::find_program("cache-probe").empty());
+        std::filesystem::remove(dir);
+    }
+
+    SUBCASE("can read the python version of a virtual environment")
+    {
+        std::filesystem::path dir = std::filesystem::temp_directory_path() / "subprocess-venv-test";
+#ifdef _WIN32
+        std::filesystem::path python = dir / "Scripts" / "python.exe";
+#else
+        std::filesystem::path python = dir / "bin" / "python";
+#endif
+        std::filesystem::create_directories(python.parent_path());
+        std::ofstream{python}.close();
+        std::ofstream{dir / "pyvenv.cfg"} << "home = /usr/bin\nversion_info = 3.11.4.final.0\n";
+
+        // The interpreter is an empty file, so running it would fail.
+        CHECK_EQ(subprocess::python_version(python.string()), "3.11.4");
+        CHECK_EQ(subprocess::probe_program(""), "");
+        std::filesystem::remove_all(dir);
+    }
+
     SUBCASE("can sleep")
     {
         subprocess::StopWatch sw{};
@@ -108,6 +214,38 @@ TEST_CASE("TEST_CASE - utilities")
         auto delta = sw.seconds() - 1.0f;
         CHECK(abs(delta) <= 0.1f);
     }
+
+    SUBCASE("can time from many threads")
+    {
+        std::atomic<bool> ordered{true};
+        std::vector<std::thread> threads;
+        for (int i = 0; i < 4; ++i)
+        {
+            threads.emplace_back(
+                [&ordered]
+                {
+                    auto last = subprocess::StopWatch::now();
+                    for (int j = 0; j < 10000; ++j)
+                    {
+                        auto now = subprocess::StopWatch::now();
+                        ordered = ordered && now >= last;
+                        last = now;
+                    }
+                });
+        }
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+        CHECK(ordered);
+
+        subprocess::StopWatch sw{};
+        CHECK_EQ(sw.remaining(-1.0), -1.0);
+        CHECK(!sw.expired(-1.0));
+        CHECK(sw.remaining(1e12) > 0.0);
+        CHECK(sw.expired(0.0));
+        CHECK_EQ(sw.remaining(0.0), 0.0);
+    }
 }
 
 TEST_CASE("TEST_CASE - popen")
@@ -140,6 +278,22 @@ TEST_CASE("TEST_CASE - popen")
                         subprocess::TimeoutExpired);
     }
 
+    SUBCASE("can kill a process tree of a job object")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+        auto popen = RunBuilder({"sleep", "10"}).job_object(true).popen();
+#ifdef _WIN32
+        CHECK_EQ(popen.resource_usage().process_count, 1U);
+#else
+        CHECK_EQ(getpgid(popen.pid), popen.pid);
+#endif
+        subprocess::StopWatch timer;
+        CHECK(popen.kill());
+        CHECK_NE(popen.wait(), 0);
+        CHECK(timer.seconds() < 5.0);
+    }
+
     SUBCASE("can wait timeout")
     {
         subprocess::EnvGuard guard;
@@ -150,6 +304,31 @@ TEST_CASE("TEST_CASE - popen")
         (void)popen.close();
     }
 
+    SUBCASE("can wait for any or all of many processes")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+        Popen slow = RunBuilder({"sleep", "2"}).popen();
+        Popen fast = RunBuilder({"sleep", "0"}).popen();
+        std::vector<Popen*> popens{&slow, nullptr, &fast};
+
+        subprocess::StopWatch timer;
+        CHECK_EQ(subprocess::wait_any(popens), std::vector<std::size_t>{2U});
+        CHECK(timer.seconds() < 1.5);
+        CHECK_EQ(fast.returncode, 0);
+        CHECK_EQ(subprocess::wait_any(popens, 5.0), std::vector<std::size_t>{2U}); // already exited
+
+        CHECK_FALSE(subprocess::wait_all(popens, 0.1));
+        // A supervisor loop, whose waits reuse what the first one set up.
+        std::vector<Popen*> running{&slow};
+        for (int i = 0; i < 100; ++i)
+        {
+            CHECK(subprocess::wait_any(running, 0.0).empty());
+        }
+        CHECK(subprocess::wait_all(popens));
+        CHECK_EQ(slow.returncode, 0);
+    }
+
     SUBCASE("can kill")
     {
         subprocess::EnvGuard guard;
@@ -235,6 +414,101 @@ TEST_CASE("TEST_CASE - popen")
         c.close();
         CHECK_EQ(p.cout, "hello world" EOL);
     }
+
+    SUBCASE("can read a subprocess through an overlapped pipe")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        subprocess::PipePair pp = subprocess::pipe_create_overlapped(false);
+#ifdef _WIN32
+        CHECK(subprocess::pipe_is_overlapped(pp.input));
+#else
+        CHECK_FALSE(subprocess::pipe_is_overlapped(pp.input));
+#endif
+        CHECK_FALSE(subprocess::pipe_is_overlapped(pp.output));
+
+        subprocess::Popen e = RunBuilder({"echo", "hello", "world"}).cout(pp.output).popen();
+        pp.close_output();
+
+        std::string output;
+        auto done = std::make_shared<subprocess::IoCompletion>();
+        subprocess::IoReactor::instance().add(std::make_unique<subprocess::PipeToString>(pp.input, output), done);
+        pp.disown(); // the reactor closes the input end
+        CHECK(done->wait(10.0));
+        CHECK_EQ(e.wait(), 0);
+        CHECK_EQ(output, "hello world" EOL);
+    }
+
+    SUBCASE("can run a pipeline")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        std::string data(256U * 1024U, 'x');
+        auto pipeline = RunBuilder({"cat"}).cin(data) | RunBuilder({"cat", "--output-stderr"}).cerr(PipeOption::cout) |
+                        RunBuilder({"cat"}).cout(PipeOption::pipe);
+        std::vector<CompletedProcess> stages = pipeline.run();
+        REQUIRE_EQ(stages.size(), 3U);
+        CHECK(stages.back().cout == data);
+        for (auto& stage : stages)
+        {
+            CHECK_EQ(stage.returncode, 0);
+        }
+        CHECK(is_equal(stages[1].args, {"cat", "--output-stderr"}));
+    }
+
+    SUBCASE("will not wait for input of a pipeline with a piped cin")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        auto pipeline = RunBuilder({"cat"}).cin(PipeOption::pipe) | RunBuilder({"cat"}).cout(PipeOption::pipe);
+        std::vector<CompletedProcess> stages = pipeline.run();
+        REQUIRE_EQ(stages.size(), 2U);
+        CHECK(stages.back().cout.empty());
+        CHECK_EQ(stages.front().returncode, 0);
+    }
+
+    SUBCASE("can communicate with a subprocess")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        auto popen = RunBuilder({"cat"}).cin(PipeOption::pipe).cout(PipeOption::pipe).popen();
+        auto [out, err] = popen.communicate("hello world");
+        CHECK_EQ(out, "hello world");
+        CHECK(err.empty());
+        CHECK_EQ(popen.cin, kBadPipeValue);
+        CHECK_EQ(popen.cout, kBadPipeValue);
+        CHECK_EQ(popen.wait(), 0);
+    }
+
+    SUBCASE("can redirect many subprocesses to streams at once")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        constexpr int count = 16;
+        std::string data(256U * 1024U, 'x');
+        std::vector<std::istringstream> inputs;
+        std::vector<std::ostringstream> outputs(count);
+        std::vector<subprocess::Popen> popens;
+        for (int i = 0; i < count; ++i)
+        {
+            inputs.emplace_back(data + std::to_string(i));
+        }
+        for (int i = 0; i < count; ++i)
+        {
+            popens.push_back(RunBuilder({"cat"}).cin(&inputs[i]).cout(&outputs[i]).popen());
+        }
+
+        for (int i = 0; i < count; ++i)
+        {
+            popens[i].close();
+            CHECK(outputs[i].str() == data + std::to_string(i));
+        }
+    }
 }
 
 TEST_CASE("TEST_CASE - subprocess::run")
@@ -265,6 +539,282 @@ TEST_CASE("TEST_CASE - subprocess::run")
         CHECK(is_equal(args, cp.args));
     }
 
+    SUBCASE("can send and capture more than a pipe buffer")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        std::string data(1024U * 1024U, 'x');
+        auto cp = subprocess::run({"cat", "--output-stderr"},
+                                  {.cin = data, .cout = PipeOption::pipe, .cerr = PipeOption::pipe});
+        CHECK_EQ(cp.cerr.size(), data.size());
+        CHECK(cp.cerr == data);
+        CHECK(cp.cout.empty());
+    }
+
+    SUBCASE("can reserve output with a size hint")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        std::string data(512U * 1024U, 'x');
+        auto cp = RunBuilder({"cat"}).cin(data).cout(PipeOption::pipe).cout_size_hint(data.size()).run();
+        CHECK(cp.cout == data);
+        CHECK_GE(cp.cout.capacity(), data.size());
+    }
+
+    SUBCASE("can hand a FILE* to the subprocess")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        FILE* input = std::tmpfile();
+        FILE* output = std::tmpfile();
+        REQUIRE(input != nullptr);
+        REQUIRE(output != nullptr);
+        std::fputs("skipped hello world", input);
+        std::rewind(input);
+        std::fgetc(input); // leaves the rest of the file in the stream's buffer
+        std::fseek(input, 8L, SEEK_SET);
+        std::fputs("cout:", output);
+
+        auto cp = RunBuilder({"cat"}).cin(input).cout(output).run();
+        CHECK_EQ(cp.returncode, 0);
+
+        std::string result(64U, '\0');
+        std::rewind(output);
+        result.resize(std::fread(result.data(), 1U, result.size(), output));
+        CHECK_EQ(result, "cout:hello world");
+        std::fclose(input);
+        std::fclose(output);
+    }
+
+    SUBCASE("can stream output to a callback")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        std::vector<std::string> lines;
+        auto cp = RunBuilder({"cat"})
+                      .cin("first\nsecond\r\n\nlast\r")
+                      .cout(OutputCallback::lines([&lines](std::string_view line) { lines.emplace_back(line); }))
+                      .run();
+        CHECK_EQ(cp.returncode, 0);
+        CHECK(cp.cout.empty());
+        CHECK_EQ(lines, std::vector<std::string>{"first", "second", "", "last"});
+
+        std::string chunks;
+        Popen popen = RunBuilder({"echo", "hello", "world"})
+                          .cout(OutputCallback::chunks([&chunks](std::string_view chunk) { chunks += chunk; }))
+                          .popen();
+        popen.close();
+        CHECK_EQ(chunks, "hello world" EOL);
+    }
+
+    SUBCASE("can tee output to several sinks")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        std::string data(1U << 20U, 'x');
+        data += "\nlast";
+        std::string captured;
+        std::ostringstream logged;
+        std::vector<std::string> lines;
+        auto cp = RunBuilder({"cat"})
+                      .cin(data)
+                      .cout(subprocess::Tee{
+                          {&captured, &logged,
+                           OutputCallback::lines([&lines](std::string_view line) { lines.emplace_back(line); })}})
+                      .run();
+        CHECK_EQ(cp.returncode, 0);
+        CHECK(cp.cout.empty());
+        CHECK(captured == data);
+        CHECK(logged.str() == data);
+        REQUIRE_EQ(lines.size(), 2U);
+        CHECK_EQ(lines[1], "last");
+
+        // A sink that reads only after the child is done is a whole 64 KiB buffer behind.
+        for (auto policy : {subprocess::Backpressure::block, subprocess::Backpressure::drop,
+                            subprocess::Backpressure::spill})
+        {
+            subprocess::PipePair pp = subprocess::pipe_create(false);
+            std::string received;
+            std::thread reader(
+                [&pp, &received]
+                {
+                    sleep_seconds(0.2);
+                    received = subprocess::pipe_read_all(pp.input);
+                });
+
+            captured.clear();
+            subprocess::Tee tee({&captured, pp.output}, policy, 64U * 1024U);
+            cp = RunBuilder({"cat"}).cin(data).cout(tee).run();
+            // The caller's handle is left in the mode it had.
+            CHECK(subprocess::pipe_is_blocking(pp.output));
+            pp.close_output();
+            reader.join();
+
+            CHECK(captured == data);
+            if (policy == subprocess::Backpressure::drop)
+            {
+                CHECK_GT(tee.dropped(), 0U);
+                CHECK_EQ(received.size() + tee.dropped(), data.size());
+            }
+            else
+            {
+                CHECK_EQ(tee.dropped(), 0U);
+                CHECK(received == data);
+            }
+        }
+    }
+
+    SUBCASE("can pass input without copying it")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        std::string data(1U << 20U, 'x');
+        auto cp = RunBuilder({"cat"}).cin(std::as_bytes(std::span{data})).cout(PipeOption::pipe).run();
+        CHECK_EQ(cp.cout, data);
+
+        auto shared = std::make_shared<const std::string>("shared input");
+        std::ostringstream output;
+        Popen popen = RunBuilder({"cat"}).cin(shared).cout(&output).popen();
+        popen.close();
+        CHECK_EQ(output.str(), "shared input");
+
+        Popen moved({"cat"}, RunOptions{.cin = std::string("moved input"), .cout = &output});
+        moved.close();
+        CHECK_EQ(output.str(), "shared inputmoved input");
+    }
+
+    SUBCASE("can stream input from a producer")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        // Many small records are batched, the large one is written in place, partially while cat catches up.
+        std::vector<std::string> records;
+        for (int i = 0; i < 20000; ++i)
+        {
+            records.push_back(std::to_string(i) + '\n');
+        }
+        records.insert(records.begin() + 10000, std::string(1U << 20U, 'x'));
+
+        std::size_t next = 0U;
+        std::string expected;
+        for (const auto& record : records)
+        {
+            expected += record;
+        }
+
+        auto cp = RunBuilder({"cat"})
+                      .cin(subprocess::InputProducer(
+                          [&records, &next]()
+                          {
+                              return next < records.size() ? std::as_bytes(std::span{records[next++]})
+                                                           : std::span<const std::byte>{};
+                          }))
+                      .cout(PipeOption::pipe)
+                      .run();
+        CHECK_EQ(cp.returncode, 0);
+        CHECK_EQ(next, records.size());
+        CHECK(cp.cout == expected);
+    }
+
+    SUBCASE("can capture output into a mapped file")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        std::string data(1U << 20U, 'x');
+        auto cp = RunBuilder({"cat"}).cin(std::as_bytes(std::span{data})).cout(PipeOption::mmap_file).run();
+        CHECK_EQ(cp.returncode, 0);
+        CHECK(cp.cout.empty());
+        CHECK_EQ(cp.cout_file.view(), data);
+
+        cp = RunBuilder({"echo"}).cout(PipeOption::none).cerr(PipeOption::mmap_file).run();
+        CHECK(cp.cerr_file.empty());
+        CHECK_THROWS_AS((void)RunBuilder({"cat"}).cin(PipeOption::mmap_file).popen(), std::domain_error);
+    }
+
+    SUBCASE("can run a subprocess on a pseudo-terminal")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        auto cp = RunBuilder({"echo", "hello", "world"}).cout(PipeOption::pty).run();
+        CHECK_EQ(cp.returncode, 0);
+#ifndef _WIN32
+        CHECK_EQ(cp.cout, "hello world\r\n");
+
+        // Input is not echoed, and ends with the end-of-file character of the terminal.
+        std::string streamed;
+        Popen popen = RunBuilder({"cat"})
+                          .cin("line\n\x04")
+                          .cout(OutputCallback::chunks([&streamed](std::string_view chunk) { streamed += chunk; }))
+                          .pty({.columns = 120U, .rows = 40U})
+                          .popen();
+        CHECK(popen.resize_pty({.columns = 100U, .rows = 30U}));
+        CHECK_EQ(popen.wait(), 0);
+        popen.close();
+        CHECK_EQ(streamed, "line\r\n");
+        CHECK_FALSE(popen.resize_pty({}));
+#endif
+    }
+
+    SUBCASE("can limit and measure resources")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        ResourceLimits limits{.cpu_seconds = 10.0, .open_files = 64U};
+#if defined(_WIN32) || defined(__linux__)
+        limits.cpus = {0};
+#endif
+        auto cp = RunBuilder({"sleep", "1"}).limits(limits).run();
+        CHECK_EQ(cp.returncode, 0);
+        CHECK(cp.usage.wall_seconds >= 0.9);
+        CHECK(cp.usage.wall_seconds < 5.0);
+        CHECK(cp.usage.max_rss > 0U);
+        CHECK_THROWS_AS((void)RunBuilder({"sleep", "1"}).limits({.cpus = {-1}}).run(), std::invalid_argument);
+    }
+
+    SUBCASE("can trace the phases of a spawn")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        auto recorder = std::make_shared<subprocess::TraceRecorder>();
+        subprocess::trace_counters_reset();
+        subprocess::set_trace_sink(recorder);
+        auto cp = subprocess::run({"echo", "hello"}, {.cout = PipeOption::pipe});
+        subprocess::set_trace_sink(nullptr);
+
+        std::set<std::string_view> phases;
+        for (const auto& event : recorder->events())
+        {
+            CHECK(event.end >= event.begin);
+            phases.insert(subprocess::trace_phase_name(event.phase));
+        }
+
+        if constexpr (subprocess::kTracingEnabled)
+        {
+            CHECK_EQ(phases, std::set<std::string_view>{"find_program", "spawn", "exec", "capture", "wait",
+                                                        "pipe_create", "redirect"});
+            CHECK_EQ(subprocess::trace_counter(subprocess::TraceCounter::spawns), 1U);
+            CHECK_EQ(subprocess::trace_counter(subprocess::TraceCounter::cout_bytes), cp.cout.size());
+            CHECK_NE(recorder->chrome_trace_json().find(R"("name":"exec")"), std::string::npos);
+            CHECK_NE(recorder->prometheus_text().find("subprocess_spawns_total 1\n"), std::string::npos);
+        }
+        else
+        {
+            CHECK(phases.empty());
+            CHECK_EQ(subprocess::trace_counter(subprocess::TraceCounter::spawns), 0U);
+        }
+    }
+
     SUBCASE("will throw on not found")
     {
         CHECK_THROWS(subprocess::run({"yay-322"}));
@@ -295,6 +845,204 @@ TEST_CASE("TEST_CASE - subprocess::run")
     }
 }
 
+TEST_CASE("TEST_CASE - subprocess::run_many")
+{
+    SUBCASE("can run many commands with bounded parallelism")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        std::vector<RunBuilder> jobs;
+        for (int i = 0; i < 40; ++i)
+        {
+            jobs.push_back(RunBuilder({"cat"}).cin("job " + std::to_string(i)).cout(PipeOption::pipe));
+        }
+
+        std::vector<CompletedProcess> results = subprocess::run_many(jobs, 4U);
+        REQUIRE_EQ(results.size(), jobs.size());
+        for (int i = 0; i < 40; ++i)
+        {
+            CHECK_EQ(results[i].returncode, 0);
+            CHECK_EQ(results[i].cout, "job " + std::to_string(i));
+        }
+    }
+
+    SUBCASE("will throw for the first failed job")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        std::vector<RunBuilder> jobs{RunBuilder({"echo", "ok"}).cout(PipeOption::pipe),
+                                     RunBuilder({"sleep", "3"}).timeout(0.1),
+                                     RunBuilder({"cat"}).cin(PipeOption::close).raise_on_nonzero(true)};
+        StopWatch watch;
+        CHECK_THROWS_AS(subprocess::run_many(jobs), TimeoutExpired);
+        CHECK_LT(watch.seconds(), 2.0);
+    }
+}
+
+TEST_CASE("TEST_CASE - subprocess::SpawnTemplate")
+{
+    SUBCASE("can spawn many processes with different arguments")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        subprocess::SpawnTemplate echo({"echo", "job"}, {.cout = PipeOption::pipe});
+        CHECK_EQ(echo.program(), subprocess::find_program("echo"));
+
+        std::vector<std::thread> threads;
+        std::vector<std::string> outputs(8U);
+        for (std::size_t i = 0U; i < outputs.size(); ++i)
+        {
+            threads.emplace_back(
+                [&echo, &outputs, i]
+                {
+                    Popen popen = echo.spawn({std::to_string(i)});
+                    outputs[i] = popen.communicate().first;
+                    (void)popen.wait();
+                });
+        }
+        for (auto& thread : threads)
+        {
+            thread.join();
+        }
+
+        for (std::size_t i = 0U; i < outputs.size(); ++i)
+        {
+            CHECK_EQ(outputs[i], "job " + std::to_string(i) + EOL);
+        }
+    }
+
+    SUBCASE("will throw for options of a single process")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        std::ostringstream output;
+        CHECK_THROWS_AS(subprocess::SpawnTemplate({"cat"}, {.cin = std::string("data")}), std::invalid_argument);
+        CHECK_THROWS_AS(subprocess::SpawnTemplate({"cat"}, {.cout = &output}), std::invalid_argument);
+        CHECK_THROWS_AS(subprocess::SpawnTemplate({"cat"}, {.cout = PipeOption::mmap_file}), std::invalid_argument);
+        CHECK_THROWS_AS(subprocess::SpawnTemplate({"missing-program-name"}), CommandNotFoundError);
+    }
+}
+
+TEST_CASE("TEST_CASE - subprocess::ProcessPool")
+{
+    SUBCASE("can serve many requests with warm children")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        ProcessPool pool({"cat"}, {.workers = 2U, .max_uses = 5U});
+        std::vector<std::future<std::string>> responses;
+        for (int i = 0; i < 50; ++i)
+        {
+            responses.push_back(pool.submit("request " + std::to_string(i)));
+        }
+
+        for (int i = 0; i < 50; ++i)
+        {
+            CHECK_EQ(responses[i].get(), "request " + std::to_string(i));
+        }
+    }
+
+    SUBCASE("can serve one request per child")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        ProcessPool pool({"cat"}, {.workers = 1U, .one_shot = true});
+        CHECK_EQ(pool.call("first"), "first");
+        CHECK_EQ(pool.call("second\nline"), "second\nline");
+    }
+
+    SUBCASE("will throw on not found")
+    {
+        CHECK_THROWS_AS(ProcessPool({"yay-322"}), CommandNotFoundError);
+    }
+}
+
+Task<std::string> read_to_end(Popen& popen)
+{
+    std::string output;
+    std::vector<char> buffer(256U);
+    ssize_t transfered = 0;
+    while ((transfered = co_await async_read(popen.cout, buffer)) > 0)
+    {
+        output.append(buffer.data(), static_cast<std::size_t>(transfered));
+    }
+    (void)co_await popen.async_wait();
+    co_return output;
+}
+
+Task<std::string> echo_twice()
+{
+    RunOptions options{.cout = PipeOption::pipe};
+    CommandLine hello = {"echo", "hello"};
+    CommandLine world = {"echo", "world"};
+    CompletedProcess first = co_await async_run(hello, options);
+    CompletedProcess second = co_await async_run(world, options);
+    co_return first.cout + second.cout;
+}
+
+TEST_CASE("TEST_CASE - subprocess::async")
+{
+    SUBCASE("can co_await reads and the exit of a subprocess")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        Popen popen = RunBuilder({"echo", "hello", "world"}).cout(PipeOption::pipe).popen();
+        CHECK_EQ(sync_wait(read_to_end(popen)), "hello world" EOL);
+        CHECK_EQ(popen.returncode, 0);
+    }
+
+    SUBCASE("can co_await async_run with a custom executor")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        std::atomic<int> resumed{0};
+        set_async_executor(
+            [&resumed](std::coroutine_handle<> handle)
+            {
+                ++resumed;
+                handle.resume();
+            });
+        CHECK_EQ(sync_wait(echo_twice()), "hello" EOL "world" EOL);
+        set_async_executor({});
+        CHECK_GT(resumed.load(), 0);
+    }
+
+    SUBCASE("can co_await async_run with a callback redirection")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        std::string input(std::size_t{1} << 16U, 'x');
+        for (int i = 0; i < 10; ++i)
+        {
+            std::string errors;
+            auto callback = subprocess::OutputCallback::chunks([&errors](std::string_view chunk) { errors += chunk; });
+            CompletedProcess completed = sync_wait(
+                async_run({"cat", "--output-stderr"}, {.cin = input, .cout = PipeOption::pipe, .cerr = callback}));
+            CHECK_EQ(completed.returncode, 0);
+            CHECK(completed.cout.empty());
+            CHECK_EQ(errors, input);
+        }
+    }
+
+    SUBCASE("will throw on non-zero exit")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        CHECK_THROWS_AS(sync_wait(async_run({"sleep"}, {.cerr = PipeOption::pipe, .raise_on_nonzero = true})),
+                        CalledProcessError);
+    }
+}
+
 TEST_CASE("TEST_CASE - subprocess::RunBuilder")
 {
     SUBCASE("can redirect subprocess output to CompletedProcess cout")
@@ -339,6 +1087,55 @@ TEST_CASE("TEST_CASE - subprocess::RunBuilder")
         CHECK_EQ(cp.cout, "world" EOL);
     }
 
+    SUBCASE("can share an environment block with overrides")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        subprocess::EnvMap env = subprocess::current_env_copy();
+        env["HELLO"] = "world";
+        env["GOODBYE"] = "moon";
+        subprocess::EnvBlock base(env);
+        subprocess::EnvBlock changed = base.with({{"HELLO", "there"}, {"GOODBYE", ""}, {"ADDED", "yes"}});
+
+        auto printenv = [](const subprocess::EnvBlock& block, const std::string& name)
+        { return subprocess::RunBuilder({"printenv", name}).cout(PipeOption::pipe).env(block).run(); };
+
+        CHECK_EQ(printenv(base, "HELLO").cout, "world" EOL);
+        CHECK_EQ(printenv(base, "GOODBYE").cout, "moon" EOL);
+        CHECK_EQ(printenv(changed, "HELLO").cout, "there" EOL);
+        CHECK_EQ(printenv(changed, "GOODBYE").returncode, 1);
+        CHECK_EQ(printenv(changed, "ADDED").cout, "yes" EOL);
+
+        subprocess::EnvMap expected = env;
+        expected["HELLO"] = "there";
+        expected["ADDED"] = "yes";
+        (void)expected.erase("GOODBYE");
+        CHECK_EQ(changed.to_map(), expected);
+        CHECK_EQ(subprocess::EnvBlock().with({{"HELLO", "again"}}).to_map().at("HELLO"), "again");
+    }
+
+    SUBCASE("can share the spawned arguments")
+    {
+        subprocess::EnvGuard guard;
+        prepend_this_to_path();
+
+        CommandLine command{"echo", "hello world", "x"};
+        auto popen = RunBuilder(command).cout(PipeOption::pipe).popen();
+        REQUIRE(popen.argv());
+        CHECK_EQ(popen.argv()->size(), 3U);
+        CHECK_EQ((*popen.argv())[1U], "hello world");
+        CHECK_EQ(popen.argv()->argv()[3U], nullptr);
+        CHECK_EQ(subprocess::run(popen).argv, popen.argv());
+        popen.close();
+        CHECK(!popen.argv());
+
+        auto cp = subprocess::run(command, {.cout = PipeOption::pipe});
+        CHECK(is_equal(cp.args, command));
+        CHECK(is_equal(cp.argv->to_command_line(), command));
+        CHECK_EQ(cp.argv->windows_command_line(), ProcessBuilder::windows_args(command));
+    }
+
     SUBCASE("can redirect cerr to cout")
     {
         subprocess::EnvGuard guard;
@@ -412,7 +1209,7 @@ void signal_handler(int signal)
     {
         std::cout << "Ctrl+C received. Cleaning up and exiting." << std::endl;
         // Perform cleanup or other actions if needed
-        g_signal_received.test_and_set();
+        g_signal_received = true;
     }
 }
 
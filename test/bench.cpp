@@ -0,0 +1,316 @@
+// Benchmarks of spawning, piping and lookups, driven by the cat and echo helpers next to this executable.
+//
+// Prints one JSON object, so results can be compared between versions:
+//
+//     bench [--iterations N] [--output FILE]
+//
+// N scales every benchmark, default 200. Times are in microseconds unless the name says otherwise.
+
+#include <algorithm>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <subprocess.h>
+
+namespace
+{
+using subprocess::PipeOption;
+using subprocess::Popen;
+using subprocess::RunBuilder;
+using subprocess::StopWatch;
+
+struct Result
+{
+    std::string name;
+    std::vector<std::pair<std::string, double>> values;
+};
+
+double percentile(std::vector<double> samples, double fraction)
+{
+    if (samples.empty())
+    {
+        return 0.0;
+    }
+    std::sort(samples.begin(), samples.end());
+    auto index = static_cast<std::size_t>(fraction * static_cast<double>(samples.size() - 1U) + 0.5);
+    return samples[std::min(index, samples.size() - 1U)];
+}
+
+double mean(const std::vector<double>& samples)
+{
+    double sum = 0.0;
+    for (double sample : samples)
+    {
+        sum += sample;
+    }
+    return samples.empty() ? 0.0 : sum / static_cast<double>(samples.size());
+}
+
+Result latency(std::string name, const std::vector<double>& seconds)
+{
+    std::vector<double> us;
+    us.reserve(seconds.size());
+    for (double sample : seconds)
+    {
+        us.push_back(sample * 1e6);
+    }
+    return {std::move(name),
+            {{"samples", static_cast<double>(us.size())},
+             {"mean_us", mean(us)},
+             {"p50_us", percentile(us, 0.5)},
+             {"p90_us", percentile(us, 0.9)},
+             {"p99_us", percentile(us, 0.99)},
+             {"max_us", percentile(us, 1.0)}}};
+}
+
+void spawn_echo(const subprocess::EnvBlock& env = {})
+{
+    (void)subprocess::run({"echo"}, {.cout = PipeOption::none, .raise_on_nonzero = true, .env = env});
+}
+
+Result bench_spawn_wait(int iterations)
+{
+    spawn_echo(); // warms up the find_program cache and the page cache
+    std::vector<double> samples;
+    for (int i = 0; i < iterations; ++i)
+    {
+        StopWatch watch;
+        spawn_echo();
+        samples.push_back(watch.seconds());
+    }
+    return latency("spawn_wait", samples);
+}
+
+Result bench_spawn_template(int iterations)
+{
+    subprocess::SpawnTemplate echo({"echo"}, {.cout = PipeOption::none});
+    std::vector<double> samples;
+    for (int i = 0; i < iterations; ++i)
+    {
+        StopWatch watch;
+        Popen popen = echo.spawn({"bench"});
+        (void)popen.wait();
+        samples.push_back(watch.seconds());
+    }
+    return latency("spawn_template", samples);
+}
+
+Result bench_spawn_threads(int iterations, unsigned threads)
+{
+    int per_thread = std::max(1, iterations / static_cast<int>(threads));
+    std::vector<std::thread> workers;
+    StopWatch watch;
+    for (unsigned t = 0U; t < threads; ++t)
+    {
+        workers.emplace_back(
+            [per_thread]
+            {
+                for (int i = 0; i < per_thread; ++i)
+                {
+                    spawn_echo();
+                }
+            });
+    }
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+    double elapsed = watch.seconds();
+    double spawns = static_cast<double>(per_thread) * threads;
+    return {"spawn_threads", {{"threads", threads}, {"spawns", spawns}, {"spawns_per_second", spawns / elapsed}}};
+}
+
+/** @brief Pushes payload through cat, with run() capturing or the IoReactor redirecting. */
+Result bench_throughput(bool redirect, std::size_t size, int iterations)
+{
+    std::string payload(size, 'x');
+    auto input = std::as_bytes(std::span{payload});
+
+    // About 64 MiB in total for each size, but no more runs than iterations.
+    auto runs = static_cast<int>(
+        std::clamp<std::size_t>((std::size_t{64U} << 20U) / size, 1U, static_cast<std::size_t>(iterations)));
+    StopWatch watch;
+    for (int i = 0; i < runs; ++i)
+    {
+        std::size_t received = 0U;
+        if (redirect)
+        {
+            std::ostringstream output;
+            subprocess::Popen popen = RunBuilder({"cat"}).cin(input).cout(&output).popen();
+            popen.close();
+            received = output.str().size();
+        }
+        else
+        {
+            received = RunBuilder({"cat"}).cin(input).cout(PipeOption::pipe).run().cout.size();
+        }
+
+        if (received != size)
+        {
+            throw std::runtime_error("cat returned " + std::to_string(received) + " of " + std::to_string(size));
+        }
+    }
+    double elapsed = watch.seconds();
+    double bytes = static_cast<double>(size) * runs;
+    return {redirect ? "redirect_throughput" : "capture_throughput",
+            {{"payload_bytes", static_cast<double>(size)},
+             {"runs", static_cast<double>(runs)},
+             {"mib_per_second", bytes / elapsed / (1U << 20U)}}};
+}
+
+Result bench_env_block(std::size_t variables, int iterations)
+{
+    subprocess::EnvMap extra;
+    for (std::size_t i = 0U; i < variables; ++i)
+    {
+        extra["SUBPROCESS_BENCH_" + std::to_string(i)] = std::string(32U, 'v');
+    }
+
+    StopWatch build_watch;
+    subprocess::EnvBlock block = subprocess::EnvBlock{}.with(extra);
+    double build = build_watch.seconds();
+
+    int runs = std::max(1, iterations / 4);
+    std::vector<double> samples;
+    for (int i = 0; i < runs; ++i)
+    {
+        StopWatch watch;
+        spawn_echo(block);
+        samples.push_back(watch.seconds());
+    }
+    Result result = latency("env_block", samples);
+    result.values.insert(result.values.begin(),
+                         {{"variables", static_cast<double>(variables)}, {"build_us", build * 1e6}});
+    return result;
+}
+
+Result bench_find_program(int iterations)
+{
+    int lookups = iterations * 100;
+    (void)subprocess::find_program("echo");
+    (void)subprocess::find_program("subprocess-bench-missing");
+
+    StopWatch hit_watch;
+    for (int i = 0; i < lookups; ++i)
+    {
+        (void)subprocess::find_program("echo");
+    }
+    double hit = hit_watch.seconds();
+
+    StopWatch miss_watch;
+    for (int i = 0; i < lookups; ++i)
+    {
+        (void)subprocess::find_program("subprocess-bench-missing");
+    }
+    double miss = miss_watch.seconds();
+
+    StopWatch uncached_watch;
+    for (int i = 0; i < iterations; ++i)
+    {
+        subprocess::find_program_clear_cache();
+        (void)subprocess::find_program("echo");
+    }
+    double uncached = uncached_watch.seconds();
+
+    return {"find_program",
+            {{"hit_ns", hit / lookups * 1e9},
+             {"miss_ns", miss / lookups * 1e9},
+             {"uncached_us", uncached / iterations * 1e6}}};
+}
+
+std::string to_json(const std::vector<Result>& results, int iterations)
+{
+    std::ostringstream json;
+    json.precision(10);
+    json << "{\n  \"iterations\": " << iterations << ",\n  \"results\": [";
+    for (std::size_t i = 0U; i < results.size(); ++i)
+    {
+        json << (i == 0U ? "\n" : ",\n") << "    {\"name\": \"" << results[i].name << "\"";
+        for (const auto& [key, value] : results[i].values)
+        {
+            json << ", \"" << key << "\": " << value;
+        }
+        json << "}";
+    }
+    json << "\n  ]\n}\n";
+    return json.str();
+}
+} // namespace
+
+int main(int argc, char** argv)
+{
+    int iterations = 200;
+    std::string output;
+    for (int i = 1; i < argc; i += 2)
+    {
+        // Every option takes a value, one without it gets the usage.
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (has_value && arg == "--iterations")
+        {
+            iterations = std::max(1, std::stoi(argv[i + 1]));
+        }
+        else if (has_value && arg == "--output")
+        {
+            output = argv[i + 1];
+        }
+        else
+        {
+            std::cerr << "usage: bench [--iterations N] [--output FILE]\n";
+            return 2;
+        }
+    }
+
+    // The helpers next to this executable come first, like in the tests.
+    std::string exe_dir = std::filesystem::path(subprocess::abspath(argv[0])).parent_path().string();
+    subprocess::cenv["PATH"] = exe_dir + subprocess::kPathDelimiter + subprocess::cenv["PATH"].to_string();
+
+    std::vector<Result> results;
+    try
+    {
+        results.push_back(bench_spawn_wait(iterations));
+        results.push_back(bench_spawn_template(iterations));
+        for (unsigned threads : {1U, std::max(2U, std::thread::hardware_concurrency())})
+        {
+            results.push_back(bench_spawn_threads(iterations, threads));
+        }
+        for (bool redirect : {false, true})
+        {
+            for (std::size_t size : {std::size_t{4U} << 10U, std::size_t{64U} << 10U, std::size_t{1U} << 20U,
+                                     std::size_t{16U} << 20U})
+            {
+                results.push_back(bench_throughput(redirect, size, iterations));
+            }
+        }
+        for (std::size_t variables : {0U, 100U, 1000U, 10000U})
+        {
+            results.push_back(bench_env_block(variables, iterations));
+        }
+        results.push_back(bench_find_program(iterations));
+    }
+    catch (const std::exception& error)
+    {
+        std::cerr << "bench failed: " << error.what() << '\n';
+        return 1;
+    }
+
+    std::string json = to_json(results, iterations);
+    if (output.empty())
+    {
+        std::cout << json;
+    }
+    else
+    {
+        std::ofstream{output} << json;
+    }
+    return 0;
+}
@@ -6,6 +6,7 @@
 #include <io.h>
 #else
 #include <unistd.h>
+#define _read read
 #endif
 
 template <typename T, typename V> bool contains(const std::vector<T>& container, const V& value)
@@ -43,7 +44,7 @@ int main(int argc, char** argv)
         {
             auto transfered = _read(0, &buffer[0], buffer.size());
 
-            if (transfered == 0)
+            if (transfered <= 0)
                 break;
 
             if (output_err)
@@ -23,10 +23,11 @@ BOOL CtrlHandler(DWORD fdwCtrlType)
 }
 
 #else
+#include <atomic>
 #include <csignal>
 
 // Global flag to indicate whether Ctrl+C was pressed
-volatile std::sig_atomic_t g_signal_received = false;
+std::atomic_flag g_signal_received = ATOMIC_FLAG_INIT;
 
 void signal_handler(int signal)
 {
@@ -0,0 +1,327 @@
+// Concurrent stress and scalability run of Popen and run(), driven by the cat, echo and sleep helpers next to this
+// executable.
+//
+//     stress [--threads N] [--jobs N] [--payload BYTES] [--output FILE]
+//
+// Each of N threads (default: the number of cores, at most 64) runs its share of the jobs, in turn a captured cat
+// of a payload unique to the job, an echo through Popen, a cat through the IoReactor with an InputProducer and an
+// OutputCallback, and a sleep that runs into its timeout. Any lost or interleaved output, leaked handle or zombie
+// is an error, and the exit code is 1. The same jobs are then run with 1, 2, 4, ... N threads, and the throughput
+// of each is printed as one JSON object.
+//
+// Built with -DSUBPROCESS_SANITIZE_THREAD=ON, the run doubles as a data race check under ThreadSanitizer.
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <span>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <subprocess.h>
+
+#ifdef _WIN32
+#define EOL "\r\n"
+#else
+#include <sys/wait.h>
+#define EOL "\n"
+#endif
+
+namespace
+{
+using subprocess::PipeOption;
+using subprocess::Popen;
+using subprocess::RunBuilder;
+using subprocess::StopWatch;
+
+/** @brief Collects the failures of all threads, reporting the first few. */
+class Failures
+{
+public:
+    void add(const std::string& message)
+    {
+        std::lock_guard lock(m_mutex);
+        if (++m_count <= 10U)
+        {
+            std::cerr << "stress: " << message << '\n';
+        }
+    }
+
+    [[nodiscard]] std::size_t count() const
+    {
+        std::lock_guard lock(m_mutex);
+        return m_count;
+    }
+
+private:
+    mutable std::mutex m_mutex;
+    std::size_t m_count{0U};
+};
+
+/** @brief Lines naming the job, so output of another job, or out of order, shows. */
+std::string make_payload(int job, std::size_t size)
+{
+    std::string result;
+    result.reserve(size + 64U);
+    for (int line = 0; result.size() < size; ++line)
+    {
+        result += "job " + std::to_string(job) + " line " + std::to_string(line) + '\n';
+    }
+    result.resize(size);
+    return result;
+}
+
+void capture_job(int job, std::size_t payload, Failures& failures)
+{
+    std::string input = make_payload(job, payload);
+    auto cp = RunBuilder({"cat"}).cin(std::as_bytes(std::span{input})).cout(PipeOption::pipe).run();
+    if (cp.returncode != 0 || cp.cout != input)
+    {
+        failures.add("cat of job " + std::to_string(job) + " returned " + std::to_string(cp.cout.size()) + " of " +
+                     std::to_string(input.size()) + " bytes, exit " + std::to_string(cp.returncode));
+    }
+}
+
+void popen_job(int job, Failures& failures)
+{
+    std::string word = "job-" + std::to_string(job);
+    Popen popen = RunBuilder({"echo", word}).cout(PipeOption::pipe).popen();
+    auto [out, err] = popen.communicate();
+    if (popen.wait() != 0 || out != word + EOL)
+    {
+        failures.add("echo of job " + std::to_string(job) + " returned \"" + out + "\"");
+    }
+}
+
+void reactor_job(int job, std::size_t payload, Failures& failures)
+{
+    std::string input = make_payload(job, payload);
+    std::size_t offset = 0U;
+    std::string output;
+    Popen popen = RunBuilder({"cat"})
+                      .cin(subprocess::InputProducer(
+                          [&input, &offset]()
+                          {
+                              // Record sized pieces, so both batching and writes in place are exercised.
+                              std::size_t size = std::min<std::size_t>(input.size() - offset, 100U + offset % 90000U);
+                              auto piece = std::as_bytes(std::span{input}.subspan(offset, size));
+                              offset += size;
+                              return piece;
+                          }))
+                      .cout(subprocess::OutputCallback::chunks([&output](std::string_view chunk) { output += chunk; }))
+                      .popen();
+    popen.close();
+    if (output != input)
+    {
+        failures.add("redirected cat of job " + std::to_string(job) + " returned " + std::to_string(output.size()) +
+                     " of " + std::to_string(input.size()) + " bytes");
+    }
+}
+
+void timeout_job(int job, Failures& failures)
+{
+    try
+    {
+        (void)subprocess::run({"sleep", "10"}, {.timeout = 0.05});
+        failures.add("sleep of job " + std::to_string(job) + " did not time out");
+    }
+    catch (const subprocess::TimeoutExpired&)
+    {
+    }
+}
+
+void run_job(int job, std::size_t payload, Failures& failures)
+{
+    try
+    {
+        switch (job % 4)
+        {
+            case 0:
+                capture_job(job, payload, failures);
+                break;
+            case 1:
+                popen_job(job, failures);
+                break;
+            case 2:
+                reactor_job(job, payload, failures);
+                break;
+            default:
+                // Only one in 16 jobs, they mostly wait.
+                if (job % 16 == 3)
+                {
+                    timeout_job(job, failures);
+                }
+                else
+                {
+                    capture_job(job, payload / 16U, failures);
+                }
+                break;
+        }
+    }
+    catch (const std::exception& error)
+    {
+        failures.add("job " + std::to_string(job) + " threw: " + error.what());
+    }
+}
+
+/** @brief Runs the jobs on threads, each taking the next job until none is left. */
+double run_jobs(unsigned threads, int jobs, std::size_t payload, Failures& failures)
+{
+    std::atomic<int> next{0};
+    std::vector<std::thread> workers;
+    StopWatch watch;
+    for (unsigned t = 0U; t < threads; ++t)
+    {
+        workers.emplace_back(
+            [&next, jobs, payload, &failures]
+            {
+                for (int job = next++; job < jobs; job = next++)
+                {
+                    run_job(job, payload, failures);
+                }
+            });
+    }
+    for (auto& worker : workers)
+    {
+        worker.join();
+    }
+    return watch.seconds();
+}
+
+/** @brief Handles of this process, to find leaks. -1 if they cannot be counted. */
+long open_handles()
+{
+#ifdef _WIN32
+    DWORD count = 0U;
+    return GetProcessHandleCount(GetCurrentProcess(), &count) ? static_cast<long>(count) : -1L;
+#else
+    std::error_code ec;
+    long count = 0L;
+    for (auto it = std::filesystem::directory_iterator("/dev/fd", ec); !ec && it != std::filesystem::end(it);
+         it.increment(ec))
+    {
+        ++count;
+    }
+    return ec ? -1L : count;
+#endif
+}
+
+/** @brief Reaps any child left behind. @return The number of zombies found. */
+int reap_zombies()
+{
+    int zombies = 0;
+#ifndef _WIN32
+    int status = 0;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        ++zombies;
+    }
+    if (pid == 0)
+    {
+        // A child that has not exited yet is a leak as well.
+        ++zombies;
+    }
+#endif
+    return zombies;
+}
+} // namespace
+
+int main(int argc, char** argv)
+{
+    unsigned threads = std::clamp(std::thread::hardware_concurrency(), 2U, 64U);
+    int jobs = 2000;
+    std::size_t payload = std::size_t{256U} << 10U;
+    std::string output;
+    for (int i = 1; i < argc; i += 2)
+    {
+        // Every option takes a value, one without it gets the usage.
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (has_value && arg == "--threads")
+        {
+            threads = static_cast<unsigned>(std::max(1, std::stoi(argv[i + 1])));
+        }
+        else if (has_value && arg == "--jobs")
+        {
+            jobs = std::max(1, std::stoi(argv[i + 1]));
+        }
+        else if (has_value && arg == "--payload")
+        {
+            payload = std::max<std::size_t>(1U, std::stoul(argv[i + 1]));
+        }
+        else if (has_value && arg == "--output")
+        {
+            output = argv[i + 1];
+        }
+        else
+        {
+            std::cerr << "usage: stress [--threads N] [--jobs N] [--payload BYTES] [--output FILE]\n";
+            return 2;
+        }
+    }
+
+    // The helpers next to this executable come first, like in the tests.
+    std::string exe_dir = std::filesystem::path(subprocess::abspath(argv[0])).parent_path().string();
+    subprocess::cenv["PATH"] = exe_dir + subprocess::kPathDelimiter + subprocess::cenv["PATH"].to_string();
+
+    Failures failures;
+    // Warms up the find_program cache, and starts the IoReactor, whose wake-up pipes stay open.
+    for (int job = 0; job < 4; ++job)
+    {
+        run_job(job, payload, failures);
+    }
+    long handles = open_handles();
+
+    std::vector<unsigned> counts;
+    for (unsigned count = 1U; count < threads; count *= 2U)
+    {
+        counts.push_back(count);
+    }
+    counts.push_back(threads);
+
+    std::vector<std::pair<unsigned, double>> scaling;
+    for (unsigned count : counts)
+    {
+        scaling.emplace_back(count, run_jobs(count, jobs, payload, failures));
+    }
+
+    // Redirected output is complete before close() returns, so nothing may be left open by now.
+    if (long now = open_handles(); handles >= 0 && now > handles)
+    {
+        failures.add(std::to_string(now - handles) + " handles leaked");
+    }
+
+    if (int zombies = reap_zombies(); zombies > 0)
+    {
+        failures.add(std::to_string(zombies) + " children left behind");
+    }
+
+    std::ostringstream json;
+    json << "{\n  \"jobs\": " << jobs << ",\n  \"payload_bytes\": " << payload << ",\n  \"failures\": "
+         << failures.count() << ",\n  \"scaling\": [";
+    for (std::size_t i = 0U; i < scaling.size(); ++i)
+    {
+        auto [count, seconds] = scaling[i];
+        json << (i == 0U ? "\n" : ",\n") << "    {\"threads\": " << count << ", \"jobs_per_second\": " << jobs / seconds
+             << ", \"speedup\": " << scaling[0U].second / seconds << "}";
+    }
+    json << "\n  ]\n}\n";
+
+    if (output.empty())
+    {
+        std::cout << json.str();
+    }
+    else
+    {
+        std::ofstream{output} << json.str();
+    }
+    return failures.count() == 0U ? 0 : 1;
+}